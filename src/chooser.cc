@@ -1,10 +1,20 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "global.h"
 #include "chooser.h"
 #include "filemgr.h"
+#include "fuzzy.h"
+#include "projectindex.h"
 #include "util.h"
+#include "worker.h"
 
 using std::make_shared;
 using std::shared_ptr;
@@ -12,39 +22,413 @@ using std::string;
 using std::vector;
 using sigc::mem_fun;
 
+// The chooser lists at most this many recent files, the highest frecency
+// first, above the files in the directory.
+static const unsigned int MAX_RECENT_ROWS = 10;
+
+// The directory is listed in batches of this many entries.  The first one
+// is smaller so that the list shows up right away.
+static const unsigned int FIRST_BATCH_SIZE = 256;
+static const unsigned int BATCH_SIZE = 4096;
+
+// In the project mode, changes to the project index are shown after this
+// long, so that a burst of them costs one update.
+static const unsigned int PROJECT_REFRESH_MS = 100;
+
+// Without a pattern, the chooser lists the kinds in this order.
+enum class CandidateKind: unsigned char {
+    Recent,
+    File,
+    Directory,
+    Dotfile,	// listed only if the pattern starts with '.'
+};
+
+// Shown in the first column.
+static const char* kindName(CandidateKind kind)
+{
+    switch (kind) {
+    case CandidateKind::Recent:
+	return "recent";
+    case CandidateKind::File:
+	return "file";
+    case CandidateKind::Directory:
+	return "directory";
+    case CandidateKind::Dotfile:
+	return "dot";
+    }
+    return "";
+}
+
+// Shared between a Chooser and its lister job running on a worker thread.
+// Once 'cancelled' is set, nothing posted by the job touches the Chooser.
+struct ListingState
+{
+    ListingState() : cancelled{false} {}
+    std::atomic<bool> cancelled;
+};
+
+// The names the chooser may list, packed in a single buffer as in
+// ProjectIndex: besides the name, each costs 13 bytes.  A name is a full
+// path if recent, and ends with '/' if a directory.
+class CandidateTable
+{
+public:
+    typedef vector<unsigned int>::size_type size_type;
+
+    void append(CandidateKind kind, const string& name);
+    void append(const CandidateTable& other);
+    void clear() { *this = CandidateTable(); }	// and free the memory
+    bool empty() const { return offsets.empty(); }
+    CandidateKind getKind(size_type i) const { return kinds[i]; }
+    unsigned int getLength(size_type i) const;
+    FuzzyCharMask getMask(size_type i) const { return masks[i]; }
+    const char* getName(size_type i) const {
+	return names.data() + offsets[i];
+    }
+    size_type size() const { return offsets.size(); }
+private:
+    string names;	// each followed by '\0'
+    vector<unsigned int> offsets;	// into names
+    vector<CandidateKind> kinds;
+    vector<FuzzyCharMask> masks;
+};
+
+void CandidateTable::append(CandidateKind kind, const string& name)
+{
+    offsets.push_back(names.size());
+    names += name;
+    names += '\0';
+    kinds.push_back(kind);
+    masks.push_back(fuzzyCharMask(name.data(), name.size()));
+}
+
+void CandidateTable::append(const CandidateTable& other)
+{
+    const unsigned int base = names.size();
+    for (auto offset: other.offsets)
+	offsets.push_back(base + offset);
+    names += other.names;
+    kinds.insert(end(kinds), begin(other.kinds), end(other.kinds));
+    masks.insert(end(masks), begin(other.masks), end(other.masks));
+}
+
+unsigned int CandidateTable::getLength(size_type i) const
+{
+    const auto next = (i + 1 < offsets.size()) ? offsets[i + 1] :
+	names.size();
+    return next - offsets[i] - 1;
+}
+
 //// tree model ////
 
 class ModelColumns: public Gtk::TreeModelColumnRecord
 {
 public:
-    ModelColumns() { add(type); add(name); add(rowNum); }
+    ModelColumns() { add(type); add(name); }
 
     Gtk::TreeModelColumn<Glib::ustring> type;
     Gtk::TreeModelColumn<Glib::ustring> name;
-    Gtk::TreeModelColumn<unsigned int> rowNum;	// hidden field
 };
 
+// The rows of the chooser, each an index into the candidates and nothing
+// more.  The view asks for the text of the rows it shows, when it shows
+// them.  While update() runs, the rows are split around a gap: the new
+// rows before it, and the old ones yet to be looked at after it, reversed,
+// so that each step is a push or a pop.
+class ChooserModel: public Glib::Object, public Gtk::TreeModel
+{
+public:
+    static Glib::RefPtr<ChooserModel> create(
+	const CandidateTable& candidates);
+    void clear();
+    unsigned int getRow(unsigned int pos) const;
+    unsigned int size() const { return head.size() + tail.size(); }
+    void update(const vector<unsigned int>& newRows);
+
+    const ModelColumns columns;
+protected:
+    ChooserModel(const CandidateTable& candidates);
+    virtual Gtk::TreeModelFlags get_flags_vfunc() const;
+    virtual int get_n_columns_vfunc() const;
+    virtual GType get_column_type_vfunc(int index) const;
+    virtual void get_value_vfunc(const iterator& iter, int column,
+	Glib::ValueBase& value) const;
+    virtual bool iter_next_vfunc(const iterator& iter,
+	iterator& iterNext) const;
+    virtual bool iter_children_vfunc(const iterator& parent,
+	iterator& iter) const;
+    virtual bool iter_has_child_vfunc(const iterator& iter) const;
+    virtual int iter_n_children_vfunc(const iterator& iter) const;
+    virtual int iter_n_root_children_vfunc() const;
+    virtual bool iter_nth_child_vfunc(const iterator& parent, int n,
+	iterator& iter) const;
+    virtual bool iter_nth_root_child_vfunc(int n, iterator& iter) const;
+    virtual bool iter_parent_vfunc(const iterator& child,
+	iterator& iter) const;
+    virtual Path get_path_vfunc(const iterator& iter) const;
+    virtual bool get_iter_vfunc(const Path& path, iterator& iter) const;
+    virtual bool iter_is_valid(const iterator& iter) const;
+private:
+    void dropRow();
+    void insertRow(unsigned int c);
+    void keepRow();
+    static Path makePath(unsigned int pos);
+    static unsigned int posOf(const iterator& iter);
+    bool setIter(iterator& iter, unsigned int pos) const;
+
+    const CandidateTable& candidates;
+    vector<unsigned int> head;	// the rows before the gap
+    vector<unsigned int> tail;	// after the gap, reversed; empty if none
+    int stamp;	// changes with the rows, invalidating the iterators
+};
+
+ChooserModel::ChooserModel(const CandidateTable& candidates_)
+    : Glib::ObjectBase{typeid(ChooserModel)}, Glib::Object{},
+      candidates{candidates_}, stamp{1}
+{
+}
+
+Glib::RefPtr<ChooserModel> ChooserModel::create(
+    const CandidateTable& candidates)
+{
+    return Glib::RefPtr<ChooserModel>(new ChooserModel(candidates));
+}
+
+// Remove every row, from the bottom up.
+void ChooserModel::clear()
+{
+    while (!head.empty()) {
+	head.pop_back();
+	++stamp;
+	row_deleted(makePath(head.size()));
+    }
+}
+
+// @return	the candidate shown in row 'pos'
+unsigned int ChooserModel::getRow(unsigned int pos) const
+{
+    if (pos < head.size())
+	return head[pos];
+    return tail[tail.size() - 1 - (pos - head.size())];
+}
+
+// Turn the rows into 'newRows' by inserting and removing rows, so that the
+// view updates only what has changed.  Typing a character mostly removes
+// rows.  A row out of order is removed, and inserted again where it
+// belongs.  Each step is O(1) here, and O(log n) in the view.
+void ChooserModel::update(const vector<unsigned int>& newRows)
+{
+    vector<bool> wanted(candidates.size(), false);
+    for (auto c: newRows)
+	wanted[c] = true;
+    vector<bool> shown(candidates.size(), false);	// and not dropped yet
+    for (auto c: head)
+	shown[c] = wanted[c];
+    tail.assign(head.rbegin(), head.rend());
+    head.clear();
+    head.reserve(newRows.size());
+
+    for (auto c: newRows) {
+	while (!tail.empty() && (tail.back() != c) &&
+		(!wanted[tail.back()] || shown[c])) {
+	    shown[tail.back()] = false;
+	    dropRow();
+	}
+	if (!tail.empty() && (tail.back() == c))
+	    keepRow();
+	else insertRow(c);
+    }
+    while (!tail.empty())
+	dropRow();
+}
+
+// Remove the row after the gap.
+void ChooserModel::dropRow()
+{
+    tail.pop_back();
+    ++stamp;
+    row_deleted(makePath(head.size()));
+}
+
+// Insert a row for candidate 'c' before the gap.
+void ChooserModel::insertRow(unsigned int c)
+{
+    head.push_back(c);
+    ++stamp;
+    iterator iter;
+    setIter(iter, head.size() - 1);
+    row_inserted(makePath(head.size() - 1), iter);
+}
+
+// Move the gap past the row after it.  The row stays where it is.
+void ChooserModel::keepRow()
+{
+    head.push_back(tail.back());
+    tail.pop_back();
+}
+
+Gtk::TreeModel::Path ChooserModel::makePath(unsigned int pos)
+{
+    Path path;
+    path.push_back(pos);
+    return path;
+}
+
+unsigned int ChooserModel::posOf(const iterator& iter)
+{
+    return GPOINTER_TO_UINT(iter.gobj()->user_data);
+}
+
+// Point 'iter' to row 'pos'.
+// @return	false, leaving 'iter' invalid, if there's no such row
+bool ChooserModel::setIter(iterator& iter, unsigned int pos) const
+{
+    if (pos >= size()) {
+	iter = iterator();
+	return false;
+    }
+    iter.set_stamp(stamp);
+    iter.gobj()->user_data = GUINT_TO_POINTER(pos);
+    return true;
+}
+
+Gtk::TreeModelFlags ChooserModel::get_flags_vfunc() const
+{
+    return Gtk::TREE_MODEL_LIST_ONLY;
+}
+
+int ChooserModel::get_n_columns_vfunc() const
+{
+    return columns.size();
+}
+
+GType ChooserModel::get_column_type_vfunc(int index) const
+{
+    return columns.types()[index];
+}
+
+void ChooserModel::get_value_vfunc(const iterator& iter, int column,
+    Glib::ValueBase& value) const
+{
+    if (!iter_is_valid(iter))
+	return;
+    const unsigned int c = getRow(posOf(iter));
+    Glib::Value<Glib::ustring> text;
+    text.init(Glib::Value<Glib::ustring>::value_type());
+    if (column == columns.type.index())
+	text.set(kindName(candidates.getKind(c)));
+    else text.set(candidates.getName(c));
+    value.init(Glib::Value<Glib::ustring>::value_type());
+    value = text;
+}
+
+bool ChooserModel::iter_next_vfunc(const iterator& iter,
+    iterator& iterNext) const
+{
+    if (!iter_is_valid(iter)) {
+	iterNext = iterator();
+	return false;
+    }
+    return setIter(iterNext, posOf(iter) + 1);
+}
+
+bool ChooserModel::iter_children_vfunc(const iterator& parent,
+    iterator& iter) const
+{
+    iter = iterator();
+    return false;	// The rows have no children.
+}
+
+bool ChooserModel::iter_has_child_vfunc(const iterator& iter) const
+{
+    return false;
+}
+
+int ChooserModel::iter_n_children_vfunc(const iterator& iter) const
+{
+    return 0;
+}
+
+int ChooserModel::iter_n_root_children_vfunc() const
+{
+    return size();
+}
+
+bool ChooserModel::iter_nth_child_vfunc(const iterator& parent, int n,
+    iterator& iter) const
+{
+    iter = iterator();
+    return false;
+}
+
+bool ChooserModel::iter_nth_root_child_vfunc(int n, iterator& iter) const
+{
+    if (n < 0) {
+	iter = iterator();
+	return false;
+    }
+    return setIter(iter, n);
+}
+
+bool ChooserModel::iter_parent_vfunc(const iterator& child,
+    iterator& iter) const
+{
+    iter = iterator();
+    return false;
+}
+
+Gtk::TreeModel::Path ChooserModel::get_path_vfunc(const iterator& iter) const
+{
+    return makePath(posOf(iter));
+}
+
+bool ChooserModel::get_iter_vfunc(const Path& path, iterator& iter) const
+{
+    if ((path.size() != 1) || (path[0] < 0)) {
+	iter = iterator();
+	return false;
+    }
+    return setIter(iter, path[0]);
+}
+
+bool ChooserModel::iter_is_valid(const iterator& iter) const
+{
+    return (iter.get_stamp() == stamp) && (posOf(iter) < size());
+}
+
 //// impl class ////
 
 class Chooser::Impl
 {
 public:
     Impl(Chooser* parent, string* result);
-    ~Impl() = default;
+    ~Impl();
     void init(const string& args);
-    void buildListStore(const string& pattern);
-    bool fileNameMatcher(const string& filename, const string& pattern);
-    void getFilesOnFS(const string& directory,
-	shared_ptr<vector<string>> dotfiles,
-	shared_ptr<vector<string>> regulars,
-	shared_ptr<vector<string>> directories);
+    void addCandidates(const CandidateTable& batch);
+    void addProjectPaths();
+    void buildList(const string& pattern);
+    const vector<FuzzyMatch>& findMatches(const string& pattern);
     void highlightLine(unsigned int lineNum);
+    void matchCandidate(const FuzzyPattern& fuzzy, unsigned int i,
+	vector<FuzzyMatch>& matches);
+    void rankMatches(const FuzzyPattern& fuzzy, vector<FuzzyMatch>& matches,
+	vector<FuzzyMatch>::size_type numRanked);
+    void showMatches(const string& pattern, bool keepSelection);
+    void startListing();
+    void toggleProjectMode();
+    static void listerJob(Impl* self, shared_ptr<ListingState> state,
+	const string& dir);
+
     void entryOnActivate();
     void entryBufferOnDeletedText(unsigned int placeholder1,
         unsigned int placeholder2);
     void entryBufferOnInsertedText(unsigned int placeholder1,
         const char* placeholder2, unsigned int placeholder3);
     bool entryOnKeyPress(GdkEventKey*);
+    void indexOnChanged();
+    void listerOnBatch(const CandidateTable& batch);
+    void listerOnDone();
+    bool timeoutOnRefresh();
 
     Chooser* chooser;
     string* result;
@@ -53,17 +437,38 @@ public:
     Gtk::ScrolledWindow scrolledWindow;
     string curdir;
     vector<string> recentFiles;
-    shared_ptr<vector<string>> dotfiles;
-    shared_ptr<vector<string>> regulars;
-    shared_ptr<vector<string>> directories;
-    ModelColumns modelColumns;
-    Glib::RefPtr<Gtk::ListStore> refListStore;
+    // The recent files, then the entries of curdir as they're listed, or
+    // the files of the project in the project mode.
+    CandidateTable candidates;
+    shared_ptr<ListingState> listingState;	// null unless listing
+    bool projectMode;	// listing every file under projectRoot
+    string projectRoot;	// empty if curdir isn't in a project
+    ProjectIndex* index;	// of projectRoot; null if none
+    std::unique_ptr<ProjectIndex> ownIndex;	// if not the global one
+    ProjectIndex::size_type numProjectPaths;	// in candidates
+    unsigned long indexGeneration;	// when the candidates were taken
+    sigc::connection indexConnection;
+    sigc::connection refreshConnection;	// pending refresh
+    // Matches of the patterns typed so far, while each is a prefix of the
+    // next; filtering these is quicker than starting over.
+    std::map<string, vector<FuzzyMatch>> matchCache;
+    Glib::RefPtr<ChooserModel> model;	// over candidates
     Gtk::TreeView treeView;
 };
 
 Chooser::Impl::Impl(Chooser* parent, string* result_)
-    : chooser{parent}, result{result_}
+    : chooser{parent}, result{result_}, listingState{nullptr},
+      projectMode{false}, index{nullptr}, numProjectPaths{0},
+      indexGeneration{0}
+{
+}
+
+Chooser::Impl::~Impl()
 {
+    if (listingState)
+	listingState->cancelled = true;
+    indexConnection.disconnect();
+    refreshConnection.disconnect();
 }
 
 void Chooser::Impl::init(const string& args)
@@ -79,22 +484,44 @@ void Chooser::Impl::init(const string& args)
     entry->signal_key_press_event().connect(mem_fun(*this,
         &Chooser::Impl::entryOnKeyPress));
 
-    dotfiles = make_shared<vector<string>>();
-    regulars = make_shared<vector<string>>();
-    directories = make_shared<vector<string>>();
     // curdir = *result;
     curdir = toFullPath(".", *result);
     *result = "";
-    getFilesOnFS(curdir, dotfiles, regulars, directories);
     recentFiles = fileMgr->getRecentFiles();
+    startListing();
+
+    // Get the project ready for the project mode.  The global index is
+    // used if it's the same project; otherwise the walk starts now.
+    projectRoot = ProjectIndex::findRoot(curdir);
+    if (!projectRoot.empty() && (projectIndex->getRoot() == projectRoot))
+	index = projectIndex;
+    else if (!projectRoot.empty()) {
+	ownIndex.reset(new ProjectIndex());
+	ownIndex->start(projectRoot);
+	index = ownIndex.get();
+    }
+    if (index)
+	indexConnection = index->signalChanged().connect(mem_fun(*this,
+	    &Chooser::Impl::indexOnChanged));
 
-    refListStore = Gtk::ListStore::create(modelColumns);
-    treeView.set_model(refListStore);
+    model = ChooserModel::create(candidates);
+    treeView.set_model(model);
     treeView.set_can_focus(false);
     treeView.set_headers_visible(false);
-    treeView.append_column("", modelColumns.type);
-    treeView.append_column("", modelColumns.name);
-    buildListStore("");
+    treeView.append_column("", model->columns.type);
+    treeView.append_column("", model->columns.name);
+
+    // Every row is as tall as the first, and the columns are as wide as
+    // set here, so the view need not measure the rows.
+    int typeWidth, typeHeight;
+    treeView.create_pango_layout(kindName(CandidateKind::Directory))->
+	get_pixel_size(typeWidth, typeHeight);
+    for (auto column: treeView.get_columns())
+	column->set_sizing(Gtk::TREE_VIEW_COLUMN_FIXED);
+    treeView.get_column(0)->set_fixed_width(typeWidth + 8);	// + padding
+    treeView.get_column(1)->set_expand(true);
+    treeView.set_fixed_height_mode(true);
+    buildList("");
 
     scrolledWindow.set_policy(Gtk::POLICY_AUTOMATIC, Gtk::POLICY_AUTOMATIC);
     scrolledWindow.set_placement(Gtk::CORNER_TOP_RIGHT);
@@ -123,8 +550,51 @@ void Chooser::Impl::init(const string& args)
     chooser->set_geometry_hints(*grid, geom, masks);
 }
 
-void Chooser::Impl::buildListStore(const string& pattern)
+// Add 'batch' to the candidates, as if it had been there when the cached
+// matches were made.
+void Chooser::Impl::addCandidates(const CandidateTable& batch)
+{
+    const unsigned int numOld = candidates.size();
+    candidates.append(batch);
+    for (auto& cached: matchCache) {
+	FuzzyPattern fuzzy = compileFuzzyPattern(cached.first);
+	auto& matches = cached.second;
+	auto numRanked = matches.size();
+	for (unsigned int i = numOld; i < candidates.size(); ++i)
+	    matchCandidate(fuzzy, i, matches);
+	rankMatches(fuzzy, matches, numRanked);
+    }
+}
+
+// Add the paths appended to the project index since the last time.  If
+// the index has changed otherwise, start over.
+void Chooser::Impl::addProjectPaths()
+{
+    if (index->getGeneration() != indexGeneration) {
+	startListing();
+	return;
+    }
+    CandidateTable batch;
+    for (; numProjectPaths < index->getSize(); ++numProjectPaths)
+	batch.append(CandidateKind::File, index->getPath(numProjectPaths));
+    addCandidates(batch);
+}
+
+// List the names matching 'pattern', the best match first.  Up to
+// MAX_RECENT_ROWS recent files are listed on top.
+void Chooser::Impl::buildList(const string& pattern)
 {
+    if (projectMode) {	// Patterns are matched against the paths.
+	showMatches(pattern, false);
+	return;
+    }
+
+    FuzzyPattern fuzzy = compileFuzzyPattern(pattern);
+    auto matches = [this, &fuzzy](CandidateTable::size_type i) {
+	return fuzzyScore(fuzzy, candidates.getName(i),
+	    candidates.getLength(i));
+    };
+
     // changing directory?
     bool changingDir = false;
     Glib::RefPtr<Gio::File> newDir;
@@ -142,21 +612,21 @@ void Chooser::Impl::buildListStore(const string& pattern)
     }
     else if ((!pattern.empty()) && pattern.rfind('/') == pattern.size() - 1) {
 	// pattern ends with '/'.  If this is the only match, chdir there.
-	vector<string> matches;
-	if (pattern.find(".") == 0)
-	    for (const auto& df: *dotfiles) {
-		if ((df.rfind('/') == df.size() - 1) &&
-			(fileNameMatcher(df, pattern)))
-		    matches.push_back(df);
-	    }
-	for (const auto& f: *directories) {
-	    if (fileNameMatcher(f, pattern)) {
-		matches.push_back(f);
-	    }
+	vector<string> dirMatches;
+	for (CandidateTable::size_type i = 0; i < candidates.size(); ++i) {
+	    auto kind = candidates.getKind(i);
+	    const char* name = candidates.getName(i);
+	    if ((kind == CandidateKind::Dotfile) && (pattern.find(".") == 0)
+		    && (name[candidates.getLength(i) - 1] == '/') &&
+		    matches(i))
+		dirMatches.push_back(name);
+	    else if ((kind == CandidateKind::Directory) && matches(i))
+		dirMatches.push_back(name);
 	}
-	if (matches.size() == 1) {	// only match!
+	if (dirMatches.size() == 1) {	// only match!
 	    changingDir = true;
-	    newDir = Gio::File::create_for_path(curdir)->get_child(matches[0]);
+	    newDir = Gio::File::create_for_path(curdir)->get_child(
+		dirMatches[0]);
 	}
     }
 
@@ -166,122 +636,216 @@ void Chooser::Impl::buildListStore(const string& pattern)
 
 	recentFiles.clear();
 	curdir = newDir->get_path();
-	getFilesOnFS(curdir, dotfiles, regulars, directories);
+	startListing();
 	chooser->set_title(entilde(curdir));
 	entry->set_text("");
     }
 
-    // Populate the Gtk::ListStore.
-    refListStore->clear();
-    unsigned int rowNum = 0;
-    for (const auto& rf: recentFiles) {
-	if (!changingDir && !fileNameMatcher(rf, pattern))
-	    continue;
-	auto row = *(refListStore->append());
-	row[modelColumns.type] = "recent";
-	row[modelColumns.name] = rf;
-	row[modelColumns.rowNum] = rowNum;
-	++rowNum;
-    }
-    unsigned int numRecentFiles = rowNum;
-    if (!changingDir && (pattern.find('.') == 0)) {
-	for (const auto& df: *dotfiles) {
-	    if (!changingDir && !fileNameMatcher(df, pattern))
-		continue;
-	    auto row = *(refListStore->append());
-	    row[modelColumns.type] = "dot";
-	    row[modelColumns.name] = df;
-	    row[modelColumns.rowNum] = rowNum;
-	    ++rowNum;
-	}
+    showMatches(changingDir ? "" : pattern, false);
+}
+
+// Pick the rows from the ranked matches of 'pattern'.  Dotfiles are
+// listed only if asked for.
+// @param keepSelection	leave the highlight where it is, if anywhere
+void Chooser::Impl::showMatches(const string& pattern, bool keepSelection)
+{
+    const auto& ranked = findMatches(pattern);
+    const bool withDotfiles = (pattern.find('.') == 0);
+    vector<unsigned int> newRows;
+    for (const auto& m: ranked) {
+	if (newRows.size() >= MAX_RECENT_ROWS)
+	    break;
+	if (candidates.getKind(m.index) == CandidateKind::Recent)
+	    newRows.push_back(m.index);
     }
-    for (const auto& f: *regulars) {
-	if (!changingDir && !fileNameMatcher(f, pattern))
-	    continue;
-	auto row = *(refListStore->append());
-	row[modelColumns.type] = "file";
-	row[modelColumns.name] = f;
-	row[modelColumns.rowNum] = rowNum;
-	++rowNum;
-    }
-    for (const auto& d: *directories) {
-	if (!changingDir && !fileNameMatcher(d, pattern))
-	    continue;
-	auto row = *(refListStore->append());
-	row[modelColumns.type] = "directory";
-	row[modelColumns.name] = d;
-	row[modelColumns.rowNum] = rowNum;
-	++rowNum;
-    }
-
-    // Highlight the row for the first regular file.
-    // If there is none, highlight the last recent file.
-    if (rowNum > 0) {
+    unsigned int numRecentFiles = newRows.size();
+    for (const auto& m: ranked) {
+	auto kind = candidates.getKind(m.index);
+	if ((kind != CandidateKind::Recent) &&
+		(withDotfiles || (kind != CandidateKind::Dotfile)))
+	    newRows.push_back(m.index);
+    }
+    model->update(newRows);
+    if (keepSelection && treeView.get_selection()->get_selected())
+	return;
+
+    // Highlight the best match below the recent files.
+    // If there is none, highlight the top recent file.
+    if (model->size() != 0) {
 	unsigned int rowIndexToHighlight = numRecentFiles;
-	if (numRecentFiles == rowNum) {
-	    --rowIndexToHighlight;
+	if (numRecentFiles == model->size()) {
+	    rowIndexToHighlight = 0;
 	}
 	highlightLine(rowIndexToHighlight);
     }
 }
 
-bool Chooser::Impl::fileNameMatcher(const string& filename,
-    const string& pattern)
+// @return	the candidates matching 'pattern', the best match first
+const vector<FuzzyMatch>& Chooser::Impl::findMatches(const string& pattern)
 {
-    std::string::size_type indexInFilename = 0;
-    std::string::size_type indexInPattern = 0;
-
-    while (indexInPattern < pattern.size()) {
-	char needle = pattern[indexInPattern];
-	std::string::size_type i =
-	    filename.find_first_of(needle, indexInFilename);
-	if (i == string::npos)
-	    return false;
-	indexInFilename = i + 1;
-	++indexInPattern;
+    auto iter = matchCache.find(pattern);
+    if (iter != end(matchCache))
+	return iter->second;	// e.g. after a backspace
+
+    // Keep the prefixes of 'pattern' only.  Of those, the longest one
+    // sorts last.  Anything matching 'pattern' matches it too.
+    for (iter = begin(matchCache); iter != end(matchCache); ) {
+	if (pattern.compare(0, iter->first.size(), iter->first) == 0)
+	    ++iter;
+	else iter = matchCache.erase(iter);
     }
-
-    return true;
-}
-
-void Chooser::Impl::getFilesOnFS(const string& directory,
-    shared_ptr<vector<string>> dotfiles,
-    shared_ptr<vector<string>> regulars,
-    shared_ptr<vector<string>> directories)
-{
-    auto giofile =
-        Gio::File::create_for_path(directory)->resolve_relative_path(curdir);
-    auto fileEnumerator = giofile->enumerate_children();
-    // Glib::object_unref(giofile);	// bug in gtkmm?
-
-    dotfiles->clear();
-    regulars->clear();
-    directories->clear();
-    for (auto f = fileEnumerator->next_file(); f != 0;
-	    f = fileEnumerator->next_file()) {
-	string filename = f->get_name();
-	if (filename.find_first_of('.') == 0) {
-	    if (f->get_file_type() == Gio::FileType::FILE_TYPE_DIRECTORY)
-		dotfiles->push_back(filename + '/');
-	    else dotfiles->push_back(filename);
-	}
-	else if (f->get_file_type() == Gio::FileType::FILE_TYPE_DIRECTORY)
-	    directories->push_back(filename + '/');
-	else regulars->push_back(filename);
+    const vector<FuzzyMatch>* narrowing = matchCache.empty() ? nullptr :
+	&matchCache.rbegin()->second;
+
+    FuzzyPattern fuzzy = compileFuzzyPattern(pattern);
+    vector<FuzzyMatch> result;
+    if (narrowing) {
+	for (const auto& m: *narrowing)
+	    matchCandidate(fuzzy, m.index, result);
+    } else {
+	for (unsigned int i = 0; i < candidates.size(); ++i)
+	    matchCandidate(fuzzy, i, result);
     }
-
-    std::sort(begin(*dotfiles), end(*dotfiles));
-    std::sort(begin(*regulars), end(*regulars));
-    std::sort(begin(*directories), end(*directories));
+    rankMatches(fuzzy, result, 0);
+    auto& cached = matchCache[pattern];
+    cached.swap(result);
+    return cached;
 }
 
 void Chooser::Impl::highlightLine(unsigned int lineNum)
 {
-    auto rowToHighlight = refListStore->children()[lineNum];
+    auto rowToHighlight = model->children()[lineNum];
     if (!rowToHighlight)
 	return;
     treeView.get_selection()->select(rowToHighlight);
-    treeView.scroll_to_row(refListStore->get_path(rowToHighlight));
+    treeView.scroll_to_row(model->get_path(rowToHighlight));
+}
+
+// Append the i-th candidate to 'matches' if it matches.
+void Chooser::Impl::matchCandidate(const FuzzyPattern& fuzzy, unsigned int i,
+    vector<FuzzyMatch>& matches)
+{
+    if (!fuzzyMayMatch(fuzzy, candidates.getMask(i)))
+	return;
+    const unsigned int length = candidates.getLength(i);
+    auto score = fuzzyScore(fuzzy, candidates.getName(i), length);
+    if (score)
+	matches.push_back(FuzzyMatch{*score, length, i});
+}
+
+// Sort the matches from 'numRanked' on, and merge them into the ranked
+// ones before.  Without a pattern, the recent files keep their order, and
+// the rest are sorted by name.
+void Chooser::Impl::rankMatches(const FuzzyPattern& fuzzy,
+    vector<FuzzyMatch>& matches, vector<FuzzyMatch>::size_type numRanked)
+{
+    auto before = [this, &fuzzy](const FuzzyMatch& a, const FuzzyMatch& b) {
+	if (!fuzzy.text.empty())
+	    return fuzzyRanksBefore(a, b);
+	auto kindA = candidates.getKind(a.index);
+	auto kindB = candidates.getKind(b.index);
+	if (kindA != kindB)
+	    return kindA < kindB;
+	if (kindA == CandidateKind::Recent)
+	    return a.index < b.index;
+	return std::strcmp(candidates.getName(a.index),
+	    candidates.getName(b.index)) < 0;
+    };
+    auto middle = begin(matches) + numRanked;
+    std::sort(middle, end(matches), before);
+    std::inplace_merge(begin(matches), middle, end(matches), before);
+}
+
+// List curdir in the background, replacing the listing so far.  The
+// recent files are listed right away, and so are the files of the project
+// in the project mode.
+void Chooser::Impl::startListing()
+{
+    if (listingState)
+	listingState->cancelled = true;
+    if (model)
+	model->clear();	// before the candidates it shows
+    candidates.clear();
+    for (const auto& rf: recentFiles)
+	candidates.append(CandidateKind::Recent, rf);
+    matchCache.clear();
+
+    if (projectMode) {
+	listingState = nullptr;
+	numProjectPaths = 0;
+	indexGeneration = index->getGeneration();
+	addProjectPaths();
+	return;
+    }
+    listingState = make_shared<ListingState>();
+    workerPool->post(std::bind(&Chooser::Impl::listerJob, this,
+	listingState, curdir));
+}
+
+// Switch between listing curdir and listing every file of the project,
+// keeping the pattern.
+void Chooser::Impl::toggleProjectMode()
+{
+    if (!index) {
+	chooser->set_title(entilde(curdir) + " (not in a project)");
+	return;
+    }
+    projectMode = !projectMode;
+    refreshConnection.disconnect();
+    startListing();
+    chooser->set_title(projectMode ? "project: " + entilde(projectRoot) :
+	entilde(curdir));
+    showMatches(entry->get_text(), false);
+}
+
+// Runs on a worker thread.  Only the names and the types are read: the
+// type comes from readdir(3), or from stat(2) for symlinks and on file
+// systems that don't tell.  'self' may be used only in the callbacks
+// posted to the main loop, and only while the listing is not cancelled.
+void Chooser::Impl::listerJob(Impl* self, shared_ptr<ListingState> state,
+    const string& dir)
+{
+    auto batch = make_shared<CandidateTable>();
+    unsigned int batchSize = FIRST_BATCH_SIZE;
+    auto postBatch = [self, state, &batch]() {
+	workerPool->postToMain([self, state, batch]() {
+	    if (!state->cancelled)
+		self->listerOnBatch(*batch);
+	});
+	batch = make_shared<CandidateTable>();
+    };
+
+    DIR* d = opendir(dir.c_str());
+    if (d) {
+	struct dirent* ent;
+	while (!state->cancelled && ((ent = readdir(d)) != nullptr)) {
+	    string name{ent->d_name};
+	    if ((name == ".") || (name == ".."))
+		continue;
+	    bool isDir = (ent->d_type == DT_DIR);
+	    if ((ent->d_type == DT_UNKNOWN) || (ent->d_type == DT_LNK)) {
+		struct stat st;
+		isDir = (stat((dir + "/" + name).c_str(), &st) == 0) &&
+		    S_ISDIR(st.st_mode);
+	    }
+	    auto kind = (name[0] == '.') ? CandidateKind::Dotfile :
+		isDir ? CandidateKind::Directory : CandidateKind::File;
+	    if (isDir)
+		name += '/';
+	    batch->append(kind, name);
+	    if (batch->size() >= batchSize) {
+		postBatch();
+		batchSize = BATCH_SIZE;
+	    }
+	}
+	closedir(d);
+    }
+    if (!batch->empty())
+	postBatch();
+    workerPool->postToMain([self, state]() {
+	if (!state->cancelled)
+	    self->listerOnDone();
+    });
 }
 
 //// event handlers ////
@@ -306,15 +870,16 @@ void Chooser::Impl::entryOnActivate()
 	chooser->hide();
 	return;
     }
-    Glib::ustring selectedName = (*iter)[modelColumns.name];
-    string fullpath = toFullPath(curdir, selectedName);
+    Glib::ustring selectedName = (*iter)[model->columns.name];
+    string fullpath = toFullPath(projectMode ? projectRoot : curdir,
+	selectedName);
 
     // If a directory is selected:
     if (selectedName[selectedName.size() - 1] == '/') {
         curdir = fullpath;
-        getFilesOnFS(curdir, dotfiles, regulars, directories);
 	recentFiles.clear();
-        buildListStore("");
+	startListing();
+        buildList("");
         chooser->set_title(entilde(curdir));
         entry->set_text("");
         return;
@@ -328,14 +893,14 @@ void Chooser::Impl::entryBufferOnDeletedText(unsigned int placeholder1,
     unsigned int placeholder2)
 {
     const string& pattern = entry->get_text();
-    buildListStore(pattern);
+    buildList(pattern);
 }
 
 void Chooser::Impl::entryBufferOnInsertedText(unsigned int placeholder1,
     const char* placeholder2, unsigned int placeholder3)
 {
     const string& pattern = entry->get_text();
-    buildListStore(pattern);
+    buildList(pattern);
 }
 
 bool Chooser::Impl::entryOnKeyPress(GdkEventKey* ev)
@@ -346,12 +911,19 @@ bool Chooser::Impl::entryOnKeyPress(GdkEventKey* ev)
     if (ev->is_modifier)
         return true;
 
+    // Toggle the project mode.
+    if (((ev->state & ALL_MODIFIERS) == GDK_CONTROL_MASK) &&
+	    (ev->keyval == GDK_KEY_r)) {
+	toggleProjectMode();
+	return true;
+    }
+
     // No-op if nothing is selected.
     Gtk::TreeModel::iterator iter = treeView.get_selection()->get_selected();
     if (!iter)
 	return true;
 
-    const unsigned int rowNum = (*iter)[modelColumns.rowNum];
+    const unsigned int rowNum = model->get_path(iter)[0];
 
     // Handle Up and Down.
     if ((ev->state & ALL_MODIFIERS) == 0) {
@@ -387,6 +959,35 @@ bool Chooser::Impl::entryOnKeyPress(GdkEventKey* ev)
     return false;
 }
 
+void Chooser::Impl::indexOnChanged()
+{
+    if (projectMode && !refreshConnection.connected())
+	refreshConnection = Glib::signal_timeout().connect(mem_fun(*this,
+	    &Chooser::Impl::timeoutOnRefresh), PROJECT_REFRESH_MS);
+}
+
+// Show the entries listed so far.  The rows already shown stay; the new
+// ones are inserted among them.
+void Chooser::Impl::listerOnBatch(const CandidateTable& batch)
+{
+    addCandidates(batch);
+    showMatches(entry->get_text(), true);
+}
+
+void Chooser::Impl::listerOnDone()
+{
+    listingState = nullptr;
+}
+
+bool Chooser::Impl::timeoutOnRefresh()
+{
+    if (projectMode) {
+	addProjectPaths();
+	showMatches(entry->get_text(), true);
+    }
+    return false;	// one-shot
+}
+
 //// interface class ////
 
 Chooser::Chooser(string* result) : pimpl{new Impl{this, result}} {}
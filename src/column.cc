@@ -28,7 +28,7 @@ public:
     optional<unsigned int> closeWindow(EditWindow*);
     unsigned int closeWindowsForFile(shared_ptr<File> f);
     optional<EditWindow*> getEditWindow(const unsigned int rowNum);
-    optional<FileWindow*> getFileWindow(const string& path);
+    optional<FileWindow*> getFileWindow(FileId id);
     optional<unsigned int> getRow(const EditWindow*);
     optional<ScratchWindow*> getScratchWindow();
     void replaceWindow(EditWindow* oldEW, EditWindow* newEW);
@@ -161,14 +161,14 @@ optional<EditWindow*> Column::Impl::getEditWindow(const unsigned int rowNum)
     return optional<EditWindow*>(editWindows->at(rowNum));
 }
 
-optional<FileWindow*> Column::Impl::getFileWindow(const string& path)
+optional<FileWindow*> Column::Impl::getFileWindow(FileId id)
 {
     for (auto iter: *editWindows) {
         if (typeid(*iter) != typeid(FileWindow))
             continue;
 
 	FileWindow* fw = reinterpret_cast<FileWindow*>(iter);
-	if (fw->getFile()->getGioFile()->get_path() == path)
+	if (fw->getFileId() == id)
 	    return optional<FileWindow*>(fw);
     }
     return optional<FileWindow*>();
@@ -231,8 +231,8 @@ unsigned int Column::closeWindowsForFile(shared_ptr<File> f) {
 optional<EditWindow*> Column::getEditWindow(const unsigned int rowNum) {
     return pimpl->getEditWindow(rowNum);
 }
-optional<FileWindow*> Column::getFileWindow(const string& path) {
-    return pimpl->getFileWindow(path);
+optional<FileWindow*> Column::getFileWindow(FileId id) {
+    return pimpl->getFileWindow(id);
 }
 optional<unsigned int> Column::getRow(const EditWindow* ew) {
     return pimpl->getRow(ew);
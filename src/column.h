@@ -19,7 +19,7 @@ public:
     boost::optional<unsigned int> closeWindow(EditWindow*);
     unsigned int closeWindowsForFile(std::shared_ptr<File> f);
     boost::optional<EditWindow*> getEditWindow(const unsigned int rowNum);
-    boost::optional<FileWindow*> getFileWindow(const std::string& path);
+    boost::optional<FileWindow*> getFileWindow(FileId id);
     boost::optional<unsigned int> getRow(const EditWindow* ew);
     boost::optional<ScratchWindow*> getScratchWindow();
     void replaceWindow(EditWindow* oldEW, EditWindow* newEW);
@@ -1,6 +1,7 @@
+#include <climits>
+#include <cstdlib>
 #include <iostream>
 #include <map>
-#include <sstream>
 #include <string>
 #include <vector>
 #include <boost/optional.hpp>
@@ -9,6 +10,7 @@
 #include "global.h"
 #include "filemgr.h"
 #include "filewindow.h"
+#include "projectindex.h"
 #include "util.h"
 #include "windowmgr.h"
 
@@ -32,18 +34,27 @@ public:
     ~Impl() = default;
     CommandStatus execute(const string& command);
     CommandStatus ch_bubble(const string& _);
+    CommandStatus ch_cancel(const string& _);
     CommandStatus ch_choose(const string& _);
     CommandStatus ch_close(const string& _);
     CommandStatus ch_deleteBuffer(const string& args);
     CommandStatus ch_edit(const string& args);
     CommandStatus ch_files(const string& _);
+    CommandStatus ch_find(const string& args);
     CommandStatus ch_gotoLine(const string& args);
+    CommandStatus ch_index(const string& args);
+    CommandStatus ch_memoryReport(const string& _);
     CommandStatus ch_newColumn(const string& args);
     CommandStatus ch_quit(const string& args);
+    CommandStatus ch_redo(const string& _);
+    CommandStatus ch_reload(const string& _);
+    CommandStatus ch_reloadAll(const string& _);
     CommandStatus ch_save(const string& args);
     CommandStatus ch_shade(const string& args);
     CommandStatus ch_split(const string& _);
+    CommandStatus ch_undo(const string& _);
     void log(const string& msg);
+    CommandStatus showFile(const string& fullpath);
 
     Command* cp;
     map<string, CommandHandler> commandMap;
@@ -53,14 +64,22 @@ Command::Impl::Impl(Command* parent) : cp{parent} {
     commandMap = {
 	{"bd", &Command::Impl::ch_deleteBuffer},
 	{"bubble", &Command::Impl::ch_bubble},
+	{"cancel", &Command::Impl::ch_cancel},
 	{"choose", &Command::Impl::ch_choose},
 	{"close", &Command::Impl::ch_close},
 	{"e", &Command::Impl::ch_edit},
 	{"files", &Command::Impl::ch_files},
+	{"find", &Command::Impl::ch_find},
+	{"index", &Command::Impl::ch_index},
+	{"mem", &Command::Impl::ch_memoryReport},
 	{"newcol", &Command::Impl::ch_newColumn},
 	{"q", &Command::Impl::ch_quit},
+	{"redo", &Command::Impl::ch_redo},
+	{"reload", &Command::Impl::ch_reload},
+	{"reload-all", &Command::Impl::ch_reloadAll},
 	{"shade", &Command::Impl::ch_shade},
 	{"split", &Command::Impl::ch_split},
+	{"undo", &Command::Impl::ch_undo},
 	{"w", &Command::Impl::ch_save},
     };
 }
@@ -105,6 +124,13 @@ CommandStatus Command::Impl::ch_bubble(const string& args)
     return CommandStatus{CommandStatusCode::Success, ""};
 }
 
+// Cancel loading files.
+CommandStatus Command::Impl::ch_cancel(const string& args)
+{
+    fileMgr->cancelLoading();
+    return CommandStatus{CommandStatusCode::Success, ""};
+}
+
 CommandStatus Command::Impl::ch_choose(const string& args)
 {
     auto kit = Gtk::Main::instance();
@@ -139,11 +165,8 @@ CommandStatus Command::Impl::ch_close(const string& _)
     if (!actuallyClosed)
 	return CommandStatus{CommandStatusCode::Error,
 	    "cannot close the only window in the column"};
-    if (typeid(*ew) == typeid(FileWindow)) {
-	FileWindow* fw = reinterpret_cast<FileWindow*>(ew);
-	fw->getFile()->deleteBuffer(fw->getBuffer());
+    if (typeid(*ew) == typeid(FileWindow))
 	delete ew;
-    }
     return CommandStatus{CommandStatusCode::Success, ""};
 }
 
@@ -186,22 +209,32 @@ CommandStatus Command::Impl::ch_edit(const string& args)
 	    baseDir = fw->getFile()->getGioFile()->get_parent()->get_path();
 	}
     }
+
     giofile = Gio::File::create_for_path(toFullPath(baseDir, args));
 
+    if ((args.find_first_of("*?[") != string::npos) &&
+	    !giofile->query_exists()) {
+	// A glob pattern.  Open the matching files in the background, and
+	// show the first.  With no match, the pattern is taken as the name
+	// of a new file.
+	fileMgr->getFiles(vector<string>{giofile->get_path()},
+	    [this](const vector<shared_ptr<File>>& files) {
+		if (files.empty()) {
+		    log("no match");
+		    return;
+		}
+		showFile(files.front()->getGioFile()->get_path());
+		log("opened " + std::to_string(files.size()) + " files");
+	    });
+	return CommandStatus{CommandStatusCode::Success, ""};
+    }
+
     if (giofile->query_file_type() == Gio::FileType::FILE_TYPE_DIRECTORY) {
 	// This may be a recursive call, but anyway...
 	return ch_choose(giofile->get_path());
     }
 
-    string fullpath{giofile->get_path()};
-    auto opt_fw = windowMgr->getFileWindow(fullpath, true);
-    if (!opt_fw)
-	return CommandStatus{CommandStatusCode::Error, ""};
-    (*opt_fw)->grabFocus();
-    (*opt_fw)->shadeMode(ShadeMode::Unshaded);
-    windowMgr->setFrontEditWindow(*opt_fw);
-
-    return CommandStatus{CommandStatusCode::Success, ""};
+    return showFile(giofile->get_path());
 }
 
 CommandStatus Command::Impl::ch_files(const string& args)
@@ -216,12 +249,28 @@ CommandStatus Command::Impl::ch_files(const string& args)
     return CommandStatus{CommandStatusCode::Success, ""};
 }
 
+// List the files in the project whose paths contain 'args'.
+CommandStatus Command::Impl::ch_find(const string& args)
+{
+    constexpr ProjectIndex::size_type MAX_RESULTS = 1000;
+
+    if (projectIndex->getRoot().empty())
+	return CommandStatus{CommandStatusCode::Error, "no project; see index"};
+    string text{"\n"};
+    for (const auto& path: projectIndex->find(args, MAX_RESULTS))
+	text += "e " + path + "\n";
+    auto opt_sw = windowMgr->getScratchWindow(true);
+    (*opt_sw)->appendText(text);
+    (*opt_sw)->grabFocus();
+    windowMgr->setFrontEditWindow(*opt_sw);
+    return CommandStatus{CommandStatusCode::Success, ""};
+}
+
 CommandStatus Command::Impl::ch_gotoLine(const string& args)
 {
-    unsigned int lineNum;
-    std::stringstream ss;
-    ss << args;
-    ss >> lineNum;
+    // Too large a number goes to the last line.
+    auto parsed = strtoul(args.c_str(), nullptr, 10);
+    unsigned int lineNum = (parsed > UINT_MAX) ? UINT_MAX : parsed;
 
     auto ew = windowMgr->getCurrentFocus();
     ew->gotoLine(lineNum);
@@ -229,6 +278,39 @@ CommandStatus Command::Impl::ch_gotoLine(const string& args)
     return CommandStatus{CommandStatusCode::Success, ""};
 }
 
+// Show how much memory the Files take, and which have been evicted.
+CommandStatus Command::Impl::ch_memoryReport(const string& _)
+{
+    auto opt_sw = windowMgr->getScratchWindow(true);
+    (*opt_sw)->appendText("\n" + fileMgr->getMemoryReport());
+    (*opt_sw)->grabFocus();
+    windowMgr->setFrontEditWindow(*opt_sw);
+    return CommandStatus{CommandStatusCode::Success, ""};
+}
+
+// Index the directory 'args', or the project of the current file.
+CommandStatus Command::Impl::ch_index(const string& args)
+{
+    string baseDir{"."};
+    EditWindow* ew = windowMgr->getCurrentFocus();
+    if (typeid(*ew) == typeid(FileWindow)) {
+	FileWindow* fw = reinterpret_cast<FileWindow*>(ew);
+	baseDir = fw->getFile()->getGioFile()->get_parent()->get_path();
+    }
+
+    string root;
+    if (!args.empty())
+	root = toFullPath(baseDir, args);
+    else {
+	baseDir = toFullPath(baseDir, ".");
+	root = ProjectIndex::findRoot(baseDir);
+	if (root.empty())
+	    root = baseDir;
+    }
+    projectIndex->start(root);
+    return CommandStatus{CommandStatusCode::Success, "indexing " + root};
+}
+
 CommandStatus Command::Impl::ch_newColumn(const string& args)
 {
     EditWindow* ew = windowMgr->newColumn(optional<EditWindow*>());
@@ -239,11 +321,40 @@ CommandStatus Command::Impl::ch_newColumn(const string& args)
 
 CommandStatus Command::Impl::ch_quit(const string& args)
 {
+    windowMgr->saveSession();
     fileMgr->cleanup();
     Gtk::Main::quit();
     return CommandStatus{CommandStatusCode::Success, ""};
 }
 
+// The undo history of a file is shared by all its FileWindows.  Other
+// windows use the buffer's own.
+CommandStatus Command::Impl::ch_redo(const string& _)
+{
+    auto ew = windowMgr->getCurrentFocus();
+    if (typeid(*ew) == typeid(FileWindow))
+	reinterpret_cast<FileWindow*>(ew)->getFile()->redo();
+    else if (ew->getBuffer()->can_redo())
+	ew->getBuffer()->redo();
+    return CommandStatus{CommandStatusCode::Success, ""};
+}
+
+// Reload the current file from disk, discarding local changes.
+CommandStatus Command::Impl::ch_reload(const string& _)
+{
+    auto ew = windowMgr->getCurrentFocus();
+    if (typeid(*ew) != typeid(FileWindow))
+	return CommandStatus{CommandStatusCode::Error, "not a file window"};
+    reinterpret_cast<FileWindow*>(ew)->getFile()->reload();
+    return CommandStatus{CommandStatusCode::Success, ""};
+}
+
+CommandStatus Command::Impl::ch_reloadAll(const string& _)
+{
+    fileMgr->reloadAll();
+    return CommandStatus{CommandStatusCode::Success, ""};
+}
+
 CommandStatus Command::Impl::ch_save(const string& args)
 {
     auto ew = windowMgr->getCurrentFocus();
@@ -264,11 +375,37 @@ CommandStatus Command::Impl::ch_split(const string& _)
     return CommandStatus{CommandStatusCode::Success, ""};
 }
 
+CommandStatus Command::Impl::ch_undo(const string& _)
+{
+    auto ew = windowMgr->getCurrentFocus();
+    if (typeid(*ew) == typeid(FileWindow))
+	reinterpret_cast<FileWindow*>(ew)->getFile()->undo();
+    else if (ew->getBuffer()->can_undo())
+	ew->getBuffer()->undo();
+    return CommandStatus{CommandStatusCode::Success, ""};
+}
+
 void Command::Impl::log(const string& args)
 {
     windowMgr->setEntryPlaceholderText(args);
 }
 
+// Show the file in a FileWindow, opening it if necessary.
+// This is where the user opens a file, by "e" or the chooser; the visit
+// counts for the recent files.
+CommandStatus Command::Impl::showFile(const string& fullpath)
+{
+    auto opt_fw = windowMgr->getFileWindow(fullpath, true);
+    if (!opt_fw)
+	return CommandStatus{CommandStatusCode::Error, ""};
+    fileMgr->visit((*opt_fw)->getFile()->getId());
+    (*opt_fw)->grabFocus();
+    (*opt_fw)->shadeMode(ShadeMode::Unshaded);
+    windowMgr->setFrontEditWindow(*opt_fw);
+
+    return CommandStatus{CommandStatusCode::Success, ""};
+}
+
 //// interface class ////
 
 Command::Command() : pimpl{new Impl{this}} {}
@@ -0,0 +1,264 @@
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <lzma.h>
+#include <zlib.h>
+#include "compression.h"
+
+using std::string;
+
+// The compressor writes this much at a time.
+static const string::size_type OUTPUT_CHUNK_SIZE = 64 * 1024;
+
+string compressionName(Compression compression)
+{
+    switch (compression) {
+    case Compression::None:
+	return "uncompressed";
+    case Compression::Gzip:
+	return "gzip";
+    case Compression::Xz:
+	return "xz";
+    case Compression::Zstd:
+	return "zstd";
+    }
+    return "";
+}
+
+static bool endsWith(const string& s, const string& suffix)
+{
+    return (s.size() >= suffix.size()) &&
+	(s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+// By the magic number, or by the name if the file is empty or new.
+Compression detectCompression(const string& path)
+{
+    unsigned char magic[6] = {0};
+    std::ifstream ifs{path, std::ios::in | std::ios::binary};
+    ifs.read(reinterpret_cast<char*>(magic), sizeof(magic));
+    const auto length = ifs.gcount();
+
+    if ((length >= 2) && (magic[0] == 0x1F) && (magic[1] == 0x8B))
+	return Compression::Gzip;
+    if ((length >= 6) && (memcmp(magic, "\xFD" "7zXZ\0", 6) == 0))
+	return Compression::Xz;
+    if ((length >= 4) && (memcmp(magic, "\x28\xB5\x2F\xFD", 4) == 0))
+	return Compression::Zstd;
+    if (length > 0)
+	return Compression::None;
+
+    if (endsWith(path, ".gz"))
+	return Compression::Gzip;
+    if (endsWith(path, ".xz"))
+	return Compression::Xz;
+    return Compression::None;
+}
+
+//// impl class ////
+
+class Decompressor::Impl
+{
+public:
+    Impl(Decompressor* parent, Compression c);
+    ~Impl();
+    void feed(const char* data, string::size_type length, bool isLast);
+    bool isComplete();
+    bool isFailed();
+    string read(string::size_type maxLength);
+
+    Decompressor* decompressor;
+    Compression compression;
+    z_stream zs;
+    lzma_stream xs;
+    bool isLastInput;
+    bool ended;	// at the end of a stream
+    bool failed;
+};
+
+Decompressor::Impl::Impl(Decompressor* parent, Compression c)
+  : decompressor{parent}, compression{c}, zs(), xs(LZMA_STREAM_INIT), isLastInput{false},
+    ended{false}, failed{false}
+{
+    if (compression == Compression::Gzip)
+	failed = (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK);
+    else if (compression == Compression::Xz)
+	failed = (lzma_stream_decoder(&xs, UINT64_MAX, LZMA_CONCATENATED) !=
+	    LZMA_OK);
+    else failed = true;
+}
+
+Decompressor::Impl::~Impl()
+{
+    if (compression == Compression::Gzip)
+	inflateEnd(&zs);
+    else if (compression == Compression::Xz)
+	lzma_end(&xs);
+}
+
+void Decompressor::Impl::feed(const char* data, string::size_type length,
+    bool isLast)
+{
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zs.avail_in = length;
+    xs.next_in = reinterpret_cast<const uint8_t*>(data);
+    xs.avail_in = length;
+    isLastInput = isLast;
+}
+
+// @return	true if the input ended where a stream did, i.e. it's not
+//		truncated
+bool Decompressor::Impl::isComplete()
+{
+    return ended && !failed;
+}
+
+bool Decompressor::Impl::isFailed()
+{
+    return failed;
+}
+
+// @return	at most maxLength bytes; empty if the input is used up
+string Decompressor::Impl::read(string::size_type maxLength)
+{
+    string out(maxLength, '\0');
+    if (compression == Compression::Gzip) {
+	zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+	zs.avail_out = maxLength;
+	while (!failed && (zs.avail_out > 0)) {
+	    const auto availIn = zs.avail_in;
+	    const auto availOut = zs.avail_out;
+	    int result = inflate(&zs, Z_NO_FLUSH);
+	    if (result == Z_STREAM_END) {
+		ended = true;
+		if (zs.avail_in == 0)
+		    break;
+		// Another member follows, as with "cat a.gz b.gz".
+		failed = (inflateReset(&zs) != Z_OK);
+		ended = false;
+	    }
+	    else if ((result != Z_OK) && (result != Z_BUF_ERROR))
+		failed = true;
+	    else if ((zs.avail_in == availIn) && (zs.avail_out == availOut))
+		break;	// needs more input
+	}
+	out.resize(maxLength - zs.avail_out);
+    } else if (compression == Compression::Xz) {
+	xs.next_out = reinterpret_cast<uint8_t*>(&out[0]);
+	xs.avail_out = maxLength;
+	while (!failed && !ended && (xs.avail_out > 0)) {
+	    const auto availIn = xs.avail_in;
+	    const auto availOut = xs.avail_out;
+	    lzma_ret result = lzma_code(&xs,
+		isLastInput ? LZMA_FINISH : LZMA_RUN);
+	    if (result == LZMA_STREAM_END)
+		ended = true;
+	    else if ((result != LZMA_OK) && (result != LZMA_BUF_ERROR))
+		failed = true;
+	    else if ((xs.avail_in == availIn) && (xs.avail_out == availOut))
+		break;	// needs more input
+	}
+	out.resize(maxLength - xs.avail_out);
+    }
+    else out.clear();
+    return out;
+}
+
+class Compressor::Impl
+{
+public:
+    Impl(Compressor* parent, Compression c, int level);
+    ~Impl();
+    bool compress(const char* data, string::size_type length, string& out,
+	bool isLast);
+
+    Compressor* compressor;
+    Compression compression;
+    z_stream zs;
+    lzma_stream xs;
+    bool failed;
+};
+
+Compressor::Impl::Impl(Compressor* parent, Compression c, int level)
+  : compressor{parent}, compression{c}, zs(), xs(LZMA_STREAM_INIT), failed{false}
+{
+    if (compression == Compression::Gzip)
+	failed = (deflateInit2(&zs, level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK);
+    else if (compression == Compression::Xz)
+	failed = (lzma_easy_encoder(&xs, level, LZMA_CHECK_CRC64) !=
+	    LZMA_OK);
+    else failed = true;
+}
+
+Compressor::Impl::~Impl()
+{
+    if (compression == Compression::Gzip)
+	deflateEnd(&zs);
+    else if (compression == Compression::Xz)
+	lzma_end(&xs);
+}
+
+// Append the compressed 'data' to 'out'.  With 'isLast', end the stream.
+bool Compressor::Impl::compress(const char* data, string::size_type length,
+    string& out, bool isLast)
+{
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zs.avail_in = length;
+    xs.next_in = reinterpret_cast<const uint8_t*>(data);
+    xs.avail_in = length;
+    bool done = false;
+    while (!failed && !done) {
+	const auto oldSize = out.size();
+	out.resize(oldSize + OUTPUT_CHUNK_SIZE);
+	string::size_type availOut;
+	if (compression == Compression::Gzip) {
+	    zs.next_out = reinterpret_cast<Bytef*>(&out[oldSize]);
+	    zs.avail_out = OUTPUT_CHUNK_SIZE;
+	    int result = deflate(&zs, isLast ? Z_FINISH : Z_NO_FLUSH);
+	    failed = (result == Z_STREAM_ERROR);
+	    done = isLast ? (result == Z_STREAM_END) :
+		((zs.avail_in == 0) && (zs.avail_out > 0));
+	    availOut = zs.avail_out;
+	} else {
+	    xs.next_out = reinterpret_cast<uint8_t*>(&out[oldSize]);
+	    xs.avail_out = OUTPUT_CHUNK_SIZE;
+	    lzma_ret result = lzma_code(&xs, isLast ? LZMA_FINISH : LZMA_RUN);
+	    failed = (result != LZMA_OK) && (result != LZMA_STREAM_END);
+	    done = isLast ? (result == LZMA_STREAM_END) :
+		((xs.avail_in == 0) && (xs.avail_out > 0));
+	    availOut = xs.avail_out;
+	}
+	out.resize(oldSize + OUTPUT_CHUNK_SIZE - availOut);
+    }
+    return !failed;
+}
+
+//// interface class ////
+
+Decompressor::Decompressor(Compression compression)
+    : pimpl{new Impl{this, compression}} {}
+Decompressor::~Decompressor() = default;
+void Decompressor::feed(const char* data, string::size_type length,
+	bool isLast) {
+    pimpl->feed(data, length, isLast);
+}
+bool Decompressor::isComplete() { return pimpl->isComplete(); }
+bool Decompressor::isFailed() { return pimpl->isFailed(); }
+string Decompressor::read(string::size_type maxLength) {
+    return pimpl->read(maxLength);
+}
+
+Compressor::Compressor(Compression compression, int level)
+    : pimpl{new Impl{this, compression, level}} {}
+Compressor::~Compressor() = default;
+bool Compressor::compress(const char* data, string::size_type length,
+	string& out) {
+    return pimpl->compress(data, length, out, false);
+}
+bool Compressor::finish(string& out) {
+    return pimpl->compress(nullptr, 0, out, true);
+}
+
+// eof
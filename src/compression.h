@@ -0,0 +1,59 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+// How a file is compressed on disk.  Buffers and Documents hold the
+// decompressed text; the compression is restored when the file is saved.
+enum class Compression: unsigned int {
+    None,
+    Gzip,
+    Xz,
+    Zstd,	// recognized, but not supported
+};
+
+std::string compressionName(Compression compression);
+Compression detectCompression(const std::string& path);
+
+// Decompresses a file fed in consecutive chunks.  After each feed(),
+// call read() until it returns an empty string; the chunk must stay
+// valid until then.
+class Decompressor
+{
+public:
+    explicit Decompressor(Compression compression);
+    virtual ~Decompressor();
+    void feed(const char* data, std::string::size_type length, bool isLast);
+    bool isComplete();
+    bool isFailed();
+    std::string read(std::string::size_type maxLength);
+private:
+    Decompressor(const Decompressor&) = delete;	// copy ctor
+    Decompressor(Decompressor&&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+    Decompressor& operator=(Decompressor&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// The other way around.  finish() writes out the rest.
+class Compressor
+{
+public:
+    Compressor(Compression compression, int level);
+    virtual ~Compressor();
+    bool compress(const char* data, std::string::size_type length,
+	std::string& out);
+    bool finish(std::string& out);
+private:
+    Compressor(const Compressor&) = delete;	// copy ctor
+    Compressor(Compressor&&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+    Compressor& operator=(Compressor&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
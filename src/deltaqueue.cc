@@ -0,0 +1,123 @@
+#include <string>
+#include <vector>
+#include "deltaqueue.h"
+#include "util.h"
+
+using std::string;
+using std::vector;
+
+typedef Delta::size_type size_type;
+
+//// impl class ////
+
+class DeltaQueue::Impl
+{
+public:
+    Impl(DeltaQueue* parent);
+    ~Impl() = default;
+    void addConsumer(const Consumer& consumer);
+    bool empty();
+    void flush();
+    void pushErase(size_type charOffset, size_type numChars);
+    void pushInsert(size_type charOffset, const char* text, size_type length);
+
+    DeltaQueue* dq;
+    vector<Delta> pending;
+    vector<Consumer> consumers;
+};
+
+DeltaQueue::Impl::Impl(DeltaQueue* parent) : dq{parent} {}
+
+void DeltaQueue::Impl::addConsumer(const Consumer& consumer)
+{
+    consumers.push_back(consumer);
+}
+
+bool DeltaQueue::Impl::empty()
+{
+    return pending.empty();
+}
+
+void DeltaQueue::Impl::flush()
+{
+    if (pending.empty())
+	return;
+    vector<Delta> batch;
+    batch.swap(pending);
+    for (auto& consumer: consumers)
+	consumer(batch);
+}
+
+void DeltaQueue::Impl::pushErase(size_type charOffset, size_type numChars)
+{
+    if (numChars == 0)
+	return;
+
+    if (!pending.empty()) {
+	Delta& last = pending.back();
+	if (last.kind == Delta::Kind::Erase) {
+	    if (charOffset + numChars == last.charOffset) {	// backspace
+		last.charOffset = charOffset;
+		last.numChars += numChars;
+		return;
+	    }
+	    if (charOffset == last.charOffset) {	// delete forward
+		last.numChars += numChars;
+		return;
+	    }
+	}
+	else if ((charOffset >= last.charOffset) &&
+		(charOffset + numChars == last.charOffset + last.numChars)) {
+	    // Erasing the tail of what has just been typed.
+	    size_type keep = charOffset - last.charOffset;
+	    last.text.resize(utf8ByteOffset(last.text.data(),
+		last.text.size(), keep));
+	    last.numChars = keep;
+	    if (keep == 0)
+		pending.pop_back();
+	    return;
+	}
+    }
+
+    pending.push_back(Delta{Delta::Kind::Erase, charOffset, numChars, ""});
+}
+
+void DeltaQueue::Impl::pushInsert(size_type charOffset, const char* text,
+    size_type length)
+{
+    if (length == 0)
+	return;
+    size_type numChars = utf8CharCount(text, length);
+
+    if (!pending.empty()) {
+	Delta& last = pending.back();
+	if ((last.kind == Delta::Kind::Insert) &&
+		(charOffset == last.charOffset + last.numChars)) {
+	    last.text.append(text, length);
+	    last.numChars += numChars;
+	    return;
+	}
+    }
+
+    pending.push_back(Delta{Delta::Kind::Insert, charOffset, numChars,
+	string(text, length)});
+}
+
+//// interface class ////
+
+DeltaQueue::DeltaQueue() : pimpl{new Impl{this}} {}
+DeltaQueue::~DeltaQueue() = default;
+void DeltaQueue::addConsumer(const Consumer& consumer) {
+    pimpl->addConsumer(consumer);
+}
+bool DeltaQueue::empty() { return pimpl->empty(); }
+void DeltaQueue::flush() { pimpl->flush(); }
+void DeltaQueue::pushErase(size_type charOffset, size_type numChars) {
+    pimpl->pushErase(charOffset, numChars);
+}
+void DeltaQueue::pushInsert(size_type charOffset, const char* text,
+	size_type length) {
+    pimpl->pushInsert(charOffset, text, length);
+}
+
+// eof
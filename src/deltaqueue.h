@@ -0,0 +1,51 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// An edit made to a File's buffer.  Offsets are in characters.
+struct Delta
+{
+    enum class Kind: unsigned int {
+	Insert,
+	Erase,
+    };
+    typedef std::string::size_type size_type;
+
+    Kind kind;
+    size_type charOffset;
+    size_type numChars;
+    std::string text;	// inserted text; empty for Erase
+};
+
+// Edit-delta journal of a File.
+// Edits are recorded (and coalesced) on the typing path, and handed over to
+// the consumers in batches when flush() is called, typically at idle time
+// or right before someone reads the consumers' state.
+class DeltaQueue
+{
+public:
+    typedef std::function<void(const std::vector<Delta>&)> Consumer;
+    // using Consumer = std::function<void(const std::vector<Delta>&)>;
+
+    DeltaQueue();
+    virtual ~DeltaQueue();
+    void addConsumer(const Consumer& consumer);
+    bool empty();
+    void flush();
+    void pushErase(Delta::size_type charOffset, Delta::size_type numChars);
+    void pushInsert(Delta::size_type charOffset, const char* text,
+	Delta::size_type length);
+private:
+    DeltaQueue(const DeltaQueue&) = delete;	// copy ctor
+    DeltaQueue(DeltaQueue&&) = delete;
+    DeltaQueue& operator=(const DeltaQueue&) = delete;
+    DeltaQueue& operator=(DeltaQueue&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
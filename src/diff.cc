@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "diff.h"
+#include "util.h"
+
+using std::string;
+using std::vector;
+
+typedef string::size_type size_type;
+
+// Beyond this many differing lines, diffLines() gives up finding the
+// shortest edit and replaces the whole differing region in one hunk.
+// The cost of the search is O((N + M) * D) time and O(D^2) memory.
+static const long MAX_EDIT_DISTANCE = 1000;
+
+struct Line
+{
+    size_type start;	// byte offset
+    size_type length;	// including '\n'
+    size_type charStart;	// character offset
+};
+
+// @return	the lines of 'text', followed by a sentinel empty line at its
+//		end
+static vector<Line> splitLines(const string& text)
+{
+    vector<Line> result;
+    size_type pos = 0;
+    size_type charPos = 0;
+    while (pos < text.size()) {
+	auto nl = text.find('\n', pos);
+	size_type end = (nl == string::npos) ? text.size() : nl + 1;
+	result.push_back(Line{pos, end - pos, charPos});
+	charPos += utf8CharCount(text.data() + pos, end - pos);
+	pos = end;
+    }
+    result.push_back(Line{pos, 0, charPos});
+    return result;
+}
+
+// Myers' O(ND) algorithm on the lines ids a[0..n) and b[0..m).
+// Appends pairs of matching lines (in increasing order) to 'matches'.
+// @return	false if the edit distance exceeds MAX_EDIT_DISTANCE
+static bool shortestEdit(const int* a, long n, const int* b, long m,
+    vector<std::pair<long, long>>& matches)
+{
+    const long maxD = std::min(n + m, MAX_EDIT_DISTANCE);
+    const long offset = maxD + 1;
+    vector<long> v(2 * offset + 1, 0);
+    vector<vector<long>> trace;	// trace[d][k + d]: furthest x after step d
+
+    long d;
+    for (d = 0; d <= maxD; ++d) {
+	bool done = false;
+	for (long k = -d; k <= d; k += 2) {
+	    long x;
+	    if ((k == -d) || ((k != d) && (v[offset + k - 1] < v[offset + k + 1])))
+		x = v[offset + k + 1];	// down: insertion
+	    else x = v[offset + k - 1] + 1;	// right: deletion
+	    long y = x - k;
+	    while ((x < n) && (y < m) && (a[x] == b[y])) {
+		++x;
+		++y;
+	    }
+	    v[offset + k] = x;
+	    if ((x >= n) && (y >= m))
+		done = true;
+	}
+	trace.emplace_back(v.begin() + offset - d, v.begin() + offset + d + 1);
+	if (done)
+	    break;
+    }
+    if (d > maxD)
+	return false;
+
+    // Walk back from (n, m), collecting the diagonals.
+    vector<std::pair<long, long>> reversed;
+    long x = n, y = m;
+    for (; d > 0; --d) {
+	const vector<long>& prev = trace[d - 1];	// indexed by k + d - 1
+	long k = x - y;
+	long prevK;
+	if ((k == -d) || ((k != d) && (prev[k - 1 + d - 1] < prev[k + 1 + d - 1])))
+	    prevK = k + 1;
+	else prevK = k - 1;
+	long prevX = prev[prevK + d - 1];
+	long prevY = prevX - prevK;
+	while ((x > prevX) && (y > prevY)) {
+	    --x;
+	    --y;
+	    reversed.emplace_back(x, y);
+	}
+	x = prevX;
+	y = prevY;
+    }
+    while ((x > 0) && (y > 0)) {
+	--x;
+	--y;
+	reversed.emplace_back(x, y);
+    }
+    matches.insert(matches.end(), reversed.rbegin(), reversed.rend());
+    return true;
+}
+
+// Compute the hunks that turn 'oldText' into 'newText', line by line.
+// The hunks are in increasing order of oldCharOffset and don't overlap;
+// apply them from the last one so that the offsets stay valid.
+vector<Hunk> diffLines(const string& oldText, const string& newText)
+{
+    vector<Line> oldLines = splitLines(oldText);
+    vector<Line> newLines = splitLines(newText);
+    // Not compared, only for the offset of the end.
+    const Line oldEnd = oldLines.back();
+    oldLines.pop_back();
+    newLines.pop_back();
+    auto charOffset = [&](size_type i) {
+	return (i < oldLines.size()) ? oldLines[i].charStart : oldEnd.charStart;
+    };
+    auto equal = [&](const Line& o, const Line& n) {
+	return (o.length == n.length) &&
+	    (oldText.compare(o.start, o.length, newText, n.start, n.length) == 0);
+    };
+
+    // Common prefix and suffix are usually most of the file.
+    size_type prefix = 0;
+    while ((prefix < oldLines.size()) && (prefix < newLines.size()) &&
+	    equal(oldLines[prefix], newLines[prefix]))
+	++prefix;
+    size_type suffix = 0;
+    while ((suffix < oldLines.size() - prefix) &&
+	    (suffix < newLines.size() - prefix) &&
+	    equal(oldLines[oldLines.size() - 1 - suffix],
+		newLines[newLines.size() - 1 - suffix]))
+	++suffix;
+    const long n = oldLines.size() - prefix - suffix;
+    const long m = newLines.size() - prefix - suffix;
+
+    // Give each distinct line an id, so that the search compares ints.
+    std::unordered_map<string, int> ids;
+    vector<int> a(n), b(m);
+    for (long i = 0; i < n; ++i) {
+	const Line& l = oldLines[prefix + i];
+	a[i] = ids.emplace(oldText.substr(l.start, l.length),
+	    ids.size()).first->second;
+    }
+    for (long j = 0; j < m; ++j) {
+	const Line& l = newLines[prefix + j];
+	b[j] = ids.emplace(newText.substr(l.start, l.length),
+	    ids.size()).first->second;
+    }
+
+    vector<std::pair<long, long>> matches;
+    if ((n > 0) && (m > 0))
+	shortestEdit(a.data(), n, b.data(), m, matches);
+    matches.emplace_back(n, m);	// sentinel
+
+    // Whatever lies between two matches is a hunk.
+    vector<Hunk> result;
+    long x = 0, y = 0;
+    for (const auto& match: matches) {
+	if ((match.first > x) || (match.second > y)) {
+	    const size_type first = prefix + x;
+	    const size_type last = prefix + match.first;	// exclusive
+	    Hunk h{charOffset(first), charOffset(last) - charOffset(first), ""};
+	    for (long j = y; j < match.second; ++j) {
+		const Line& l = newLines[prefix + j];
+		h.newText.append(newText, l.start, l.length);
+	    }
+	    result.push_back(h);
+	}
+	x = match.first + 1;
+	y = match.second + 1;
+    }
+    return result;
+}
+
+// eof
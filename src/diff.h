@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Characters [oldCharOffset, oldCharOffset + oldNumChars) of the old text
+// are to be replaced with 'newText'.  Both are complete lines, ending with
+// '\n' except at the end of the text.  Lines end only at '\n'; the offsets
+// don't depend on what else a text widget takes as a line break (a lone
+// '\r', U+2028, etc.).
+struct Hunk
+{
+    std::string::size_type oldCharOffset;
+    std::string::size_type oldNumChars;
+    std::string newText;
+};
+
+std::vector<Hunk> diffLines(const std::string& oldText,
+    const std::string& newText);
+
+// eof
@@ -0,0 +1,389 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "document.h"
+#include "util.h"
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+typedef Document::Piece Piece;
+typedef Document::size_type size_type;
+
+// Inserted text is stored in blocks of this size.  This also bounds the
+// length of the pieces for inserted text, and thus the cost of splitting
+// them.
+static const size_type BLOCK_SIZE = 64 * 1024;
+
+// At most this many files are mapped at once.  Beyond that, create()
+// fails and the caller reads the file instead.
+static const unsigned int MAX_GUARDED_MAPPINGS = 4096;
+
+//// storage ////
+
+// A mapping the SIGBUS handler may repair.  The slot is free while 'used'
+// is false, and the handler ignores it while 'start' is null.
+struct GuardedMapping
+{
+    std::atomic<bool> used;
+    std::atomic<const char*> start;
+    std::atomic<size_type> length;
+    std::atomic<bool> damaged;
+};
+
+static GuardedMapping guardedMappings[MAX_GUARDED_MAPPINGS];
+static uintptr_t pageSize;
+
+// Reading a page of a mapped file past its end raises SIGBUS.  If the page
+// belongs to one of our mappings, replace the rest of the mapping with
+// zero pages, and let the read be retried.  Otherwise crash as usual.
+// Only faults of this process are handled; a SIGBUS sent by kill() or the
+// like has no address, and gets the default action.
+static void sigbusHandler(int sig, siginfo_t* info, void* context)
+{
+    if (info->si_code <= 0) {	// SI_USER, SI_QUEUE, ...
+	signal(SIGBUS, SIG_DFL);
+	raise(SIGBUS);
+	return;
+    }
+    const char* addr = static_cast<const char*>(info->si_addr);
+    for (auto& g: guardedMappings) {
+	const char* start = g.start.load();
+	if ((start == nullptr) || (addr < start) ||
+		(addr >= start + g.length.load()))
+	    continue;
+	const uintptr_t page = reinterpret_cast<uintptr_t>(addr) &
+	    ~(pageSize - 1);
+	const uintptr_t end = reinterpret_cast<uintptr_t>(start) +
+	    g.length.load();
+	if (mmap(reinterpret_cast<void*>(page), end - page, PROT_READ,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+	    g.damaged = true;
+	    return;
+	}
+	break;
+    }
+    signal(SIGBUS, SIG_DFL);
+}
+
+static bool installSigbusHandler()
+{
+    pageSize = sysconf(_SC_PAGESIZE);
+    struct sigaction sa;
+    sa.sa_sigaction = sigbusHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO;
+    return sigaction(SIGBUS, &sa, nullptr) == 0;
+}
+
+// @return	a free slot in guardedMappings, or MAX_GUARDED_MAPPINGS if
+//		none
+static unsigned int guardMapping(const char* start, size_type length)
+{
+    static const bool installed = installSigbusHandler();
+    if (!installed)
+	return MAX_GUARDED_MAPPINGS;
+    for (unsigned int i = 0; i < MAX_GUARDED_MAPPINGS; ++i) {
+	auto& g = guardedMappings[i];
+	if (g.used.exchange(true))
+	    continue;
+	g.length = length;
+	g.damaged = false;
+	g.start = start;	// Now the handler sees it.
+	return i;
+    }
+    return MAX_GUARDED_MAPPINGS;
+}
+
+MappedStorage::MappedStorage(const char* addr_, size_type length_,
+    unsigned int slot_, const string& path_, const struct stat& st)
+    : addr{addr_}, length{length_}, slot{slot_}, path{path_},
+      dev{st.st_dev}, ino{st.st_ino}, mtime(st.st_mtim), ctime(st.st_ctim)
+{
+}
+
+MappedStorage::~MappedStorage()
+{
+    guardedMappings[slot].start = nullptr;
+    munmap(const_cast<char*>(addr), length);
+    guardedMappings[slot].used = false;
+}
+
+// Runs on any thread.  The file is stat'ed; a change within the timestamp
+// granularity of the file system goes unnoticed.
+// @return	true if the file has been written to since it was mapped, or
+//		has shrunk under the mapping and some of the data read as
+//		zeros
+bool MappedStorage::isStale() const
+{
+    if (guardedMappings[slot].damaged)
+	return true;
+    struct stat st;
+    if ((stat(path.c_str(), &st) != 0) || (st.st_dev != dev) ||
+	    (st.st_ino != ino))
+	return false;	// replaced, which leaves the mapped inode alone
+    return (static_cast<size_type>(st.st_size) != length) ||
+	(st.st_mtim.tv_sec != mtime.tv_sec) ||
+	(st.st_mtim.tv_nsec != mtime.tv_nsec) ||
+	(st.st_ctim.tv_sec != ctime.tv_sec) ||
+	(st.st_ctim.tv_nsec != ctime.tv_nsec);
+}
+
+// @return	null if the file cannot be mapped (e.g. it's empty or special,
+//		or too many are mapped)
+shared_ptr<MappedStorage> MappedStorage::create(const string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return nullptr;
+
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size == 0)) {
+	close(fd);
+	return nullptr;
+    }
+
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);	// The mapping stays valid.
+    if (addr == MAP_FAILED)
+	return nullptr;
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    unsigned int slot = guardMapping(static_cast<const char*>(addr),
+	st.st_size);
+    if (slot == MAX_GUARDED_MAPPINGS) {
+	munmap(addr, st.st_size);
+	return nullptr;
+    }
+    return shared_ptr<MappedStorage>(new MappedStorage(
+	static_cast<const char*>(addr), st.st_size, slot, path, st));
+}
+
+HeapStorage::HeapStorage(size_type capacity_)
+    : block{new char[capacity_]}, capacity{capacity_}, used{0}
+{
+}
+
+// @return	offset where 'text' is stored
+size_type HeapStorage::append(const char* text, size_type length)
+{
+    size_type start = used;
+    std::copy(text, text + length, block.get() + used);
+    used += length;
+    return start;
+}
+
+//// impl class ////
+
+class Document::Impl
+{
+public:
+    Impl(Document* parent);
+    ~Impl() = default;
+    void append(const shared_ptr<const Storage>& storage,
+	size_type start, size_type length);
+    void clear();
+    void erase(size_type charOffset, size_type numChars);
+    size_type getCharCount();
+    LineIndex& getLineIndex();
+    vector<Piece> getPieces();
+    size_type getSize();
+    string getText();
+    void insert(size_type charOffset, const char* text, size_type length);
+    size_type getByteOffset(vector<Piece>::size_type idx);
+    vector<Piece>::size_type splitAt(size_type charOffset);
+
+    Document* doc;
+    vector<Piece> pieces;
+    shared_ptr<HeapStorage> addStorage;	// where inserted text goes
+    size_type numChars;
+    size_type numBytes;
+    LineIndex lineIndex;
+};
+
+Document::Impl::Impl(Document* parent)
+    : doc{parent}, addStorage{nullptr}, numChars{0}, numBytes{0}
+{
+}
+
+// Append 'length' bytes of 'storage' at 'start' to the end of the document.
+void Document::Impl::append(const shared_ptr<const Storage>& storage,
+    size_type start, size_type length)
+{
+    if (length == 0)
+	return;
+    size_type n = utf8CharCount(storage->data() + start, length);
+    pieces.push_back(Piece{storage, start, length, n});
+    lineIndex.append(storage->data() + start, length);
+    numChars += n;
+    numBytes += length;
+}
+
+void Document::Impl::clear()
+{
+    pieces.clear();
+    addStorage = nullptr;
+    numChars = 0;
+    numBytes = 0;
+    lineIndex.clear();
+}
+
+void Document::Impl::erase(size_type charOffset, size_type numChars_)
+{
+    if (numChars_ == 0)
+	return;
+    auto first = splitAt(charOffset);
+    auto last = splitAt(charOffset + numChars_);
+    size_type erasedBytes = 0;
+    for (auto i = first; i < last; ++i) {
+	numChars -= pieces[i].numChars;
+	erasedBytes += pieces[i].length;
+    }
+    numBytes -= erasedBytes;
+    lineIndex.erase(getByteOffset(first), charOffset, erasedBytes, numChars_);
+    pieces.erase(begin(pieces) + first, begin(pieces) + last);
+}
+
+size_type Document::Impl::getCharCount()
+{
+    return numChars;
+}
+
+// The pieces share their storage with the document, and the storage is
+// never modified in place.  So the result is a consistent snapshot that
+// may be read from another thread.
+vector<Piece> Document::Impl::getPieces()
+{
+    return pieces;
+}
+
+LineIndex& Document::Impl::getLineIndex()
+{
+    return lineIndex;
+}
+
+size_type Document::Impl::getSize()
+{
+    return numBytes;
+}
+
+string Document::Impl::getText()
+{
+    string result;
+    result.reserve(numBytes);
+    for (const auto& p: pieces)
+	result.append(p.storage->data() + p.start, p.length);
+    return result;
+}
+
+void Document::Impl::insert(size_type charOffset, const char* text,
+    size_type length)
+{
+    auto idx = splitAt(charOffset);
+    lineIndex.insert(getByteOffset(idx), charOffset, text, length);
+
+    while (length > 0) {
+	// Typing appends to the piece that was just inserted, if possible.
+	if ((idx > 0) && (pieces[idx - 1].storage == addStorage) &&
+		(pieces[idx - 1].start + pieces[idx - 1].length ==
+		    addStorage->size()) &&
+		(addStorage->available() >= length)) {
+	    Piece& prev = pieces[idx - 1];
+	    size_type n = utf8CharCount(text, length);
+	    addStorage->append(text, length);
+	    prev.length += length;
+	    prev.numChars += n;
+	    numChars += n;
+	    numBytes += length;
+	    return;
+	}
+
+	if (!addStorage || (addStorage->available() == 0) ||
+		(addStorage->available() < std::min(length, BLOCK_SIZE)))
+	    addStorage = make_shared<HeapStorage>(BLOCK_SIZE);
+
+	// Store as much as fits, without splitting a character.
+	size_type chunkLength = std::min(length, addStorage->available());
+	if (chunkLength < length)
+	    chunkLength = utf8CompleteLength(text, chunkLength);
+	if (chunkLength == 0)	// a broken sequence; store it anyway
+	    chunkLength = std::min(length, addStorage->available());
+
+	size_type n = utf8CharCount(text, chunkLength);
+	size_type start = addStorage->append(text, chunkLength);
+	pieces.insert(begin(pieces) + idx,
+	    Piece{addStorage, start, chunkLength, n});
+	numChars += n;
+	numBytes += chunkLength;
+	++idx;
+	text += chunkLength;
+	length -= chunkLength;
+    }
+}
+
+// @return	byte offset where the piece at 'idx' starts
+size_type Document::Impl::getByteOffset(vector<Piece>::size_type idx)
+{
+    size_type pos = 0;
+    for (vector<Piece>::size_type i = 0; i < idx; ++i)
+	pos += pieces[i].length;
+    return pos;
+}
+
+// Make sure a piece boundary exists at charOffset.
+// @return	index of the piece that starts at charOffset
+vector<Piece>::size_type Document::Impl::splitAt(size_type charOffset)
+{
+    size_type pos = 0;
+    for (vector<Piece>::size_type i = 0; i < pieces.size(); ++i) {
+	if (pos == charOffset)
+	    return i;
+	Piece& p = pieces[i];
+	if (charOffset < pos + p.numChars) {
+	    size_type k = charOffset - pos;
+	    size_type b = utf8ByteOffset(p.storage->data() + p.start,
+		p.length, k);
+	    Piece right{p.storage, p.start + b, p.length - b, p.numChars - k};
+	    p.length = b;
+	    p.numChars = k;
+	    pieces.insert(begin(pieces) + i + 1, right);
+	    return i + 1;
+	}
+	pos += p.numChars;
+    }
+    return pieces.size();
+}
+
+//// interface class ////
+
+Document::Document() : pimpl{new Impl{this}} {}
+Document::~Document() = default;
+void Document::append(const shared_ptr<const Storage>& storage,
+	size_type start, size_type length) {
+    pimpl->append(storage, start, length);
+}
+void Document::clear() { pimpl->clear(); }
+void Document::erase(size_type charOffset, size_type numChars) {
+    pimpl->erase(charOffset, numChars);
+}
+size_type Document::getCharCount() { return pimpl->getCharCount(); }
+LineIndex& Document::getLineIndex() { return pimpl->getLineIndex(); }
+vector<Piece> Document::getPieces() { return pimpl->getPieces(); }
+size_type Document::getSize() { return pimpl->getSize(); }
+string Document::getText() { return pimpl->getText(); }
+void Document::insert(size_type charOffset, const char* text,
+	size_type length) {
+    pimpl->insert(charOffset, text, length);
+}
+
+// eof
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "lineindex.h"
+
+// Immutable bytes that the pieces of a Document point into.
+class Storage
+{
+public:
+    typedef std::string::size_type size_type;
+    virtual ~Storage() {}
+    virtual const char* data() const = 0;
+    virtual size_type size() const = 0;
+};
+
+// Read-only private mapping of a file on disk.
+// Someone else may truncate or rewrite the file while it's mapped.  Their
+// writes show through the mapping, and reading pages past the new end
+// reads zeros instead of raising SIGBUS.  isStale() tells either apart
+// from the text that was mapped.  Our own saves replace the file (new
+// inode), which leaves the mapping alone.
+class MappedStorage: public Storage
+{
+public:
+    static std::shared_ptr<MappedStorage> create(const std::string& path);
+    virtual ~MappedStorage();
+    const char* data() const { return addr; }
+    bool isStale() const;
+    size_type size() const { return length; }
+private:
+    MappedStorage(const char* addr, size_type length, unsigned int slot,
+	const std::string& path, const struct stat& st);
+    const char* addr;
+    size_type length;
+    unsigned int slot;	// in the table of guarded mappings
+    std::string path;
+    dev_t dev;	// the rest is as of the mapping
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+// Append-only block of memory.  Appending never moves the bytes already
+// stored, so pieces handed out earlier stay valid.
+class HeapStorage: public Storage
+{
+public:
+    explicit HeapStorage(size_type capacity);
+    virtual ~HeapStorage() {}
+    const char* data() const { return block.get(); }
+    size_type size() const { return used; }
+    size_type available() const { return capacity - used; }
+    size_type append(const char* text, size_type length);
+private:
+    std::unique_ptr<char[]> block;
+    size_type capacity;
+    size_type used;
+};
+
+// Piece table holding the content of a File.
+// The original file content is typically a MappedStorage; text inserted
+// later goes to HeapStorage blocks.  Positions are character offsets, as
+// in Gtk::TextBuffer.  A LineIndex is kept up to date along with the
+// pieces.
+class Document
+{
+public:
+    typedef std::string::size_type size_type;
+
+    struct Piece
+    {
+	std::shared_ptr<const Storage> storage;
+	size_type start;	// byte offset in storage
+	size_type length;	// in bytes
+	size_type numChars;
+    };
+
+    Document();
+    virtual ~Document();
+    void append(const std::shared_ptr<const Storage>& storage,
+	size_type start, size_type length);
+    void clear();
+    void erase(size_type charOffset, size_type numChars);
+    size_type getCharCount();
+    LineIndex& getLineIndex();
+    std::vector<Piece> getPieces();
+    size_type getSize();
+    std::string getText();
+    void insert(size_type charOffset, const char* text, size_type length);
+private:
+    Document(const Document&) = delete;	// copy ctor
+    Document(Document&&) = delete;
+    Document& operator=(const Document&) = delete;
+    Document& operator=(Document&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
@@ -37,18 +37,20 @@ class EditWindow::Impl
 
 public:
     Impl(EditWindow* parent);
-    ~Impl() = default;
+    ~Impl();
     void buildKeyHandlers();
     unsigned int getBubbleNumber();
     GsvBuffer& getBuffer();
     Gtk::EventBox* getColorBox();
     Gsv::View& getView();
     void gotoLine(unsigned int lineNum);
+    void gotoOffset(int charOffset);
     void grabFocus();
     virtual void save(const string& altFilename="") {}
     void setBubbleNumber(unsigned int num);
     void setBuffer(const GsvBuffer& buf);
     void setLabelText(const string& text);
+    void setLineWrap(bool wrap);
     ShadeMode shadeMode(const ShadeMode& sm);
 
     bool kh_bubble(GdkEventKey* ev);
@@ -59,11 +61,13 @@ public:
     bool kh_focusMinibuffer(GdkEventKey* ev);
     bool kh_quit(GdkEventKey* ev);
     bool kh_recenter(GdkEventKey* ev);
+    bool kh_redo(GdkEventKey* ev);
     bool kh_scrollDown(GdkEventKey* ev);
     bool kh_scrollUp(GdkEventKey* ev);
     bool kh_scroll_sub(bool forward);
     bool kh_splitWindow(GdkEventKey* ev);
     bool kh_switchBuffer(GdkEventKey* ev);
+    bool kh_undo(GdkEventKey* ev);
 
     bool colorBoxOnButtonPress(GdkEventButton* ev);
     void colorBoxOnDragDataGet(
@@ -86,6 +90,10 @@ public:
     ShadeMode shadeModeStatus;	// should be either Unshaded or Shaded
     Gsv::View view;
     GsvBuffer buffer;
+    // A buffer may be shown in several EditWindows.  These remember
+    // where this window's cursor and selection are while it isn't focused.
+    Glib::RefPtr<Gtk::TextMark> insertMark;
+    Glib::RefPtr<Gtk::TextMark> selectionMark;
     std::map<guint, KeyHandler> ctrlKeyMap;
     std::map<guint, KeyHandler> ctrlXKeyMap;
     std::map<guint, KeyHandler> ctrlXCtrlKeyMap;
@@ -175,12 +183,21 @@ EditWindow::Impl::Impl(EditWindow* parent)
     buildKeyHandlers();
 }
 
+EditWindow::Impl::~Impl()
+{
+    if (buffer) {
+	buffer->delete_mark(insertMark);
+	buffer->delete_mark(selectionMark);
+    }
+}
+
 void EditWindow::Impl::buildKeyHandlers()
 {
     ctrlKeyMap = {
 	{GDK_KEY_0, &EditWindow::Impl::kh_deleteWindow},
 	{GDK_KEY_2, &EditWindow::Impl::kh_splitWindow},
 	{GDK_KEY_6, &EditWindow::Impl::kh_bubble},
+	{GDK_KEY_slash, &EditWindow::Impl::kh_undo},
 	{GDK_KEY_l, &EditWindow::Impl::kh_recenter},
 	{GDK_KEY_v, &EditWindow::Impl::kh_scrollUp},
 	{GDK_KEY_x, &EditWindow::Impl::kh_ctrlX},
@@ -190,6 +207,7 @@ void EditWindow::Impl::buildKeyHandlers()
     ctrlXKeyMap = {
 	{GDK_KEY_b, &EditWindow::Impl::kh_switchBuffer},
 	{GDK_KEY_k, &EditWindow::Impl::kh_deleteBuffer},
+	{GDK_KEY_u, &EditWindow::Impl::kh_undo},
     };
 
     ctrlXCtrlKeyMap = {	// for 'Ctrl-x ctrl-f' etc.
@@ -198,6 +216,7 @@ void EditWindow::Impl::buildKeyHandlers()
     };
 
     mod1KeyMap = {
+	{GDK_KEY_slash, &EditWindow::Impl::kh_redo},
 	{GDK_KEY_x, &EditWindow::Impl::kh_focusMinibuffer},
     };
 }
@@ -226,7 +245,14 @@ Gsv::View& EditWindow::Impl::getView()
 
 void EditWindow::Impl::gotoLine(unsigned int lineNum)
 {
-    auto iter = getBuffer()->get_iter_at_line_index(lineNum - 1, 0);
+    gotoOffset(
+	getBuffer()->get_iter_at_line((lineNum > 0) ? lineNum - 1 : 0)
+	    .get_offset());
+}
+
+void EditWindow::Impl::gotoOffset(int charOffset)
+{
+    auto iter = getBuffer()->get_iter_at_offset(charOffset);
 
     if (false) {	// TODO if transient mode
 	// Move 'insert' mark, leave 'selection-bound'.
@@ -254,7 +280,14 @@ void EditWindow::Impl::setBubbleNumber(unsigned int num)
 
 void EditWindow::Impl::setBuffer(const GsvBuffer& buf)
 {
+    if (buffer) {
+	buffer->delete_mark(insertMark);
+	buffer->delete_mark(selectionMark);
+    }
     buffer = buf;
+    insertMark = buf->create_mark(buf->get_insert()->get_iter(), false);
+    selectionMark = buf->create_mark(
+	buf->get_selection_bound()->get_iter(), false);
     view.set_buffer(buf);
 }
 
@@ -263,6 +296,18 @@ void EditWindow::Impl::setLabelText(const string& text)
     label->set_text(text);
 }
 
+// Without wrapping, long lines are reached by scrolling horizontally.
+void EditWindow::Impl::setLineWrap(bool wrap)
+{
+    if (wrap) {
+	view.set_wrap_mode(Gtk::WrapMode::WRAP_WORD_CHAR);
+	scrolledWindow.set_policy(Gtk::POLICY_NEVER, Gtk::POLICY_ALWAYS);
+    } else {
+	view.set_wrap_mode(Gtk::WrapMode::WRAP_NONE);
+	scrolledWindow.set_policy(Gtk::POLICY_AUTOMATIC, Gtk::POLICY_ALWAYS);
+    }
+}
+
 ShadeMode EditWindow::Impl::shadeMode(const ShadeMode& sm)
 {
     if ((sm == ShadeMode::Query) || (sm == shadeModeStatus)) {
@@ -357,6 +402,13 @@ bool EditWindow::Impl::kh_recenter(GdkEventKey* ev)
     return true;
 }
 
+bool EditWindow::Impl::kh_redo(GdkEventKey* ev)
+{
+    lastOp = LastOp{LastOpCode::Plain, 0};
+    commandMgr->execute("redo");
+    return true;
+}
+
 bool EditWindow::Impl::kh_scrollDown(GdkEventKey* ev)
 {
     return kh_scroll_sub(false);
@@ -414,6 +466,13 @@ bool EditWindow::Impl::kh_switchBuffer(GdkEventKey* ev)
     return true;
 }
 
+bool EditWindow::Impl::kh_undo(GdkEventKey* ev)
+{
+    lastOp = LastOp{LastOpCode::Plain, 0};
+    commandMgr->execute("undo");
+    return true;
+}
+
 //// event handlers ////
 
 bool EditWindow::Impl::colorBoxOnButtonPress(GdkEventButton* ev)
@@ -447,9 +506,15 @@ bool EditWindow::Impl::viewOnFocusInOut(GdkEventFocus* ev)
 {
     lastOp = LastOp{LastOpCode::Plain, 0};
     if (ev->in) {	// focus in
+	// Bring back this window's own cursor into the shared buffer.
+	buffer->select_range(insertMark->get_iter(),
+	    selectionMark->get_iter());
 	view.set_highlight_current_line(true);
 	windowMgr->setFrontEditWindow(ew);
     } else {	// focus out
+	buffer->move_mark(insertMark, buffer->get_insert()->get_iter());
+	buffer->move_mark(selectionMark,
+	    buffer->get_selection_bound()->get_iter());
 	view.set_highlight_current_line(false);
     }
     return false;
@@ -509,6 +574,7 @@ GsvBuffer& EditWindow::getBuffer() { return pimpl->getBuffer(); }
 Gtk::EventBox* EditWindow::getColorBox() { return pimpl->getColorBox(); }
 Gsv::View& EditWindow::getView() { return pimpl->getView(); }
 void EditWindow::gotoLine(unsigned int lineNum) { pimpl->gotoLine(lineNum); }
+void EditWindow::gotoOffset(int charOffset) { pimpl->gotoOffset(charOffset); }
 void EditWindow::grabFocus() { pimpl->grabFocus(); }
 void EditWindow::setBubbleNumber(unsigned int num) {
     pimpl->setBubbleNumber(num);
@@ -517,6 +583,7 @@ void EditWindow::setBuffer(const GsvBuffer& buf) { pimpl->setBuffer(buf); }
 void EditWindow::setLabelText(const string& text) {
     pimpl->setLabelText(text);
 }
+void EditWindow::setLineWrap(bool wrap) { pimpl->setLineWrap(wrap); }
 ShadeMode EditWindow::shadeMode(const ShadeMode& sm) {
     return pimpl->shadeMode(sm);
 }
@@ -13,12 +13,14 @@ public:
     GsvBuffer& getBuffer();
     Gtk::EventBox* getColorBox();
     Gsv::View& getView();
-    void gotoLine(unsigned int lineNum);
+    virtual void gotoLine(unsigned int lineNum);
+    void gotoOffset(int charOffset);
     void grabFocus();
     virtual void save(const std::string& altFilename) {}
     void setBubbleNumber(unsigned int num);
     void setBuffer(const GsvBuffer& buf);
     void setLabelText(const std::string& text);
+    void setLineWrap(bool wrap);
     ShadeMode shadeMode(const ShadeMode& sm);
     virtual const std::string shortDesc() { return ""; }
 private:
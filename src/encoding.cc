@@ -0,0 +1,542 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "encoding.h"
+#include "util.h"
+
+using std::string;
+
+typedef string::size_type size_type;
+
+// detectTextFormat() looks at this many bytes for UTF-16 without BOM.
+static const size_type UTF16_SAMPLE_SIZE = 4096;
+
+static const char UTF8_BOM[] = "\xEF\xBB\xBF";
+static const char REPLACEMENT_CHAR[] = "\xEF\xBF\xBD";	// U+FFFD
+
+//// UTF-8 ////
+
+// Skip ASCII bytes, 16 at a time if possible.
+// @return	index of the first non-ASCII byte at or after 'i'
+static inline size_type skipAscii(const unsigned char* p, size_type i,
+    size_type length)
+{
+#if defined(__SSE2__)
+    while (i + 16 <= length) {
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+	int mask = _mm_movemask_epi8(v);	// high bit of each byte
+	if (mask != 0)
+	    return i + __builtin_ctz(mask);
+	i += 16;
+    }
+#endif
+    while ((i < length) && (p[i] < 0x80))
+	++i;
+    return i;
+}
+
+// Check the multi-byte sequence at p (RFC 3629: no overlong forms,
+// no surrogates, nothing above U+10FFFF).
+// @return	length of the sequence; 0 if invalid or truncated
+static inline size_type sequenceLength(const unsigned char* p,
+    size_type available)
+{
+    const unsigned char c = p[0];
+    if (c < 0x80)
+	return 1;
+    if (c < 0xC2)
+	return 0;
+
+    size_type len;
+    unsigned char lo = 0x80, hi = 0xBF;	// range of the 2nd byte
+    if (c < 0xE0)
+	len = 2;
+    else if (c < 0xF0) {
+	len = 3;
+	if (c == 0xE0)
+	    lo = 0xA0;
+	else if (c == 0xED)
+	    hi = 0x9F;
+    }
+    else if (c < 0xF5) {
+	len = 4;
+	if (c == 0xF0)
+	    lo = 0x90;
+	else if (c == 0xF4)
+	    hi = 0x8F;
+    }
+    else return 0;
+
+    if (available < len)
+	return 0;
+    if ((p[1] < lo) || (p[1] > hi))
+	return 0;
+    for (size_type i = 2; i < len; ++i) {
+	if ((p[i] & 0xC0) != 0x80)
+	    return 0;
+    }
+    return len;
+}
+
+bool isValidUtf8(const char* data, size_type length)
+{
+    auto p = reinterpret_cast<const unsigned char*>(data);
+    size_type i = 0;
+    for (;;) {
+	i = skipAscii(p, i, length);
+	if (i >= length)
+	    return true;
+	size_type len = sequenceLength(p + i, length - i);
+	if (len == 0)
+	    return false;
+	i += len;
+    }
+}
+
+// Replace every invalid byte with U+FFFD.
+string makeValidUtf8(const char* data, size_type length)
+{
+    auto p = reinterpret_cast<const unsigned char*>(data);
+    string result;
+    result.reserve(length);
+    size_type i = 0;
+    while (i < length) {
+	size_type j = skipAscii(p, i, length);
+	result.append(data + i, j - i);
+	i = j;
+	if (i >= length)
+	    break;
+	size_type len = sequenceLength(p + i, length - i);
+	if (len == 0) {
+	    result.append(REPLACEMENT_CHAR);
+	    ++i;
+	} else {
+	    result.append(data + i, len);
+	    i += len;
+	}
+    }
+    return result;
+}
+
+// @return	code point at p, or U+FFFD for an invalid sequence
+static unsigned int decodeUtf8(const unsigned char* p, size_type available,
+    size_type& len)
+{
+    len = sequenceLength(p, available);
+    switch (len) {
+    case 1:
+	return p[0];
+    case 2:
+	return ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+    case 3:
+	return ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+    case 4:
+	return ((p[0] & 0x07) << 18) | ((p[1] & 0x3F) << 12) |
+	    ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+    default:
+	len = 1;
+	return 0xFFFD;
+    }
+}
+
+static void appendUtf8(string& out, unsigned int cp)
+{
+    if (cp < 0x80)
+	out += static_cast<char>(cp);
+    else if (cp < 0x800) {
+	out += static_cast<char>(0xC0 | (cp >> 6));
+	out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000) {
+	out += static_cast<char>(0xE0 | (cp >> 12));
+	out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+	out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else {
+	out += static_cast<char>(0xF0 | (cp >> 18));
+	out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+	out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+	out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+//// format detection ////
+
+// 'data' is the beginning of a file; isComplete is true if it's all.
+TextFormat detectTextFormat(const char* data, size_type length,
+    bool isComplete)
+{
+    TextFormat format{Encoding::Utf8, false, LineEnding::LF};
+    auto p = reinterpret_cast<const unsigned char*>(data);
+
+    if ((length >= 3) && (memcmp(data, UTF8_BOM, 3) == 0))
+	format.hasBom = true;
+    else if ((length >= 2) && (p[0] == 0xFF) && (p[1] == 0xFE)) {
+	format.encoding = Encoding::Utf16LE;
+	format.hasBom = true;
+    }
+    else if ((length >= 2) && (p[0] == 0xFE) && (p[1] == 0xFF)) {
+	format.encoding = Encoding::Utf16BE;
+	format.hasBom = true;
+    }
+    else {
+	// UTF-16 without BOM: mostly-ASCII text has a NUL in every other
+	// byte.  (Such a file would otherwise pass as valid UTF-8.)
+	size_type sample = std::min(length, UTF16_SAMPLE_SIZE) & ~1;
+	size_type evenNuls = 0, oddNuls = 0;
+	for (size_type i = 0; i < sample; i += 2) {
+	    evenNuls += (p[i] == 0);
+	    oddNuls += (p[i + 1] == 0);
+	}
+	if ((sample > 0) && (oddNuls > sample / 4) && (evenNuls < sample / 32))
+	    format.encoding = Encoding::Utf16LE;
+	else if ((sample > 0) && (evenNuls > sample / 4) &&
+		(oddNuls < sample / 32))
+	    format.encoding = Encoding::Utf16BE;
+	else {
+	    size_type checkLength =
+		isComplete ? length : utf8CompleteLength(data, length);
+	    if (!isValidUtf8(data, checkLength))
+		format.encoding = Encoding::Latin1;
+	}
+    }
+
+    // The first line ending decides.
+    if ((format.encoding == Encoding::Utf16LE) ||
+	    (format.encoding == Encoding::Utf16BE)) {
+	const size_type lo = (format.encoding == Encoding::Utf16LE) ? 0 : 1;
+	for (size_type i = 2; i + 1 < length; i += 2) {
+	    if ((p[i + lo] == '\n') && (p[i + 1 - lo] == 0)) {
+		if ((p[i - 2 + lo] == '\r') && (p[i - 1 - lo] == 0))
+		    format.lineEnding = LineEnding::CRLF;
+		break;
+	    }
+	}
+    }
+    else {
+	auto nl = static_cast<const char*>(memchr(data, '\n', length));
+	if ((nl != nullptr) && (nl > data) && (nl[-1] == '\r'))
+	    format.lineEnding = LineEnding::CRLF;
+    }
+
+    return format;
+}
+
+string encodingName(const TextFormat& format)
+{
+    string result;
+    switch (format.encoding) {
+    case Encoding::Utf8:
+	result = "UTF-8";
+	break;
+    case Encoding::Latin1:
+	result = "ISO-8859-1";
+	break;
+    case Encoding::Utf16LE:
+	result = "UTF-16LE";
+	break;
+    case Encoding::Utf16BE:
+	result = "UTF-16BE";
+	break;
+    }
+    if (format.hasBom)
+	result += " with BOM";
+    if (format.lineEnding == LineEnding::CRLF)
+	result += ", CRLF";
+    return result;
+}
+
+// True if the file can be used as is, without decoding.
+bool isPlainUtf8(const TextFormat& format)
+{
+    return (format.encoding == Encoding::Utf8) && !format.hasBom &&
+	(format.lineEnding == LineEnding::LF);
+}
+
+//// decoder impl class ////
+
+class Decoder::Impl
+{
+public:
+    Impl(Decoder* parent, const TextFormat& format);
+    ~Impl() = default;
+    string decode(const char* data, size_type length, bool isLast);
+    bool isLossy();
+    void toUtf8(const char* data, size_type length, bool isLast,
+	string& out);
+    void normalizeLineEndings(string& text, bool isLast);
+
+    Decoder* decoder;
+    TextFormat format;
+    bool atStart;	// BOM not yet skipped
+    string carry;	// undecoded bytes at the end of the last chunk
+    unsigned int highSurrogate;	// pending UTF-16 high surrogate; or 0
+    bool pendingCR;	// the last chunk ended with CR
+    bool lossy;	// invalid UTF-8 has been replaced
+};
+
+Decoder::Impl::Impl(Decoder* parent, const TextFormat& format_)
+    : decoder{parent}, format(format_), atStart{true}, carry{""},
+      highSurrogate{0}, pendingCR{false}, lossy{false}
+{
+}
+
+string Decoder::Impl::decode(const char* data, size_type length,
+    bool isLast)
+{
+    string out;
+    out.reserve(length + length / 8);
+    if (carry.empty())
+	toUtf8(data, length, isLast, out);
+    else {
+	string joined = carry + string(data, length);
+	carry.clear();
+	toUtf8(joined.data(), joined.size(), isLast, out);
+    }
+    if (format.lineEnding == LineEnding::CRLF)
+	normalizeLineEndings(out, isLast);
+    return out;
+}
+
+// @return	true if some invalid UTF-8 has been replaced with U+FFFD.
+//		The text is not what the file says, and saving it would
+//		write the replacement back.
+bool Decoder::Impl::isLossy()
+{
+    return lossy;
+}
+
+void Decoder::Impl::toUtf8(const char* data, size_type length, bool isLast,
+    string& out)
+{
+    auto p = reinterpret_cast<const unsigned char*>(data);
+    size_type i = 0;
+
+    if (atStart && format.hasBom && (format.encoding != Encoding::Latin1)) {
+	size_type bomLength = (format.encoding == Encoding::Utf8) ? 3 : 2;
+	if ((length < bomLength) && !isLast) {
+	    carry.assign(data, length);
+	    return;
+	}
+	i = std::min(bomLength, length);
+    }
+    atStart = false;
+
+    switch (format.encoding) {
+    case Encoding::Utf8: {
+	size_type end = isLast ? length :
+	    i + utf8CompleteLength(data + i, length - i);
+	if (isValidUtf8(data + i, end - i))
+	    out.append(data + i, end - i);
+	else {
+	    out += makeValidUtf8(data + i, end - i);
+	    lossy = true;
+	}
+	carry.assign(data + end, length - end);
+	break;
+    }
+    case Encoding::Latin1:
+	for (; i < length; ++i)
+	    appendUtf8(out, p[i]);
+	break;
+    case Encoding::Utf16LE:
+    case Encoding::Utf16BE: {
+	const bool le = (format.encoding == Encoding::Utf16LE);
+	for (; i + 1 < length; i += 2) {
+	    unsigned int unit = le ? (p[i] | (p[i + 1] << 8)) :
+		((p[i] << 8) | p[i + 1]);
+	    if ((unit >= 0xD800) && (unit < 0xDC00)) {	// high surrogate
+		if (highSurrogate != 0)
+		    appendUtf8(out, 0xFFFD);
+		highSurrogate = unit;
+		continue;
+	    }
+	    if ((unit >= 0xDC00) && (unit < 0xE000)) {	// low surrogate
+		if (highSurrogate == 0)
+		    appendUtf8(out, 0xFFFD);
+		else appendUtf8(out, 0x10000 + ((highSurrogate - 0xD800) << 10)
+		    + (unit - 0xDC00));
+		highSurrogate = 0;
+		continue;
+	    }
+	    if (highSurrogate != 0) {
+		appendUtf8(out, 0xFFFD);
+		highSurrogate = 0;
+	    }
+	    appendUtf8(out, unit);
+	}
+	if (i < length) {	// odd byte
+	    if (isLast)
+		appendUtf8(out, 0xFFFD);
+	    else carry.assign(data + i, 1);
+	}
+	if (isLast && (highSurrogate != 0)) {
+	    appendUtf8(out, 0xFFFD);
+	    highSurrogate = 0;
+	}
+	break;
+    }
+    }
+}
+
+// CRLF -> LF.  A lone CR is kept.
+void Decoder::Impl::normalizeLineEndings(string& text, bool isLast)
+{
+    string result;
+    result.reserve(text.size() + 1);
+    size_type i = 0;
+
+    if (text.empty() && !isLast)
+	return;
+    if (pendingCR) {
+	if (text.empty() || (text[0] != '\n'))
+	    result += '\r';
+	pendingCR = false;
+    }
+    while (i < text.size()) {
+	auto cr = text.find('\r', i);
+	if (cr == string::npos) {
+	    result.append(text, i, string::npos);
+	    break;
+	}
+	result.append(text, i, cr - i);
+	if (cr + 1 == text.size()) {	// CR at the end of the chunk
+	    if (isLast)
+		result += '\r';
+	    else pendingCR = true;
+	}
+	else if (text[cr + 1] != '\n')
+	    result += '\r';
+	i = cr + 1;
+    }
+    text.swap(result);
+}
+
+//// encoder impl class ////
+
+class Encoder::Impl
+{
+public:
+    Impl(Encoder* parent, const TextFormat& format);
+    ~Impl() = default;
+    bool encode(const char* data, size_type length, string& out);
+
+    Encoder* encoder;
+    TextFormat format;
+    bool atStart;	// BOM not yet written
+};
+
+Encoder::Impl::Impl(Encoder* parent, const TextFormat& format_)
+    : encoder{parent}, format(format_), atStart{true}
+{
+}
+
+// Append the encoded 'data' to 'out'.
+// @return	false if some character cannot be encoded
+bool Encoder::Impl::encode(const char* data, size_type length, string& out)
+{
+    if (atStart && format.hasBom) {
+	switch (format.encoding) {
+	case Encoding::Utf8:
+	    out.append(UTF8_BOM);
+	    break;
+	case Encoding::Utf16LE:
+	    out.append("\xFF\xFE");
+	    break;
+	case Encoding::Utf16BE:
+	    out.append("\xFE\xFF");
+	    break;
+	case Encoding::Latin1:
+	    break;
+	}
+    }
+    atStart = false;
+
+    string expanded;	// with CRLF
+    if (format.lineEnding == LineEnding::CRLF) {
+	expanded.reserve(length + length / 16);
+	size_type i = 0;
+	while (i < length) {
+	    auto nl = static_cast<const char*>(
+		memchr(data + i, '\n', length - i));
+	    size_type end = (nl == nullptr) ? length : nl - data;
+	    expanded.append(data + i, end - i);
+	    if (nl == nullptr)
+		break;
+	    expanded.append("\r\n");
+	    i = end + 1;
+	}
+	data = expanded.data();
+	length = expanded.size();
+    }
+
+    if (format.encoding == Encoding::Utf8) {
+	out.append(data, length);
+	return true;
+    }
+
+    bool ok = true;
+    auto p = reinterpret_cast<const unsigned char*>(data);
+    for (size_type i = 0; i < length; ) {
+	size_type len;
+	unsigned int cp = decodeUtf8(p + i, length - i, len);
+	i += len;
+	switch (format.encoding) {
+	case Encoding::Latin1:
+	    if (cp > 0xFF) {
+		ok = false;
+		cp = '?';
+	    }
+	    out += static_cast<char>(cp);
+	    break;
+	case Encoding::Utf16LE:
+	case Encoding::Utf16BE: {
+	    unsigned int units[2];
+	    int numUnits = 1;
+	    units[0] = cp;
+	    if (cp >= 0x10000) {
+		units[0] = 0xD800 + ((cp - 0x10000) >> 10);
+		units[1] = 0xDC00 + ((cp - 0x10000) & 0x3FF);
+		numUnits = 2;
+	    }
+	    for (int u = 0; u < numUnits; ++u) {
+		char lo = static_cast<char>(units[u] & 0xFF);
+		char hi = static_cast<char>(units[u] >> 8);
+		if (format.encoding == Encoding::Utf16LE) {
+		    out += lo;
+		    out += hi;
+		} else {
+		    out += hi;
+		    out += lo;
+		}
+	    }
+	    break;
+	}
+	case Encoding::Utf8:
+	    break;
+	}
+    }
+    return ok;
+}
+
+//// interface classes ////
+
+Decoder::Decoder(const TextFormat& format)
+    : pimpl{new Impl{this, format}} {}
+Decoder::~Decoder() = default;
+string Decoder::decode(const char* data, size_type length, bool isLast) {
+    return pimpl->decode(data, length, isLast);
+}
+bool Decoder::isLossy() { return pimpl->isLossy(); }
+
+Encoder::Encoder(const TextFormat& format)
+    : pimpl{new Impl{this, format}} {}
+Encoder::~Encoder() = default;
+bool Encoder::encode(const char* data, size_type length, string& out) {
+    return pimpl->encode(data, length, out);
+}
+
+// eof
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+// How a file is stored on disk.  Buffers and Documents always hold UTF-8
+// with LF line endings; the format is restored when the file is saved.
+enum class Encoding: unsigned int {
+    Utf8,
+    Latin1,	// ISO-8859-1; the fallback for invalid UTF-8
+    Utf16LE,
+    Utf16BE,
+};
+
+enum class LineEnding: unsigned int {
+    LF,
+    CRLF,
+};
+
+struct TextFormat
+{
+    Encoding encoding;
+    bool hasBom;
+    LineEnding lineEnding;
+};
+
+TextFormat detectTextFormat(const char* data, std::string::size_type length,
+    bool isComplete);
+std::string encodingName(const TextFormat& format);
+bool isPlainUtf8(const TextFormat& format);
+bool isValidUtf8(const char* data, std::string::size_type length);
+std::string makeValidUtf8(const char* data, std::string::size_type length);
+
+// Converts a file's content, fed in consecutive chunks, to UTF-8 with LF
+// line endings.
+class Decoder
+{
+public:
+    explicit Decoder(const TextFormat& format);
+    virtual ~Decoder();
+    std::string decode(const char* data, std::string::size_type length,
+	bool isLast);
+    bool isLossy();
+private:
+    Decoder(const Decoder&) = delete;	// copy ctor
+    Decoder(Decoder&&) = delete;
+    Decoder& operator=(const Decoder&) = delete;
+    Decoder& operator=(Decoder&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// The other way around.  The chunks must not split a UTF-8 sequence.
+class Encoder
+{
+public:
+    explicit Encoder(const TextFormat& format);
+    virtual ~Encoder();
+    bool encode(const char* data, std::string::size_type length,
+	std::string& out);
+private:
+    Encoder(const Encoder&) = delete;	// copy ctor
+    Encoder(Encoder&&) = delete;
+    Encoder& operator=(const Encoder&) = delete;
+    Encoder& operator=(Encoder&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
@@ -1,86 +1,357 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
 #include <string>
 #include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/optional.hpp>
+#include "command.h"
+#include "compression.h"
+#include "deltaqueue.h"
+#include "diff.h"
+#include "document.h"
+#include "encoding.h"
 #include "global.h"
 #include "file.h"
+#include "filemgr.h"
+#include "journal.h"
+#include "pager.h"
+#include "pathtable.h"
+#include "undotree.h"
 #include "util.h"
+#include "worker.h"
 
 using sigc::mem_fun;
+using std::make_shared;
+using std::shared_ptr;
 using std::string;
-using std::vector;
 using std::unique_ptr;
+using std::vector;
 using boost::optional;
 
+// The loader and the saver work in chunks of this size.  The first chunk
+// loaded is smaller so that the first screenful shows up right away.
+static const Storage::size_type FIRST_CHUNK_SIZE = 64 * 1024;
+static const Storage::size_type CHUNK_SIZE = 256 * 1024;
+
+// Files this large are opened in the read-only pager mode, and only
+// PAGER_WINDOW_LINES lines around the viewport are kept in the buffer.
+static const goffset PAGER_THRESHOLD = 256 * 1024 * 1024;
+static const Pager::size_type PAGER_WINDOW_LINES = 4000;
+
+// umask(2) cannot be read without setting it, so read it once at startup,
+// before any worker thread exists.
+static const mode_t PROCESS_UMASK = []() {
+    mode_t m = umask(0);
+    umask(m);
+    return m;
+}();
+
+// Memory limit of the undo history of each File.  MYEDITOR_UNDO_LIMIT in
+// the environment overrides it (in MiB).
+static const UndoTree::size_type UNDO_MEMORY_LIMIT = []() {
+    const char* env = getenv("MYEDITOR_UNDO_LIMIT");
+    unsigned long mib = (env != nullptr) ? strtoul(env, nullptr, 10) : 0;
+    return static_cast<UndoTree::size_type>((mib > 0) ? mib : 16) << 20;
+}();
+
+// Compressed files are saved at this level, 0 (fastest) to 9 (smallest).
+// MYEDITOR_COMPRESSION_LEVEL in the environment overrides it.
+static const int COMPRESSION_LEVEL = []() {
+    const char* env = getenv("MYEDITOR_COMPRESSION_LEVEL");
+    char* end = nullptr;
+    long level = (env != nullptr) ? strtol(env, &end, 10) : -1;
+    if ((env == nullptr) || (end == env) || (level < 0) || (level > 9))
+	return 6;
+    return static_cast<int>(level);
+}();
+
+// Undo histories are stored here when the files are saved.
+static string getUndoPath(const string& path)
+{
+    return Glib::get_home_dir() + "/.myeditor/undo/" + hashPath(path) +
+	".undo";
+}
+
+// @return	true if any of 'pieces' is in a mapping of a file that has
+//		been written to by someone else
+static bool hasStaleMapping(const vector<Document::Piece>& pieces)
+{
+    for (const auto& p: pieces) {
+	auto mapped = dynamic_cast<const MappedStorage*>(p.storage.get());
+	if (mapped && mapped->isStale())
+	    return true;
+    }
+    return false;
+}
+
+// Shared between a File and its loader or saver job running on a worker
+// thread.  Once 'cancelled' is set, nothing posted by the job touches the
+// File.
+struct JobState
+{
+    JobState() : cancelled{false} {}
+    std::atomic<bool> cancelled;
+};
+
 //// impl class ////
 
 class File::Impl
 {
 public:
-    Impl(File* parent, const string& path);
-    ~Impl() = default;
-    optional<string> init();
-    void addBuffer(const GsvBuffer& buf);
-    void deleteBuffer(const GsvBuffer& buf);
+    Impl(File* parent, FileId id);
+    ~Impl();
+    optional<string> init(GioFileInfo info);
+    void cancelLoading();
+    void discardJournal();
+    GsvBuffer getBuffer();
+    Document& getDocument();
+    string getEtag();
     GioFile getGioFile();
-    GsvBuffer getNewBuffer();
-    void save(const string& text);
+    unsigned int getLoadProgress();
+    Storage::size_type getMemoryUsage();
+    shared_ptr<Pager> getPager();
+    bool isLoading();
+    Pager::size_type pageTo(Pager::size_type line);
+    void placeCursor(int charOffset);
+    void redo();
+    void reload(const File::ReloadCallback& onRead);
+    void replayJournal(const string& etag, const vector<Delta>& deltas);
+    void save();
+    void undo();
+    void applyJournal();
+    void applyUndoEdits(const vector<UndoTree::Edit>& edits);
+    void checkDisk();
+    void detachFromDisk();
+    void saveUndo();
+    void scheduleFlush();
+    void startIndexing();
+    void startJournal();
+    void startLoading();
+    void startLoadingUndo();
+    void startMonitoring();
+    void updateEtag();
+    static void decompressorJob(Impl* self, shared_ptr<JobState> state,
+	const string& path, Compression compression);
+    static void loaderJob(Impl* self, shared_ptr<JobState> state,
+	const string& path);
+    static void loaderPostChunk(Impl* self, shared_ptr<JobState> state,
+	shared_ptr<const Storage> storage, Storage::size_type start,
+	Storage::size_type length, Storage::size_type rawLength);
+    static void loaderPostDecoded(Impl* self, shared_ptr<JobState> state,
+	const string& text, Storage::size_type rawLength);
+    static void loaderPostFormat(Impl* self, shared_ptr<JobState> state,
+	const TextFormat& format);
+    static void reloaderJob(Impl* self, shared_ptr<JobState> state,
+	const string& path, const vector<Document::Piece>& pieces,
+	unsigned long editCount, optional<uint64_t> knownHash,
+	Compression compression, const File::ReloadCallback& onRead);
+    static void reloaderPost(shared_ptr<JobState> state,
+	const File::ReloadCallback& onRead,
+	const std::function<bool()>& apply);
+    static void saverJob(Impl* self, shared_ptr<JobState> state,
+	const string& path, const vector<Document::Piece>& pieces,
+	const TextFormat& format, Compression compression);
+    static optional<string> writeAtomically(const string& path,
+	const vector<Document::Piece>& pieces, const TextFormat& format,
+	Compression compression);
 
+    void bufferOnBeginUserAction();
+    void bufferOnEndUserAction();
     void bufferOnErase(const Gtk::TextBuffer::iterator start,
 	const Gtk::TextBuffer::iterator end);
     void bufferOnInsert(const Gtk::TextBuffer::iterator& pos,
 	const Glib::ustring& text, int bytes);
+    void deltaQueueOnFlush(const vector<Delta>& deltas);
+    bool idleOnFlush();
+    void loaderOnChunk(shared_ptr<const Storage> storage,
+	Storage::size_type start, Storage::size_type length,
+	Storage::size_type rawLength);
+    void indexerOnProgress(Pager::size_type indexedBytes);
+    void loaderOnDone(const optional<string>& errmsg);
+    void loaderOnRestart();
+    void monitorOnChanged(const GioFile& file, const GioFile& otherFile,
+	Gio::FileMonitorEvent event);
+    bool reloaderOnDone(const optional<string>& errmsg,
+	const TextFormat& format, const vector<Hunk>& hunks,
+	unsigned long editCount, uint64_t hash);
+    bool reloaderOnUnchanged();
+    void saverOnDone(const optional<string>& errmsg,
+	Storage::size_type numBytes);
+    void undoLoaderOnDone(shared_ptr<UndoTree> tree,
+	const optional<string>& treeEtag, unsigned long loadedEditCount);
 
+    FileId id;
     GioFile giofile;
-    bool modifying;	// multi-buffer modification is in progress
+    bool loaderInserting;	// the loader is changing the buffer
     string path;
-    unique_ptr<vector<GsvBuffer>> buffers;
+    GsvBuffer buffer;	// shared by every FileWindow showing this File
+    unique_ptr<Document> document;	// unused in the pager mode
+    shared_ptr<Pager> pager;	// null unless in the pager mode
+    DeltaQueue deltaQueue;	// edits not yet applied to the document
+    sigc::connection flushConnection;	// pending idle flush
+    shared_ptr<JobState> loadState;	// null unless loading
+    bool partiallyLoaded;	// loading was cancelled
+    bool lossyLoad;	// invalid UTF-8 read from a FIFO was replaced
+    goffset loadedBytes;
+    goffset totalBytes;
+    TextFormat textFormat;	// on disk; restored on save
+    Compression compression;	// on disk; restored on save
+    shared_ptr<JobState> saveState;	// null unless saving
+    bool saveAgain;	// 'w' was issued during a save
+    unsigned long savedEditCount;	// editCount at the save snapshot
+    Document::size_type savedNumChars;	// length of the save snapshot
+    string etag;	// of the file on disk, as we last saw it
+    optional<uint64_t> diskHash;	// of the file on disk, if known
+    Glib::RefPtr<Gio::FileMonitor> monitor;
+    bool checkAfterSave;	// the file changed on disk during a save
+    shared_ptr<JobState> reloadState;	// null unless reloading
+    unsigned long editCount;	// edits to the buffer so far
+    unique_ptr<Journal> journal;	// null while loading or paging
+    optional<Journal::Contents> pendingReplay;	// to replay when loaded
+    shared_ptr<UndoTree> undoTree;	// shared by every FileWindow
+    bool undoing;	// applying an undo or redo to the buffer
+    UndoTree::NodeId snapshotUndoNode;	// at the save snapshot
+    UndoTree::NodeId savedUndoNode;	// matches the file on disk
+    shared_ptr<JobState> undoLoadState;	// null unless loading history
+    int pendingCursor;	// to place when loaded; -1 if none
+    sigc::signal<void> loadStateChanged;
 };
 
-File::Impl::Impl(File* parent, const string& path_)
-    : modifying{false}, path{path_}, buffers{new vector<GsvBuffer>()}
+File::Impl::Impl(File* parent, FileId id_)
+    : id{id_}, loaderInserting{false}, path{pathTable->getFullPath(id_)},
+      document{new Document()},
+      pager{nullptr}, loadState{nullptr}, partiallyLoaded{false},
+      lossyLoad{false}, loadedBytes{0}, totalBytes{0}, textFormat{Encoding::Utf8, false, LineEnding::LF},
+      compression{Compression::None},
+      saveState{nullptr}, saveAgain{false}, savedEditCount{0}, savedNumChars{0},
+      etag{""},
+      checkAfterSave{false}, reloadState{nullptr}, editCount{0},
+      undoTree{make_shared<UndoTree>(UNDO_MEMORY_LIMIT)}, undoing{false},
+      snapshotUndoNode{0}, savedUndoNode{0}, undoLoadState{nullptr},
+      pendingCursor{-1}
 {
 }
 
+File::Impl::~Impl()
+{
+    flushConnection.disconnect();
+    if (loadState)
+	loadState->cancelled = true;
+    if (saveState)
+	saveState->cancelled = true;	// The save itself completes, though.
+    if (reloadState)
+	reloadState->cancelled = true;
+    if (undoLoadState)
+	undoLoadState->cancelled = true;
+    if (monitor)
+	monitor->cancel();
+    if (journal)
+	journal->discard();	// closed on purpose
+}
+
 // Return none on success, error message on failure.
-optional<string> File::Impl::init() {
-    path = toFullPath(".", path);
+// The file content is loaded in the background; see isLoading().
+// @param info	as returned by queryInfo(), if the caller has it already
+optional<string> File::Impl::init(GioFileInfo info) {
     giofile = Gio::File::create_for_path(path);
 
-    string fileContent{""};
+    bool exists = true;
     try {
-	fileContent = Glib::file_get_contents(path);
+	if (!info)
+	    info = File::queryInfo(giofile);
+	if (info->get_file_type() == Gio::FileType::FILE_TYPE_DIRECTORY)
+	    return optional<string>("is a directory: " + entilde(path));
+	totalBytes = info->get_size();
+	etag = info->get_etag();
     }
-    catch (Glib::FileError& e) {
-	if (e.code() != Glib::FileError::Code::NO_SUCH_ENTITY)
+    catch (Gio::Error& e) {
+	if (e.code() != Gio::Error::NOT_FOUND)
 	    return optional<string>(e.what());	// error
-	// Otherwise, that's a new file.  Nothing to do.
+	// Otherwise, that's a new file.  Nothing to load.
+	exists = false;
     }
+    compression = detectCompression(path);
+    if (compression == Compression::Zstd)
+	return optional<string>("zstd compression is not supported: " +
+	    entilde(path));
 
-    auto buf = Gsv::Buffer::create();
-    buf->begin_not_undoable_action();
-    buf->set_text(fileContent);
-    buf->place_cursor(buf->begin());
-    buf->end_not_undoable_action();
-    buf->signal_erase().connect(mem_fun(*this,
+    deltaQueue.addConsumer(mem_fun(*this, &File::Impl::deltaQueueOnFlush));
+    buffer = Gsv::Buffer::create();
+    buffer->set_max_undo_levels(0);	// We have our own; see undo().
+    buffer->signal_begin_user_action().connect(mem_fun(*this,
+	&File::Impl::bufferOnBeginUserAction));
+    buffer->signal_end_user_action().connect(mem_fun(*this,
+	&File::Impl::bufferOnEndUserAction));
+    buffer->signal_erase().connect(mem_fun(*this,
 	&File::Impl::bufferOnErase), false);
-    buf->signal_insert().connect(mem_fun(*this,
+    buffer->signal_insert().connect(mem_fun(*this,
 	&File::Impl::bufferOnInsert), false);
+    startMonitoring();
 
-    buffers->push_back(buf);
-
+    if (exists && (compression == Compression::None) &&
+	    (totalBytes >= PAGER_THRESHOLD)) {
+	shared_ptr<const Storage> mapping = MappedStorage::create(path);
+	if (mapping) {
+	    pager = make_shared<Pager>(mapping);
+	    buffer->set_highlight_syntax(false);
+	    startIndexing();
+	    return optional<string>();
+	}
+    }
+    if (exists)
+	startLoading();
+    else startJournal();
     return optional<string>();
 }
 
-void File::Impl::addBuffer(const GsvBuffer& buf)
+// Stop loading.  The buffer keeps what has been loaded so far, but such
+// a File cannot be saved.
+void File::Impl::cancelLoading()
+{
+    if (!loadState)
+	return;
+    loadState->cancelled = true;
+    loadState = nullptr;
+    partiallyLoaded = true;
+    commandMgr->log("loading cancelled: " + entilde(path));
+    loadStateChanged.emit();
+}
+
+// Forget the edits not saved, e.g. when the editor quits.
+void File::Impl::discardJournal()
 {
-    buffers->push_back(buf);
+    if (journal)
+	journal->discard();
+    journal.reset();
 }
 
-void File::Impl::deleteBuffer(const GsvBuffer& buf)
+// Every FileWindow for this File shows this very buffer, so opening
+// another view costs neither memory nor time.
+GsvBuffer File::Impl::getBuffer()
 {
-    buffers->erase(
-	std::remove(buffers->begin(), buffers->end(), buf),
-	end(*buffers));
+    return buffer;
+}
+
+// @return	the document, with all the pending edits applied
+Document& File::Impl::getDocument()
+{
+    deltaQueue.flush();
+    return *document;
+}
+
+// @return	etag of the file on disk when we last loaded or saved it
+string File::Impl::getEtag()
+{
+    return etag;
 }
 
 GioFile File::Impl::getGioFile()
@@ -88,85 +359,1217 @@ GioFile File::Impl::getGioFile()
     return giofile;
 }
 
-GsvBuffer File::Impl::getNewBuffer() {
-    string fileContent = (*(buffers->begin()))->get_text();
+// @return	percentage of the file loaded so far
+unsigned int File::Impl::getLoadProgress()
+{
+    if (!loadState || (totalBytes == 0))
+	return 100;
+    return static_cast<unsigned int>(
+	std::min<goffset>(100, loadedBytes * 100 / totalBytes));
+}
+
+shared_ptr<Pager> File::Impl::getPager()
+{
+    return pager;
+}
 
-    auto newBuffer = Gsv::Buffer::create();
-    newBuffer->begin_not_undoable_action();
-    newBuffer->set_text(fileContent);
-    newBuffer->place_cursor(newBuffer->begin());
-    newBuffer->end_not_undoable_action();
-    newBuffer->signal_erase().connect(mem_fun(*this,
-	&File::Impl::bufferOnErase), false);
-    newBuffer->signal_insert().connect(mem_fun(*this,
-	&File::Impl::bufferOnInsert), false);
+// A rough estimate of the memory held: the text, once in the document
+// and once in the buffer, and the undo history.
+Storage::size_type File::Impl::getMemoryUsage()
+{
+    return document->getSize() + buffer->get_char_count() +
+	undoTree->getMemoryUsage();
+}
 
-    buffers->push_back(newBuffer);
-    return newBuffer;
+bool File::Impl::isLoading()
+{
+    return loadState != nullptr;
 }
 
-void File::Impl::save(const string& text)
+// Pager mode: show the window of lines around 'line' in the buffer.
+// @return	where 'line' is in the buffer (0-based)
+Pager::size_type File::Impl::pageTo(Pager::size_type line)
 {
-    string new_etag;
-    giofile->replace_contents(text, "", new_etag, nullptr);
+    auto numLines = pager->getNumLines();
+    if ((numLines > 0) && (line >= numLines))
+	line = numLines - 1;
+    Pager::size_type first = (line > PAGER_WINDOW_LINES / 2) ?
+	line - PAGER_WINDOW_LINES / 2 : 0;
+
+    string text = pager->getLines(first, PAGER_WINDOW_LINES);
+    if (!isValidUtf8(text.data(), text.size()))
+	text = makeValidUtf8(text.data(), text.size());	// for set_text()
+    pager->setWindowFirstLine(first);
+    buffer->begin_not_undoable_action();
+    buffer->set_text(text.data(), text.data() + text.size());
+    buffer->place_cursor(buffer->get_iter_at_line(line - first));
+    buffer->end_not_undoable_action();
+    loadStateChanged.emit();	// for updating the labels
+    return line - first;
 }
 
-//// event handlers ////
+// Bring the buffer up to date with the file on disk, discarding local
+// changes.  Only the lines that differ are replaced, so the cursors and
+// the undo history survive.
+// If 'onRead' is given, it decides when the changes are applied; see
+// FileMgr::reloadFiles().  It's called even if the reload fails.
+void File::Impl::reload(const File::ReloadCallback& onRead)
+{
+    if (loadState || pager) {
+	commandMgr->log(string(loadState ? "cannot reload while loading: " :
+	    "cannot reload in the pager mode: ") + entilde(path));
+	if (onRead)
+	    onRead([]() { return false; });
+	return;
+    }
 
-// Deletes text from other buffers related to this File.
-void File::Impl::bufferOnErase(const Gtk::TextBuffer::iterator start,
-    const Gtk::TextBuffer::iterator end)
+    if (reloadState)
+	reloadState->cancelled = true;
+    reloadState = make_shared<JobState>();
+    detachFromDisk();	// The reloader reads the old text.
+    // An unmodified buffer holds what was on disk; if the file still
+    // hashes the same, there's nothing to do.
+    optional<uint64_t> knownHash;
+    if (!buffer->get_modified() && !partiallyLoaded)
+	knownHash = diskHash;
+    workerPool->post(std::bind(&File::Impl::reloaderJob, this, reloadState,
+	path, getDocument().getPieces(), editCount, knownHash, compression,
+	onRead));
+}
+
+// Undo the last edit, in every view of this File.
+void File::Impl::undo()
+{
+    if (loadState || pager)
+	return;
+    auto edits = undoTree->undo();
+    if (edits.empty())
+	commandMgr->log("nothing to undo");
+    else applyUndoEdits(edits);
+}
+
+// Runs on a worker thread.  Read the file and diff it against the
+// snapshot 'pieces' of the document.  A compressed file is decompressed
+// as a whole, since the diff needs the whole text anyway.
+void File::Impl::reloaderJob(Impl* self, shared_ptr<JobState> state,
+    const string& path, const vector<Document::Piece>& pieces,
+    unsigned long editCount, optional<uint64_t> knownHash,
+    Compression compression, const File::ReloadCallback& onRead)
+{
+    std::ifstream ifs{path, std::ios::in | std::ios::binary};
+    if (!ifs) {
+	reloaderPost(state, onRead, [self, path]() {
+	    return self->reloaderOnDone(
+		optional<string>("cannot read: " + path), TextFormat(),
+		vector<Hunk>(), 0, 0);
+	});
+	return;
+    }
+    string raw{std::istreambuf_iterator<char>(ifs),
+	std::istreambuf_iterator<char>()};
+    const uint64_t hash = hashBytes(raw.data(), raw.size());
+    if (state->cancelled || (knownHash && (*knownHash == hash))) {
+	reloaderPost(state, onRead, [self]() {
+	    return self->reloaderOnUnchanged();
+	});
+	return;
+    }
+
+    if (compression != Compression::None) {
+	Decompressor decompressor{compression};
+	decompressor.feed(raw.data(), raw.size(), true);
+	string decompressed;
+	for (;;) {
+	    string s = decompressor.read(CHUNK_SIZE);
+	    if (s.empty())
+		break;
+	    decompressed += s;
+	}
+	if (!decompressor.isComplete()) {
+	    reloaderPost(state, onRead, [self, path]() {
+		return self->reloaderOnDone(
+		    optional<string>("cannot decompress: " + path),
+		    TextFormat(), vector<Hunk>(), 0, 0);
+	    });
+	    return;
+	}
+	raw.swap(decompressed);
+    }
+
+    auto format = detectTextFormat(raw.data(), raw.size(), true);
+    string newText = Decoder{format}.decode(raw.data(), raw.size(), true);
+    raw.clear();
+    string oldText;
+    for (const auto& p: pieces)
+	oldText.append(p.storage->data() + p.start, p.length);
+    auto hunks = diffLines(oldText, newText);
+
+    reloaderPost(state, onRead, [self, format, hunks, editCount, hash]() {
+	return self->reloaderOnDone(optional<string>(), format, hunks,
+	    editCount, hash);
+    });
+}
+
+// Hand the result of the reloader job to the main loop.  Nothing is
+// applied once the job is cancelled, but 'onRead' is called anyway.
+void File::Impl::reloaderPost(shared_ptr<JobState> state,
+    const File::ReloadCallback& onRead, const std::function<bool()>& apply)
+{
+    workerPool->postToMain([state, onRead, apply]() {
+	auto guarded = [state, apply]() {
+	    return !state->cancelled && apply();
+	};
+	if (onRead)
+	    onRead(guarded);
+	else guarded();
+    });
+}
+
+// Place the cursor of the buffer, or remember it until the file is loaded.
+void File::Impl::placeCursor(int charOffset)
+{
+    if (loadState) {
+	pendingCursor = charOffset;
+	return;
+    }
+    if (!pager)
+	buffer->place_cursor(buffer->get_iter_at_offset(charOffset));
+}
+
+// Redo the last undone edit, in every view of this File.
+void File::Impl::redo()
+{
+    if (loadState || pager)
+	return;
+    auto edits = undoTree->redo();
+    if (edits.empty())
+	commandMgr->log("nothing to redo");
+    else applyUndoEdits(edits);
+}
+
+// Replay the edits journaled before a crash onto the buffer.  The edits
+// are applied once the file is loaded, and left for the user to save.
+void File::Impl::replayJournal(const string& etag_,
+    const vector<Delta>& deltas)
+{
+    pendingReplay = Journal::Contents{path, etag_, deltas};
+    if (!loadState)
+	applyJournal();
+}
+
+// Write the document to disk in the background.
+// The snapshot is taken here, so the user may keep typing during the save.
+void File::Impl::save()
+{
+    if (loadState) {
+	commandMgr->log("cannot save while loading: " + entilde(path));
+	return;
+    }
+    if (partiallyLoaded) {
+	commandMgr->log("cannot save partially loaded file: " +
+	    entilde(path));
+	return;
+    }
+    if (lossyLoad) {
+	commandMgr->log("cannot save: invalid UTF-8 was replaced on loading "
+	    + entilde(path));
+	return;
+    }
+    if (pager) {
+	commandMgr->log("cannot save in the pager mode: " + entilde(path));
+	return;
+    }
+
+    if (saveState) {
+	saveAgain = true;	// after the save in progress
+	return;
+    }
+
+    // The file may have been rewritten or truncated without us being
+    // told, e.g. before the monitor fires or if there's none.
+    if (hasStaleMapping(getDocument().getPieces()))
+	detachFromDisk();
+
+    saveState = make_shared<JobState>();
+    savedEditCount = editCount;
+    snapshotUndoNode = undoTree->getCurrent();
+    savedNumChars = getDocument().getCharCount();
+    workerPool->post(std::bind(&File::Impl::saverJob, this, saveState, path,
+	getDocument().getPieces(), textFormat, compression));
+    commandMgr->log("saving " + entilde(path) + "...");
+}
+
+// Runs on a worker thread.
+void File::Impl::saverJob(Impl* self, shared_ptr<JobState> state,
+    const string& path, const vector<Document::Piece>& pieces,
+    const TextFormat& format, Compression compression)
+{
+    Storage::size_type numBytes = 0;
+    for (const auto& p: pieces)
+	numBytes += p.length;
+
+    // Rewritten since save() looked; the mapped pieces may read its new
+    // bytes.  Then save() detaches the document next time.
+    optional<string> errmsg;
+    if (hasStaleMapping(pieces))
+	errmsg = "changed on disk during the save, not written: " +
+	    entilde(path);
+    else errmsg = writeAtomically(path, pieces, format, compression);
+    workerPool->postToMain([self, state, errmsg, numBytes]() {
+	if (!state->cancelled)
+	    self->saverOnDone(errmsg, numBytes);
+    });
+}
+
+// Write 'pieces' to a temporary file next to 'path', fsync it, and rename
+// it over 'path'.  Either the old or the new content survives a crash.
+// The text is converted back to the encoding, BOM and line endings
+// 'format' of the original file, and compressed again if it was.
+// Return none on success, error message on failure.
+optional<string> File::Impl::writeAtomically(const string& path,
+    const vector<Document::Piece>& pieces, const TextFormat& format,
+    Compression compression)
 {
-    // We don't want other buffers to handle this signal.
-    // Note that 'buf->erase(...)' below causes another signal-erase !
-    if (modifying)
+    // Write thru symlinks rather than replacing them.
+    string target{path};
+    char resolved[PATH_MAX];
+    if (realpath(path.c_str(), resolved) != nullptr)
+	target = resolved;
+
+    auto idxSlash = target.rfind('/');
+    string dir{(idxSlash == 0) ? "/" : target.substr(0, idxSlash)};
+    string tmpPath{target + ".myeditor-XXXXXX"};
+    int fd = mkstemp(&tmpPath[0]);
+    if (fd < 0)
+	return optional<string>("cannot save " + path + ": " +
+	    strerror(errno));
+
+    // Keep the permission bits of the original file.
+    struct stat st;
+    if (stat(target.c_str(), &st) == 0)
+	fchmod(fd, st.st_mode & 07777);
+    else fchmod(fd, 0666 & ~PROCESS_UMASK);
+
+    // Stream the pieces; small ones are gathered into chunks.
+    string chunk;
+    chunk.reserve(CHUNK_SIZE);
+    bool ok = true;
+    auto writeRaw = [fd, &ok](const char* data, Storage::size_type length) {
+	while (ok && (length > 0)) {
+	    ssize_t n = write(fd, data, length);
+	    if ((n < 0) && (errno == EINTR))
+		continue;
+	    if (n <= 0) {
+		ok = false;
+		break;
+	    }
+	    data += n;
+	    length -= n;
+	}
+    };
+    unique_ptr<Compressor> compressor;
+    if (compression != Compression::None)
+	compressor.reset(new Compressor{compression, COMPRESSION_LEVEL});
+    string compressed;
+    auto writeAll = [&](const char* data, Storage::size_type length) {
+	if (!compressor) {
+	    writeRaw(data, length);
+	    return;
+	}
+	compressed.clear();
+	if (!compressor->compress(data, length, compressed)) {
+	    errno = EIO;
+	    ok = false;
+	}
+	writeRaw(compressed.data(), compressed.size());
+    };
+    Encoder encoder{format};
+    string encoded;
+    bool encodable = true;
+    auto writeText = [&](const char* data, Storage::size_type length) {
+	if (isPlainUtf8(format)) {
+	    writeAll(data, length);	// as is
+	    return;
+	}
+	do {	// even if empty, for the BOM
+	    auto n = std::min(length, CHUNK_SIZE);
+	    if ((n < length) && (utf8CompleteLength(data, n) > 0))
+		n = utf8CompleteLength(data, n);
+	    encoded.clear();
+	    if (!encoder.encode(data, n, encoded)) {
+		encodable = false;
+		ok = false;
+	    }
+	    writeAll(encoded.data(), encoded.size());
+	    data += n;
+	    length -= n;
+	} while (ok && (length > 0));
+    };
+    for (const auto& p: pieces) {
+	const char* data = p.storage->data() + p.start;
+	if (chunk.size() + p.length > CHUNK_SIZE) {
+	    writeText(chunk.data(), chunk.size());
+	    chunk.clear();
+	}
+	if (p.length >= CHUNK_SIZE)
+	    writeText(data, p.length);
+	else chunk.append(data, p.length);
+    }
+    writeText(chunk.data(), chunk.size());
+    if (compressor && ok) {
+	compressed.clear();
+	if (!compressor->finish(compressed)) {
+	    errno = EIO;
+	    ok = false;
+	}
+	writeRaw(compressed.data(), compressed.size());
+    }
+
+    if (!encodable) {
+	close(fd);
+	unlink(tmpPath.c_str());
+	return optional<string>("cannot save " + path +
+	    ": some characters cannot be encoded in " + encodingName(format));
+    }
+    if (ok)
+	ok = (fsync(fd) == 0);
+    int savedErrno = errno;
+    if ((close(fd) != 0) && ok) {
+	ok = false;
+	savedErrno = errno;
+    }
+    if (ok && (rename(tmpPath.c_str(), target.c_str()) != 0)) {
+	ok = false;
+	savedErrno = errno;
+    }
+    if (!ok) {
+	unlink(tmpPath.c_str());
+	return optional<string>("cannot save " + path + ": " +
+	    strerror(savedErrno));
+    }
+
+    // Make the rename itself durable.
+    int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirfd >= 0) {
+	fsync(dirfd);
+	close(dirfd);
+    }
+    return optional<string>();
+}
+
+void File::Impl::applyJournal()
+{
+    Journal::Contents contents = *pendingReplay;
+    pendingReplay = optional<Journal::Contents>();
+    if (pager || partiallyLoaded)
+	return;
+
+    if (contents.etag != etag) {
+	// The offsets in the journal are meaningless for this file.
+	// Keep the journal aside for the user.
+	string journalPath = Journal::getJournalPath(path);
+	rename(journalPath.c_str(), (journalPath + ".stale").c_str());
+	commandMgr->log("changed on disk since the crash; not recovered: " +
+	    entilde(path));
 	return;
-    modifying = true;
+    }
 
-    GsvBuffer currentBuffer =
-	Glib::RefPtr<Gsv::Buffer>::cast_dynamic(start.get_buffer());
-    for (auto buf: *buffers) {
-	if (buf == currentBuffer)
-	    continue;
-	auto startIntoBuf = buf->get_iter_at_offset(start.get_offset());
-	auto endIntoBuf = buf->get_iter_at_offset(end.get_offset());
-	buf->erase(startIntoBuf, endIntoBuf);
+    buffer->begin_user_action();
+    for (const auto& d: contents.deltas) {
+	auto numChars = static_cast<Delta::size_type>(buffer->get_char_count());
+	if (d.charOffset > numChars)
+	    break;	// Doesn't fit; the journal is broken.
+	auto pos = buffer->get_iter_at_offset(d.charOffset);
+	if (d.kind == Delta::Kind::Insert)
+	    buffer->insert(pos, d.text.data(), d.text.data() + d.text.size());
+	else buffer->erase(pos, buffer->get_iter_at_offset(
+	    std::min(d.charOffset + d.numChars, numChars)));
     }
+    buffer->end_user_action();
+    commandMgr->log("recovered " + std::to_string(contents.deltas.size()) +
+	" edits to " + entilde(path) + " (not saved yet)");
+}
 
-    modifying = false;
+void File::Impl::applyUndoEdits(const vector<UndoTree::Edit>& edits)
+{
+    Delta::size_type cursor = 0;
+    undoing = true;
+    buffer->begin_user_action();
+    for (const auto& e: edits) {
+	auto pos = buffer->get_iter_at_offset(e.charOffset);
+	auto numChars = utf8CharCount(e.text.data(), e.text.size());
+	if (e.isInsert) {
+	    buffer->insert(pos, e.text.data(), e.text.data() + e.text.size());
+	    cursor = e.charOffset + numChars;
+	} else {
+	    buffer->erase(pos, buffer->get_iter_at_offset(
+		e.charOffset + numChars));
+	    cursor = e.charOffset;
+	}
+    }
+    buffer->end_user_action();
+    undoing = false;
+    buffer->place_cursor(buffer->get_iter_at_offset(cursor));
+    buffer->set_modified(undoTree->getCurrent() != savedUndoNode);
+}
+
+// Store the undo history along with the file just saved, so that it's
+// there when the file is opened next time.  Only a snapshot is taken
+// here; it's serialized on a worker thread.
+void File::Impl::saveUndo()
+{
+    auto snapshot = undoTree->takeSnapshot(etag, savedUndoNode);
+    if (!snapshot)
+	return;
+    auto undoPath = getUndoPath(path);
+    workerPool->post([undoPath, snapshot]() {
+	const string data = UndoTree::serialize(*snapshot);
+	mkdir((Glib::get_home_dir() + "/.myeditor").c_str(), 0700);
+	mkdir((Glib::get_home_dir() + "/.myeditor/undo").c_str(), 0700);
+	// A temporary file of its own, since another save of the same
+	// file (or one whose path hashes the same) may be running.
+	string tmpPath{undoPath + ".XXXXXX"};
+	int fd = mkstemp(&tmpPath[0]);
+	if (fd < 0)
+	    return;
+	const char* p = data.data();
+	string::size_type left = data.size();
+	while (left > 0) {
+	    ssize_t n = write(fd, p, left);
+	    if ((n < 0) && (errno == EINTR))
+		continue;
+	    if (n <= 0)
+		break;
+	    p += n;
+	    left -= n;
+	}
+	if ((close(fd) != 0) || (left > 0) ||
+		(rename(tmpPath.c_str(), undoPath.c_str()) != 0))
+	    unlink(tmpPath.c_str());
+    });
 }
 
-// Insert text to other buffers related to this File.
+// The file on disk may have been changed by someone else.  Bring the
+// buffer up to date if it has no local changes; ask the user otherwise.
+void File::Impl::checkDisk()
+{
+    if (loadState || reloadState)
+	return;
+    if (saveState) {
+	checkAfterSave = true;	// most likely our own save
+	return;
+    }
+
+    string diskEtag;
+    try {
+	diskEtag = giofile->query_info(G_FILE_ATTRIBUTE_ETAG_VALUE)->get_etag();
+    }
+    catch (Gio::Error& e) {
+	if (e.code() == Gio::Error::NOT_FOUND)
+	    commandMgr->log("deleted on disk: " + entilde(path));
+	return;
+    }
+    if (diskEtag == etag)
+	return;
+
+    if (pager) {
+	etag = diskEtag;	// Tell it only once.
+	commandMgr->log("changed on disk: " + entilde(path) +
+	    " (open it again to see the changes)");
+	return;
+    }
+    detachFromDisk();
+    if (buffer->get_modified() || partiallyLoaded)
+	commandMgr->log("changed on disk: " + entilde(path) +
+	    " (\"reload\" to discard your changes)");
+    else fileMgr->scheduleReload(id);	// with the others changed at once
+}
+
+// Point the document at a copy of the buffer rather than at the mapping
+// of the file, which someone else has written.  Their changes show through
+// a private mapping, and a truncation turns the rest into zeros; the
+// buffer still has the text the document stands for.
+void File::Impl::detachFromDisk()
+{
+    Document& doc = getDocument();
+    auto pieces = doc.getPieces();
+    if (std::none_of(begin(pieces), end(pieces),
+	    [](const Document::Piece& p) {
+		return dynamic_cast<const MappedStorage*>(p.storage.get());
+	    }))
+	return;
+    string text = buffer->get_text();
+    auto storage = make_shared<HeapStorage>(text.size());
+    storage->append(text.data(), text.size());
+    doc.clear();
+    doc.append(storage, 0, text.size());
+}
+
+// Remember the etag of the file on disk, for detecting changes by others.
+// The file may have a new inode too, after a save or a reload.
+void File::Impl::updateEtag()
+{
+    try {
+	etag = giofile->query_info(G_FILE_ATTRIBUTE_ETAG_VALUE)->get_etag();
+    }
+    catch (Gio::Error& e) {
+	etag = "";
+    }
+    fileMgr->updateInode(id);
+}
+
+// Apply the pending edits to the document when the main loop is idle.
+void File::Impl::scheduleFlush()
+{
+    if (!flushConnection.connected())
+	flushConnection = Glib::signal_idle().connect(mem_fun(*this,
+	    &File::Impl::idleOnFlush), Glib::PRIORITY_LOW);
+}
+
+// Pager mode: build the line-offset index on a worker thread.
+void File::Impl::startIndexing()
+{
+    loadState = make_shared<JobState>();
+    loadedBytes = 0;
+    auto self = this;
+    auto state = loadState;
+    auto p = pager;
+    workerPool->post([self, state, p]() {
+	p->buildIndex([state]() { return state->cancelled.load(); },
+	    [self, state](Pager::size_type indexedBytes) {
+		workerPool->postToMain([self, state, indexedBytes]() {
+		    if (!state->cancelled)
+			self->indexerOnProgress(indexedBytes);
+		});
+	    });
+	workerPool->postToMain([self, state]() {
+	    if (!state->cancelled)
+		self->loaderOnDone(optional<string>());
+	});
+    });
+}
+
+// Journal the edits from now on, relative to the file on disk.
+void File::Impl::startJournal()
+{
+    journal.reset(new Journal{path, etag});
+}
+
+// Read the undo history stored when the file was saved last time.
+void File::Impl::startLoadingUndo()
+{
+    undoLoadState = make_shared<JobState>();
+    auto self = this;
+    auto state = undoLoadState;
+    auto undoPath = getUndoPath(path);
+    auto loadedEditCount = editCount;
+    workerPool->post([self, state, undoPath, loadedEditCount]() {
+	// Without a usable history, 'treeEtag' is left empty.
+	auto tree = make_shared<UndoTree>(UNDO_MEMORY_LIMIT);
+	optional<string> treeEtag;
+	std::ifstream ifs{undoPath, std::ios::in | std::ios::binary};
+	if (ifs) {
+	    string data{std::istreambuf_iterator<char>(ifs),
+		std::istreambuf_iterator<char>()};
+	    treeEtag = tree->deserialize(data);
+	}
+	workerPool->postToMain([self, state, tree, treeEtag, loadedEditCount]() {
+	    if (!state->cancelled)
+		self->undoLoaderOnDone(tree, treeEtag, loadedEditCount);
+	});
+    });
+}
+
+// Watch the file on disk (by inotify on Linux) for changes by others.
+void File::Impl::startMonitoring()
+{
+    try {
+	monitor = giofile->monitor_file();
+	monitor->signal_changed().connect(mem_fun(*this,
+	    &File::Impl::monitorOnChanged));
+    }
+    catch (Glib::Error& e) {
+	monitor.reset();	// Not fatal; the file is just not watched.
+    }
+}
+
+void File::Impl::startLoading()
+{
+    loadState = make_shared<JobState>();
+    loadedBytes = 0;
+    lossyLoad = false;
+    if ((compression != Compression::None) && (totalBytes > 0))
+	workerPool->post(std::bind(&File::Impl::decompressorJob, this,
+	    loadState, path, compression));
+    else workerPool->post(std::bind(&File::Impl::loaderJob, this, loadState,
+	path));
+}
+
+// Runs on a worker thread.  Like loaderJob(), but the file is decompressed
+// as it's read, and the text goes to the main loop chunk by chunk; it's
+// never held in full here.
+// The format is guessed from the first chunk, as with an unmappable file.
+// If invalid UTF-8 turns up later, the load starts over as Latin-1, as if
+// the whole file had been looked at; replacing the bytes with U+FFFD would
+// corrupt the file at the next save.
+void File::Impl::decompressorJob(Impl* self, shared_ptr<JobState> state,
+    const string& path, Compression compression)
+{
+    auto postError = [self, state, path]() {
+	workerPool->postToMain([self, state, path]() {
+	    if (!state->cancelled)
+		self->loaderOnDone(
+		    optional<string>("cannot decompress: " + path));
+	});
+    };
+
+    optional<TextFormat> forcedFormat;
+    for (;;) {
+	std::ifstream ifs{path, std::ios::in | std::ios::binary};
+	if (!ifs) {
+	    workerPool->postToMain([self, state, path]() {
+		if (!state->cancelled)
+		    self->loaderOnDone(
+			optional<string>("cannot read: " + path));
+	    });
+	    return;
+	}
+
+	auto chunkSize = FIRST_CHUNK_SIZE;
+	Decompressor decompressor{compression};
+	TextFormat format{Encoding::Utf8, false, LineEnding::LF};
+	unique_ptr<Decoder> decoder;
+	if (forcedFormat) {
+	    format = *forcedFormat;
+	    loaderPostFormat(self, state, format);
+	    decoder.reset(new Decoder{format});
+	}
+	Storage::size_type rawLength = 0;	// read but not posted yet
+	// @return	false if the load must start over as Latin-1
+	auto decode = [&](const char* data, Storage::size_type length,
+		bool isLast) {
+	    if (!decoder) {
+		format = detectTextFormat(data, length, isLast);
+		loaderPostFormat(self, state, format);
+		decoder.reset(new Decoder{format});
+	    }
+	    string text = decoder->decode(data, length, isLast);
+	    if (decoder->isLossy() && !forcedFormat &&
+		    (format.encoding == Encoding::Utf8) && !format.hasBom)
+		return false;
+	    loaderPostDecoded(self, state, text, rawLength);
+	    rawLength = 0;
+	    return true;
+	};
+
+	string input(CHUNK_SIZE, '\0');
+	bool isLast = false;
+	bool restart = false;
+	while (!state->cancelled && !isLast && !restart) {
+	    ifs.read(&input[0], CHUNK_SIZE);
+	    isLast = !ifs;
+	    rawLength += ifs.gcount();
+	    decompressor.feed(input.data(), ifs.gcount(), isLast);
+	    while (!state->cancelled && !restart) {
+		string text = decompressor.read(chunkSize);
+		if (text.empty())
+		    break;
+		restart = !decode(text.data(), text.size(), false);
+		chunkSize = CHUNK_SIZE;
+	    }
+	    if (decompressor.isFailed()) {
+		postError();
+		return;
+	    }
+	}
+	if (state->cancelled)
+	    return;
+	if (!restart && !decompressor.isComplete()) {
+	    postError();	// truncated
+	    return;
+	}
+	if (!restart)
+	    restart = !decode("", 0, true);	// empty, or the last bytes
+	if (!restart)
+	    break;
+
+	forcedFormat = TextFormat{Encoding::Latin1, false, format.lineEnding};
+	workerPool->postToMain([self, state]() {
+	    if (!state->cancelled)
+		self->loaderOnRestart();
+	});
+    }
+
+    workerPool->postToMain([self, state]() {
+	if (!state->cancelled)
+	    self->loaderOnDone(optional<string>());
+    });
+}
+
+// Runs on a worker thread.  Map the file and hand it over to the main loop
+// in chunks.  'self' may be used only in the callbacks posted to the main
+// loop, and only while the load is not cancelled.
+// Plain UTF-8 files are used in place.  Anything else (other encodings,
+// BOM, CRLF) is converted to UTF-8 with LF line endings on the way.
+void File::Impl::loaderJob(Impl* self, shared_ptr<JobState> state,
+    const string& path)
+{
+    auto chunkSize = FIRST_CHUNK_SIZE;
+
+    shared_ptr<const Storage> mapped = MappedStorage::create(path);
+    TextFormat format{Encoding::Utf8, false, LineEnding::LF};
+    bool lossy = false;	// invalid UTF-8 has been replaced
+    if (mapped) {
+	// This validates the whole file as UTF-8, which is fast enough
+	// (see isValidUtf8()) to be done before the first chunk.
+	format = detectTextFormat(mapped->data(), mapped->size(), true);
+	loaderPostFormat(self, state, format);
+    }
+
+    if (mapped && !isPlainUtf8(format)) {
+	Decoder decoder{format};
+	const char* data = mapped->data();
+	Storage::size_type offset = 0;
+	while (!state->cancelled && (offset < mapped->size())) {
+	    auto length = std::min(chunkSize, mapped->size() - offset);
+	    bool isLast = (offset + length == mapped->size());
+	    loaderPostDecoded(self, state,
+		decoder.decode(data + offset, length, isLast), length);
+	    offset += length;
+	    chunkSize = CHUNK_SIZE;
+	}
+    } else if (mapped) {
+	const char* data = mapped->data();
+	Storage::size_type offset = 0;
+	while (!state->cancelled && (offset < mapped->size())) {
+	    auto length = std::min(chunkSize, mapped->size() - offset);
+	    // Don't split a multi-byte character between two chunks,
+	    // since each chunk is inserted to the buffer separately.
+	    if ((offset + length < mapped->size()) &&
+		    (utf8CompleteLength(data + offset, length) > 0))
+		length = utf8CompleteLength(data + offset, length);
+
+	    // Touch every page here, so that the main loop doesn't stall
+	    // on page faults.
+	    volatile char sink;
+	    for (Storage::size_type i = 0; i < length; i += 4096)
+		sink = data[offset + i];
+	    (void)sink;
+
+	    loaderPostChunk(self, state, mapped, offset, length, length);
+	    offset += length;
+	    chunkSize = CHUNK_SIZE;
+	}
+    } else {
+	// Not mappable (empty, FIFO, too many mapped, etc.); read it the
+	// usual way.  The format is guessed from the first chunk.  The
+	// decoder keeps multi-byte sequences split between chunks.  If
+	// invalid UTF-8 turns up later, the load starts over as Latin-1, as
+	// in decompressorJob().  A FIFO cannot be read again; the invalid
+	// bytes are replaced, and the File refuses to be saved.
+	struct stat st;
+	const bool canReread = (stat(path.c_str(), &st) == 0) &&
+	    S_ISREG(st.st_mode);
+	optional<TextFormat> forcedFormat;
+	for (;;) {
+	    std::ifstream ifs{path, std::ios::in | std::ios::binary};
+	    if (!ifs) {
+		workerPool->postToMain([self, state, path]() {
+		    if (!state->cancelled)
+			self->loaderOnDone(
+			    optional<string>("cannot read: " + path));
+		});
+		return;
+	    }
+
+	    unique_ptr<Decoder> decoder;
+	    if (forcedFormat) {
+		format = *forcedFormat;
+		loaderPostFormat(self, state, format);
+		decoder.reset(new Decoder{format});
+	    }
+	    bool restart = false;
+	    while (!state->cancelled) {
+		string chunk(chunkSize, '\0');
+		ifs.read(&chunk[0], chunkSize);
+		chunk.resize(ifs.gcount());
+		const bool isLast = !ifs;
+		if (!decoder) {
+		    format = detectTextFormat(chunk.data(), chunk.size(),
+			isLast);
+		    loaderPostFormat(self, state, format);
+		    decoder.reset(new Decoder{format});
+		}
+		string text = decoder->decode(chunk.data(), chunk.size(),
+		    isLast);
+		if (decoder->isLossy() && canReread && !forcedFormat &&
+			(format.encoding == Encoding::Utf8) && !format.hasBom) {
+		    restart = true;
+		    break;
+		}
+		loaderPostDecoded(self, state, text, chunk.size());
+		if (isLast)
+		    break;
+		chunkSize = CHUNK_SIZE;
+	    }
+	    if (state->cancelled)
+		return;
+	    if (!restart) {
+		lossy = decoder && decoder->isLossy();
+		break;
+	    }
+
+	    forcedFormat = TextFormat{Encoding::Latin1, false,
+		format.lineEnding};
+	    chunkSize = FIRST_CHUNK_SIZE;
+	    workerPool->postToMain([self, state]() {
+		if (!state->cancelled)
+		    self->loaderOnRestart();
+	    });
+	}
+    }
+
+    // For telling later whether the file has really changed; see reload().
+    optional<uint64_t> hash;
+    if (mapped && !state->cancelled)
+	hash = hashBytes(mapped->data(), mapped->size());
+    workerPool->postToMain([self, state, hash, lossy]() {
+	if (!state->cancelled) {
+	    self->diskHash = hash;
+	    self->lossyLoad = lossy;
+	    self->loaderOnDone(optional<string>());
+	}
+    });
+}
+
+// 'rawLength' is the number of bytes of the file the chunk came from.
+void File::Impl::loaderPostChunk(Impl* self, shared_ptr<JobState> state,
+    shared_ptr<const Storage> storage, Storage::size_type start,
+    Storage::size_type length, Storage::size_type rawLength)
+{
+    workerPool->postToMain(
+	[self, state, storage, start, length, rawLength]() {
+	    if (!state->cancelled)
+		self->loaderOnChunk(storage, start, length, rawLength);
+	});
+}
+
+void File::Impl::loaderPostDecoded(Impl* self, shared_ptr<JobState> state,
+    const string& text, Storage::size_type rawLength)
+{
+    auto storage = make_shared<HeapStorage>(text.size());
+    storage->append(text.data(), text.size());
+    loaderPostChunk(self, state, storage, 0, text.size(), rawLength);
+}
+
+void File::Impl::loaderPostFormat(Impl* self, shared_ptr<JobState> state,
+    const TextFormat& format)
+{
+    workerPool->postToMain([self, state, format]() {
+	if (!state->cancelled)
+	    self->textFormat = format;
+    });
+}
+
+//// event handlers ////
+
+// A user action (a keystroke, a paste, etc.) is undone as a whole.
+void File::Impl::bufferOnBeginUserAction()
+{
+    if (!undoing)
+	undoTree->beginGroup();
+}
+
+void File::Impl::bufferOnEndUserAction()
+{
+    if (!undoing)
+	undoTree->endGroup();
+}
+
+// Record the edit; the document catches up at idle time.
+void File::Impl::bufferOnErase(const Gtk::TextBuffer::iterator start,
+    const Gtk::TextBuffer::iterator end)
+{
+    if (loaderInserting || pager)
+	return;	// loading or paging, not editing
+    ++editCount;
+    if (!undoing) {
+	Glib::ustring erased = start.get_text(end);
+	undoTree->recordErase(start.get_offset(), erased.data(),
+	    erased.bytes());
+    }
+    deltaQueue.pushErase(start.get_offset(),
+	end.get_offset() - start.get_offset());
+    scheduleFlush();
+}
+
+// Record the edit; the document catches up at idle time.
 void File::Impl::bufferOnInsert(const Gtk::TextBuffer::iterator& pos,
     const Glib::ustring& text, int bytes)
 {
-    // We don't want other buffers to handle this signal.
-    // Note that 'buf->insert(...)' below causes another signal-insert !
-    if (modifying)
+    if (loaderInserting || pager)
+	return;	// The loader has already updated the document.
+    ++editCount;
+    if (!undoing)
+	undoTree->recordInsert(pos.get_offset(), text.data(), bytes);
+    deltaQueue.pushInsert(pos.get_offset(), text.data(), bytes);
+    scheduleFlush();
+}
+
+void File::Impl::deltaQueueOnFlush(const vector<Delta>& deltas)
+{
+    for (const auto& d: deltas) {
+	if (d.kind == Delta::Kind::Insert)
+	    document->insert(d.charOffset, d.text.data(), d.text.size());
+	else document->erase(d.charOffset, d.numChars);
+    }
+    if (journal)
+	journal->append(deltas);
+}
+
+bool File::Impl::idleOnFlush()
+{
+    deltaQueue.flush();
+    return false;	// one-shot
+}
+
+// The loader has found the text decoded wrongly, and starts over.  Throw
+// away what it has loaded so far.
+void File::Impl::loaderOnRestart()
+{
+    getDocument().clear();
+    loaderInserting = true;
+    buffer->begin_not_undoable_action();
+    buffer->set_text("");
+    buffer->end_not_undoable_action();
+    loaderInserting = false;
+    loadedBytes = 0;
+    loadStateChanged.emit();
+}
+
+// Append a chunk read by the loader to the document and the buffer.
+void File::Impl::loaderOnChunk(shared_ptr<const Storage> storage,
+    Storage::size_type start, Storage::size_type length,
+    Storage::size_type rawLength)
+{
+    const bool isFirstChunk = (loadedBytes == 0);
+    const char* text = storage->data() + start;
+
+    getDocument().append(storage, start, length);
+    loaderInserting = true;
+    buffer->begin_not_undoable_action();
+    buffer->insert(buffer->end(), text, text + length);
+    if (isFirstChunk)
+	buffer->place_cursor(buffer->begin());
+    buffer->end_not_undoable_action();
+    loaderInserting = false;
+
+    loadedBytes += rawLength;
+    commandMgr->log("loading " + giofile->get_basename() + ": " +
+	std::to_string(getLoadProgress()) + "% (\"cancel\" to stop)");
+    loadStateChanged.emit();
+}
+
+void File::Impl::indexerOnProgress(Pager::size_type indexedBytes)
+{
+    const bool isFirstReport = (loadedBytes == 0);
+    loadedBytes = indexedBytes;
+    if (isFirstReport)
+	pageTo(0);
+    commandMgr->log("indexing " + giofile->get_basename() + ": " +
+	std::to_string(getLoadProgress()) + "% (\"cancel\" to stop)");
+    loadStateChanged.emit();
+}
+
+void File::Impl::loaderOnDone(const optional<string>& errmsg)
+{
+    loadState = nullptr;
+    if (errmsg) {
+	partiallyLoaded = true;
+	commandMgr->log(*errmsg);
+	loadStateChanged.emit();
 	return;
-    modifying = true;
+    }
 
-    GsvBuffer currentBuffer =
-	Glib::RefPtr<Gsv::Buffer>::cast_dynamic(pos.get_buffer());
-    for (auto buf: *buffers) {
-	if (buf == currentBuffer)
-	    continue;
-	auto posIntoBuf = buf->get_iter_at_offset(pos.get_offset());
-	buf->insert(posIntoBuf, text);
+    buffer->set_modified(false);
+    if (!pager) {
+	startJournal();
+	startLoadingUndo();
+	if (pendingCursor >= 0)
+	    buffer->place_cursor(buffer->get_iter_at_offset(pendingCursor));
     }
+    pendingCursor = -1;
+    string note;
+    if (compression != Compression::None)
+	note = compressionName(compression);
+    if (!isPlainUtf8(textFormat))
+	note += (note.empty() ? "" : ", ") + encodingName(textFormat);
+    if (note.empty())
+	commandMgr->log("loaded " + entilde(path));
+    else commandMgr->log("loaded " + entilde(path) + " (" + note + ")");
+    loadStateChanged.emit();
+    if (pendingReplay)
+	applyJournal();
+}
 
-    modifying = false;
+void File::Impl::monitorOnChanged(const GioFile& file,
+    const GioFile& otherFile, Gio::FileMonitorEvent event)
+{
+    // A save by rename(2) shows up as CREATED; an in-place write ends
+    // with CHANGES_DONE_HINT.
+    if ((event == Gio::FileMonitorEvent::FILE_MONITOR_EVENT_CREATED) ||
+	    (event == Gio::FileMonitorEvent::FILE_MONITOR_EVENT_CHANGES_DONE_HINT))
+	checkDisk();
+}
+
+// Apply the hunks from the bottom up, so that the line numbers of the
+// remaining hunks stay valid.
+// @return	true if the buffer is changed
+bool File::Impl::reloaderOnDone(const optional<string>& errmsg,
+    const TextFormat& format, const vector<Hunk>& hunks,
+    unsigned long snapshotEditCount, uint64_t hash)
+{
+    reloadState = nullptr;
+    if (errmsg) {
+	commandMgr->log(*errmsg);
+	return false;
+    }
+    if (editCount != snapshotEditCount) {
+	// Edited during the reload; the hunks no longer apply.
+	commandMgr->log("changed on disk: " + entilde(path) +
+	    " (\"reload\" to discard your changes)");
+	return false;
+    }
+
+    buffer->begin_user_action();	// one step to undo
+    // By offset, not by line: the buffer takes a lone '\r' and the like as
+    // line breaks too, and its line numbers may not match the diff's.
+    for (auto h = hunks.rbegin(); h != hunks.rend(); ++h) {
+	auto pos = buffer->get_iter_at_offset(h->oldCharOffset);
+	if (h->oldNumChars > 0)
+	    pos = buffer->erase(pos,
+		buffer->get_iter_at_offset(h->oldCharOffset + h->oldNumChars));
+	if (!h->newText.empty())
+	    buffer->insert(pos, h->newText.data(),
+		h->newText.data() + h->newText.size());
+    }
+    buffer->end_user_action();
+    buffer->set_modified(false);
+    savedUndoNode = undoTree->getCurrent();
+
+    textFormat = format;
+    partiallyLoaded = false;
+    lossyLoad = false;	// The reloader decodes the file as a whole.
+    diskHash = hash;
+    updateEtag();
+    getDocument();	// for journaling the hunks
+    if (journal)
+	journal->restart(etag);
+    commandMgr->log("reloaded " + entilde(path) + " (" +
+	std::to_string(hunks.size()) + " hunks changed)");
+    return !hunks.empty();
+}
+
+// The file was touched, but its contents are the same.
+bool File::Impl::reloaderOnUnchanged()
+{
+    reloadState = nullptr;
+    updateEtag();
+    return false;
+}
+
+void File::Impl::saverOnDone(const optional<string>& errmsg,
+    Storage::size_type numBytes)
+{
+    saveState = nullptr;
+    if (errmsg) {
+	commandMgr->log(*errmsg);
+	saveAgain = false;
+    } else {
+	updateEtag();
+	diskHash = optional<uint64_t>();	// The encoded text isn't hashed.
+	savedUndoNode = snapshotUndoNode;
+	saveUndo();
+	if (editCount == savedEditCount) {
+	    buffer->set_modified(false);
+	    if (journal)
+		journal->restart(etag);
+	}
+	else if (journal) {
+	    // Edited during the save.  Start over with the whole text,
+	    // relative to what has just been written.
+	    Document& doc = getDocument();
+	    journal->restart(etag);
+	    journal->append(vector<Delta>{
+		Delta{Delta::Kind::Erase, 0, savedNumChars, ""},
+		Delta{Delta::Kind::Insert, 0, doc.getCharCount(),
+		    doc.getText()}});
+	}
+	commandMgr->log("wrote " + entilde(path) + " (" +
+	    std::to_string(numBytes) + " bytes)");
+    }
+
+    if (saveAgain) {
+	saveAgain = false;
+	save();
+    }
+    else if (checkAfterSave) {
+	checkAfterSave = false;
+	checkDisk();
+    }
+}
+
+// Adopt the stored undo history, unless there's none, it's for another
+// version of the file, or the buffer has been edited since.
+void File::Impl::undoLoaderOnDone(shared_ptr<UndoTree> tree,
+    const optional<string>& treeEtag, unsigned long loadedEditCount)
+{
+    undoLoadState = nullptr;
+    if (!treeEtag || (*treeEtag != etag) || (editCount != loadedEditCount))
+	return;
+    undoTree = tree;
+    savedUndoNode = undoTree->getCurrent();
 }
 
 //// interface class ////
 
-File::File(const string& path) : pimpl{new Impl{this, path}} {}
+// What init() needs to know about the file.  Thread-safe; throws
+// Gio::Error.
+GioFileInfo File::queryInfo(const GioFile& giofile)
+{
+    return giofile->query_info(G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+	G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_ETAG_VALUE);
+}
+
+File::File(FileId id) : pimpl{new Impl{this, id}} {}
 File::~File() = default;
-optional<string> File::init() { return pimpl->init(); }
-void File::addBuffer(const GsvBuffer& buf) { pimpl->addBuffer(buf); }
-void File::deleteBuffer(const GsvBuffer& buf) { pimpl->deleteBuffer(buf); }
-void File::save(const string& text) { pimpl->save(text); }
+optional<string> File::init(GioFileInfo info) { return pimpl->init(info); }
+void File::cancelLoading() { pimpl->cancelLoading(); }
+void File::discardJournal() { pimpl->discardJournal(); }
+void File::save() { pimpl->save(); }
+void File::undo() { pimpl->undo(); }
+GsvBuffer File::getBuffer() { return pimpl->getBuffer(); }
+Document& File::getDocument() { return pimpl->getDocument(); }
+string File::getEtag() { return pimpl->getEtag(); }
 GioFile File::getGioFile() { return pimpl->getGioFile(); }
-GsvBuffer File::getNewBuffer() { return pimpl->getNewBuffer(); }
+FileId File::getId() { return pimpl->id; }
+unsigned int File::getLoadProgress() { return pimpl->getLoadProgress(); }
+string::size_type File::getMemoryUsage() {
+    return pimpl->getMemoryUsage();
+}
+shared_ptr<Pager> File::getPager() { return pimpl->getPager(); }
+bool File::isLoading() { return pimpl->isLoading(); }
+string::size_type File::pageTo(string::size_type line) {
+    return pimpl->pageTo(line);
+}
+void File::placeCursor(int charOffset) { pimpl->placeCursor(charOffset); }
+void File::redo() { pimpl->redo(); }
+void File::reload(const ReloadCallback& onRead) { pimpl->reload(onRead); }
+void File::replayJournal(const string& etag, const vector<Delta>& deltas) {
+    pimpl->replayJournal(etag, deltas);
+}
+sigc::signal<void>& File::signalLoadStateChanged() {
+    return pimpl->loadStateChanged;
+}
 
 // eof
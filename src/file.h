@@ -1,21 +1,50 @@
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 #include <boost/optional.hpp>
 #include "global.h"
+#include "pathtable.h"
+
+class Document;
+class Pager;
+struct Delta;
 
 class File
 {
 public:
-    explicit File(const std::string& path);
+    // Called when the file has been read for reload(), with the function
+    // that applies it to the buffer.  'apply' returns false if nothing was
+    // changed.
+    typedef std::function<void(const std::function<bool()>& apply)>
+	ReloadCallback;
+
+    explicit File(FileId id);
     virtual ~File();
-    boost::optional<std::string> init();
-    void addBuffer(const GsvBuffer&);
-    void deleteBuffer(const GsvBuffer&);
+    static GioFileInfo queryInfo(const GioFile& giofile);
+    boost::optional<std::string> init(GioFileInfo info=GioFileInfo());
+    void cancelLoading();
+    void discardJournal();
+    GsvBuffer getBuffer();
+    Document& getDocument();
+    std::string getEtag();
     GioFile getGioFile();
-    GsvBuffer getNewBuffer();
-    void save(const std::string& text);
+    FileId getId();
+    unsigned int getLoadProgress();
+    std::string::size_type getMemoryUsage();
+    std::shared_ptr<Pager> getPager();
+    bool isLoading();
+    std::string::size_type pageTo(std::string::size_type line);
+    void placeCursor(int charOffset);
+    void redo();
+    void reload(const ReloadCallback& onRead=ReloadCallback());
+    void replayJournal(const std::string& etag,
+	const std::vector<Delta>& deltas);
+    void save();
+    void undo();
+    sigc::signal<void>& signalLoadStateChanged();
 private:
     File(const File&) = delete;	// copy ctor
     File(File&&) = delete;
@@ -1,21 +1,108 @@
-#include <fstream>
+#include <algorithm>
+#include <cstdlib>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <glob.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/optional.hpp>
 #include "command.h"
 #include "file.h"
 #include "filemgr.h"
+#include "journal.h"
+#include "pathtable.h"
+#include "recents.h"
 #include "util.h"
+#include "windowmgr.h"
+#include "worker.h"
 
+using sigc::mem_fun;
 using std::make_shared;
 using std::map;
+using std::set;
 using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
+using std::unordered_map;
 using std::vector;
 using boost::optional;
 
+typedef vector<string>::size_type size_type;
+
+// Idle Files are evicted when all the Files take more memory than this.
+// MYEDITOR_MEMORY_BUDGET in the environment overrides it (in MiB).
+static const string::size_type MEMORY_BUDGET = []() {
+    const char* env = getenv("MYEDITOR_MEMORY_BUDGET");
+    unsigned long mib = (env != nullptr) ? strtoul(env, nullptr, 10) : 0;
+    return static_cast<string::size_type>((mib > 0) ? mib : 512) << 20;
+}();
+
+// What's left of a File evicted to save memory.  It's opened again, with
+// the cursor where it was, the next time it's asked for.
+struct EvictedFile
+{
+    int cursorOffset;
+    string etag;	// the cursor is kept only if this still matches
+    string::size_type memoryUsage;	// when evicted
+};
+
+// Bulk opening stats this many files per job.
+static const size_type STAT_BATCH_SIZE = 16;
+
+// Shared by the jobs of a bulk open; see getFiles().  Main thread only.
+struct BulkOpen
+{
+    vector<string> paths;	// expanded, in the order given
+    vector<shared_ptr<File>> files;	// null if not opened (yet)
+    size_type numPending;	// batches not stat'ed yet
+    FileMgr::FilesCallback onDone;
+};
+
+// Files changed on disk within this time of each other, e.g. by a
+// "git checkout", are reloaded together.
+static const unsigned int RELOAD_DELAY_MS = 200;
+
+// Shared by the Files reloaded together; see reloadFiles().  Main thread
+// only.
+struct ReloadBatch
+{
+    vector<std::function<bool()>> applies;	// for the Files read so far
+    size_type numPending;	// Files not read yet
+};
+
+// Runs on a worker thread.  Expand the glob patterns.  A pattern without
+// wildcards is taken as it is, even if there's no such file (yet).  So is
+// a file whose name merely contains them, e.g. "notes[1].txt", and a
+// pattern that matches nothing, as the shell does.
+static vector<string> expandPatterns(const vector<string>& patterns)
+{
+    vector<string> result;
+    for (const string& pattern: patterns) {
+	struct stat st;
+	if ((pattern.find_first_of("*?[") == string::npos) ||
+		(stat(pattern.c_str(), &st) == 0)) {
+	    result.push_back(pattern);
+	    continue;
+	}
+	glob_t matches;
+	int status = glob(pattern.c_str(), GLOB_MARK, nullptr, &matches);
+	if (status == 0) {
+	    for (size_t i = 0; i < matches.gl_pathc; ++i) {
+		string path{matches.gl_pathv[i]};
+		if (path.back() != '/')	// not a directory
+		    result.push_back(path);
+	    }
+	} else if (status == GLOB_NOMATCH)
+	    result.push_back(pattern);
+	globfree(&matches);
+    }
+    return result;
+}
+
 //// impl class ////
 
 class FileMgr::Impl
@@ -24,99 +111,444 @@ public:
     Impl(FileMgr* parent);
     ~Impl() = default;
     void init();
+    void cancelLoading();
     void cleanup();
     optional<shared_ptr<File>> getFile(const string& path,
-	const bool supressErrorMsg=false);
+	const bool supressErrorMsg=false, GioFileInfo info=GioFileInfo());
     vector<string> getFileNames();
+    void getFiles(const vector<string>& patterns,
+	const FileMgr::FilesCallback& onDone);
     vector<string> getRecentFiles();
     void deleteFile(shared_ptr<File> f);
+    string getMemoryReport();
+    void evictIdleFiles();
+    void forgetFile(FileId id);
+    bool isEvictable(const shared_ptr<File>& f);
+    void recoverJournals();
+    void reloadAll();
+    void reloadFiles(const vector<shared_ptr<File>>& targets);
+    void scheduleEviction();
+    void scheduleReload(FileId id);
+    void statFiles(const vector<string>& paths,
+	const FileMgr::FilesCallback& onDone);
+    void updateInode(FileId id);
+    void visit(FileId id);
+
+    void bulkOnStat(shared_ptr<BulkOpen> bulk, size_type first,
+	const vector<GioFileInfo>& infos);
+    bool idleOnEvict();
+    bool timeoutOnReload();
 
     FileMgr* fm;
-    map<string, shared_ptr<File>> files;	// use '~' for HOME
-    vector<string>* recentFiles;	// old to new; use '~' for HOME
+    unordered_map<FileId, shared_ptr<File>> files;
+    // The same file may be reached by other paths: symlinks, hard links,
+    // bind mounts, "..", etc.  Files are identified by their inodes, and
+    // the other paths are aliases of the one first opened.
+    map<std::pair<dev_t, ino_t>, FileId> fileIdsByInode;
+    unordered_map<FileId, FileId> aliases;	// to a key of 'files'
+    Recents recents;
+    unordered_map<FileId, unsigned long> lastUse;	// by useCount
+    unsigned long useCount;
+    map<FileId, EvictedFile> evictedFiles;
+    sigc::connection evictConnection;	// pending idle eviction
+    set<FileId> reloadQueue;	// changed on disk, to be reloaded
+    sigc::connection reloadConnection;	// pending batched reload
 };
 
 FileMgr::Impl::Impl(FileMgr* parent)
-    : fm{parent}, files{}, recentFiles{new vector<string>()} {}
+    : fm{parent}, files{}, useCount{0} {}
 
 void FileMgr::Impl::init()
 {
-    // Read recent files.
-    std::ifstream ifs{Glib::get_home_dir() + "/.myeditor/recents"};
-    if (ifs) {
-	string line;
-	while (ifs >> line)
-	    recentFiles->push_back(line);
+    recents.load();
+
+    // Recover from a crash, once the main loop (and windowMgr) is up.
+    workerPool->postToMain([this]() { recoverJournals(); });
+}
+
+// Cancel loading of every File that is still being loaded.
+void FileMgr::Impl::cancelLoading()
+{
+    for (auto& f: files) {
+	if (f.second->isLoading())
+	    f.second->cancelLoading();
     }
 }
 
+// On a clean exit.  Edits not saved are abandoned, so their journals go;
+// only a crash leaves journals to recover.
 void FileMgr::Impl::cleanup()
 {
     // Flash files.  TODO
 
-    // Record the recent files.
-    std::ofstream ofs{Glib::get_home_dir() + "/.myeditor/recents"};
-    if (ofs) {
-	for (string& recentFile: *recentFiles)
-	    ofs << entilde(recentFile) << '\n';
-    }
+    for (auto& f: files)
+	f.second->discardJournal();
+    recents.save();
 }
 
 void FileMgr::Impl::deleteFile(shared_ptr<File> f)
 {
-    for (auto iter = begin(files); iter != end(files); ++iter) {
-	if (iter->second == f) {
-	    files.erase(iter);
-	    return;
-	}
-    }
+    auto iter = files.find(f->getId());
+    if ((iter != end(files)) && (iter->second == f))
+	forgetFile(f->getId());
 }
 
+// Note: This doesn't wait for the file content.  A newly created File is
+// in the "opening" state (File::isLoading()) until the loader finishes.
+// @param info	passed to File::init()
 optional<shared_ptr<File>> FileMgr::Impl::getFile(const string& path,
-    const bool supressErrorMsg)
+    const bool supressErrorMsg, GioFileInfo info)
 {
-    string fullpath = toFullPath(".", path);
-    string tildedPath = entilde(fullpath);
+    FileId id = pathTable->intern(toFullPath(".", path));
+    auto alias = aliases.find(id);
+    if (alias != end(aliases))
+	id = alias->second;
 
-    // Delete path from recentFiles.  TODO How many to keep?
-    recentFiles->erase(
-	std::remove(begin(*recentFiles), end(*recentFiles), tildedPath),
-	end(*recentFiles));
-    while (recentFiles->size() >= 4)
-	recentFiles->erase(begin(*recentFiles));
-
-    auto iter2 = files.find(tildedPath);
+    auto iter2 = files.find(id);
+    if (iter2 == end(files)) {
+	// Is it another path to a File already open?
+	struct stat st;
+	if (stat(pathTable->getFullPath(id).c_str(), &st) == 0) {
+	    auto inode = fileIdsByInode.find(
+		std::make_pair(st.st_dev, st.st_ino));
+	    if (inode != end(fileIdsByInode)) {
+		aliases[id] = inode->second;
+		id = inode->second;
+		iter2 = files.find(id);
+	    }
+	}
+    }
     if (iter2 != end(files)) {
-	recentFiles->push_back(tildedPath);
+	lastUse[id] = ++useCount;
 	return optional<shared_ptr<File>>(iter2->second);
     }
 
-    auto f = make_shared<File>(tildedPath);
-    optional<string> errmsg = f->init();
+    auto f = make_shared<File>(id);
+    optional<string> errmsg = f->init(info);
     if (errmsg) {
 	if (!supressErrorMsg)
 	    commandMgr->log(*errmsg);
 	return optional<shared_ptr<File>>();
     }
-    files[tildedPath] = f;
-    recentFiles->push_back(tildedPath);
+    files[id] = f;
+    lastUse[id] = ++useCount;
+    updateInode(id);
+
+    auto evicted = evictedFiles.find(id);
+    if (evicted != end(evictedFiles)) {
+	if (evicted->second.etag == f->getEtag())
+	    f->placeCursor(evicted->second.cursorOffset);
+	evictedFiles.erase(evicted);
+    }
+    f->signalLoadStateChanged().connect(mem_fun(*this,
+	&FileMgr::Impl::scheduleEviction));
+    scheduleEviction();
     return optional<shared_ptr<File>>(f);
 }
 
+string FileMgr::Impl::getMemoryReport()
+{
+    string::size_type total = 0;
+    for (const auto& f: files)
+	total += f.second->getMemoryUsage();
+    string report{std::to_string(files.size()) + " files in " +
+	std::to_string(total >> 20) + " of " +
+	std::to_string(MEMORY_BUDGET >> 20) + " MiB; " +
+	std::to_string(evictedFiles.size()) + " evicted\n"};
+    for (const auto& e: evictedFiles) {
+	report += "e " + pathTable->getTildePath(e.first) + "\t# " +
+	    std::to_string(e.second.memoryUsage >> 10) + " KiB\n";
+    }
+    return report;
+}
+
+// If the Files take more memory than MEMORY_BUDGET, evict idle ones, least
+// recently used first.
+void FileMgr::Impl::evictIdleFiles()
+{
+    string::size_type total = 0;
+    vector<std::pair<unsigned long, FileId>> candidates;
+    for (const auto& f: files) {
+	total += f.second->getMemoryUsage();
+	if (isEvictable(f.second))
+	    candidates.push_back(std::make_pair(lastUse[f.first], f.first));
+    }
+    if (total <= MEMORY_BUDGET)
+	return;
+
+    std::sort(begin(candidates), end(candidates));
+    for (const auto& c: candidates) {
+	if (total <= MEMORY_BUDGET)
+	    break;
+	auto f = files[c.second];
+	auto usage = f->getMemoryUsage();
+	evictedFiles[c.second] = EvictedFile{
+	    f->getBuffer()->get_insert()->get_iter().get_offset(),
+	    f->getEtag(), usage};
+	forgetFile(c.second);
+	total -= usage;
+    }
+}
+
+// Drop a File, and its inode and aliases, from the registry.
+void FileMgr::Impl::forgetFile(FileId id)
+{
+    files.erase(id);
+    lastUse.erase(id);
+    for (auto iter = begin(fileIdsByInode); iter != end(fileIdsByInode); ) {
+	if (iter->second == id)
+	    iter = fileIdsByInode.erase(iter);
+	else ++iter;
+    }
+    for (auto iter = begin(aliases); iter != end(aliases); ) {
+	if (iter->second == id)
+	    iter = aliases.erase(iter);
+	else ++iter;
+    }
+}
+
+// A File can be evicted if it's loaded, unmodified and held by no window,
+// on screen or in the history.  Then nothing is lost; it can be loaded
+// again from disk, and no window keeps the old one alive.
+bool FileMgr::Impl::isEvictable(const shared_ptr<File>& f)
+{
+    return !f->isLoading() && !f->getBuffer()->get_modified() &&
+	!windowMgr->holdsFile(f->getId());
+}
+
 // Return the list of file names that are already loaded in the editor.
 vector<string> FileMgr::Impl::getFileNames()
 {
     vector<string> result{};
     for (const auto& f: files) {
-	result.push_back(f.first);
+	result.push_back(pathTable->getTildePath(f.first));
     }
     std::sort(begin(result), end(result));
     return result;
 }
 
+// Open many files at once, e.g. those in the command line.  Globs are
+// expanded and the files are stat'ed by the worker threads, in parallel;
+// the Files are created on the main thread as the stats come in, and then
+// load in the background as usual.  'onDone' gets the opened Files, in
+// the order given, once all of them are created.
+void FileMgr::Impl::getFiles(const vector<string>& patterns,
+    const FileMgr::FilesCallback& onDone)
+{
+    vector<string> fullPatterns;
+    for (const string& pattern: patterns)
+	fullPatterns.push_back(toFullPath(".", pattern));
+    workerPool->post([this, fullPatterns, onDone]() {
+	auto paths = expandPatterns(fullPatterns);
+	workerPool->postToMain([this, paths, onDone]() {
+	    statFiles(paths, onDone);
+	});
+    });
+}
+
+// @return	the highest frecency first
 vector<string> FileMgr::Impl::getRecentFiles()
 {
-    return *recentFiles;
+    return recents.getRanked();
+}
+
+// Journals left in ~/.myeditor/journal/ hold the edits that were not saved
+// before a crash.  Replay them onto their files.
+void FileMgr::Impl::recoverJournals()
+{
+    const string dirPath{Journal::getDirectory()};
+    const string suffix{".journal"};
+    vector<string> journalPaths;
+    try {
+	Glib::Dir dir{dirPath};
+	for (const string& name: dir) {
+	    if ((name.size() > suffix.size()) &&
+		    (name.compare(name.size() - suffix.size(), string::npos,
+			suffix) == 0))
+		journalPaths.push_back(dirPath + "/" + name);
+	}
+    }
+    catch (Glib::FileError& e) {
+	return;	// Nothing has been journaled yet.
+    }
+
+    for (const string& journalPath: journalPaths) {
+	if (Journal::isInUse(journalPath))
+	    continue;	// not a crash; another instance has it open
+	auto contents = Journal::read(journalPath);
+	if (!contents || contents->deltas.empty()) {
+	    unlink(journalPath.c_str());
+	    continue;
+	}
+	auto f = getFile(contents->path, true);
+	if (f)
+	    (*f)->replayJournal(contents->etag, contents->deltas);
+    }
+}
+
+// Reload every File that is loaded and unmodified.  Those that turn out
+// unchanged on disk are left alone.
+void FileMgr::Impl::reloadAll()
+{
+    vector<shared_ptr<File>> targets;
+    size_type numModified = 0;
+    for (const auto& f: files) {
+	if (f.second->isLoading() || f.second->getPager())
+	    continue;
+	if (f.second->getBuffer()->get_modified())
+	    ++numModified;
+	else targets.push_back(f.second);
+    }
+    if (numModified > 0) {
+	commandMgr->log("reload: " + std::to_string(numModified) +
+	    " modified files skipped");
+    }
+    reloadFiles(targets);
+}
+
+// The Files are read in parallel on the worker threads.  The changes are
+// applied to all the buffers in a single main loop callback, so that the
+// windows are laid out once.
+void FileMgr::Impl::reloadFiles(const vector<shared_ptr<File>>& targets)
+{
+    if (targets.empty())
+	return;
+    auto batch = make_shared<ReloadBatch>();
+    batch->numPending = targets.size();
+    for (const auto& f: targets) {
+	f->reload([batch](const std::function<bool()>& apply) {
+	    batch->applies.push_back(apply);
+	    if (--batch->numPending > 0)
+		return;
+	    size_type numChanged = 0;
+	    for (const auto& a: batch->applies) {
+		if (a())
+		    ++numChanged;
+	    }
+	    commandMgr->log("reload: " + std::to_string(numChanged) +
+		" of " + std::to_string(batch->applies.size()) +
+		" files changed");
+	});
+    }
+}
+
+// Evict when the main loop is idle, not while a File is emitting a signal.
+void FileMgr::Impl::scheduleEviction()
+{
+    if (!evictConnection.connected())
+	evictConnection = Glib::signal_idle().connect(mem_fun(*this,
+	    &FileMgr::Impl::idleOnEvict), Glib::PRIORITY_LOW);
+}
+
+// Called by a File changed on disk, instead of reloading itself.
+void FileMgr::Impl::scheduleReload(FileId id)
+{
+    reloadQueue.insert(id);
+    if (!reloadConnection.connected())
+	reloadConnection = Glib::signal_timeout().connect(mem_fun(*this,
+	    &FileMgr::Impl::timeoutOnReload), RELOAD_DELAY_MS);
+}
+
+void FileMgr::Impl::statFiles(const vector<string>& paths,
+    const FileMgr::FilesCallback& onDone)
+{
+    auto bulk = make_shared<BulkOpen>();
+    bulk->paths = paths;
+    bulk->files.resize(paths.size());
+    bulk->numPending = (paths.size() + STAT_BATCH_SIZE - 1) / STAT_BATCH_SIZE;
+    bulk->onDone = onDone;
+    if (bulk->numPending == 0) {
+	if (onDone)
+	    onDone(vector<shared_ptr<File>>());
+	return;
+    }
+
+    for (size_type first = 0; first < paths.size(); first += STAT_BATCH_SIZE) {
+	vector<string> batch(begin(paths) + first,
+	    begin(paths) + std::min(first + STAT_BATCH_SIZE, paths.size()));
+	workerPool->post([this, bulk, first, batch]() {
+	    vector<GioFileInfo> infos;
+	    for (const string& path: batch) {
+		try {
+		    infos.push_back(File::queryInfo(
+			Gio::File::create_for_path(path)));
+		}
+		catch (Gio::Error& e) {
+		    // File::init() will see the error (or a new file) again.
+		    infos.push_back(GioFileInfo());
+		}
+	    }
+	    workerPool->postToMain([this, bulk, first, infos]() {
+		bulkOnStat(bulk, first, infos);
+	    });
+	});
+    }
+}
+
+// Key File 'id' by the inode the file has now.  A save by rename(2), ours
+// or anyone's, gives the file a new inode, and a new file gets its first
+// one when it's written.
+void FileMgr::Impl::updateInode(FileId id)
+{
+    for (auto iter = begin(fileIdsByInode); iter != end(fileIdsByInode); ) {
+	if (iter->second == id)
+	    iter = fileIdsByInode.erase(iter);
+	else ++iter;
+    }
+    struct stat st;
+    if ((files.count(id) > 0) &&
+	    (stat(pathTable->getFullPath(id).c_str(), &st) == 0))
+	fileIdsByInode[std::make_pair(st.st_dev, st.st_ino)] = id;
+}
+
+// Count the File as opened by the user, for ranking the recent files.
+// Files opened by the editor itself (globs, sessions, journals) are not.
+void FileMgr::Impl::visit(FileId id)
+{
+    recents.visit(pathTable->getTildePath(id));
+}
+
+//// event handlers ////
+
+// A batch of files has been stat'ed.  Open them.
+void FileMgr::Impl::bulkOnStat(shared_ptr<BulkOpen> bulk, size_type first,
+    const vector<GioFileInfo>& infos)
+{
+    for (size_type i = 0; i < infos.size(); ++i) {
+	auto f = getFile(bulk->paths[first + i], true, infos[i]);
+	if (f)
+	    bulk->files[first + i] = *f;
+    }
+    if (--bulk->numPending > 0)
+	return;
+
+    vector<shared_ptr<File>> opened;
+    for (const auto& f: bulk->files) {
+	if (f)
+	    opened.push_back(f);
+    }
+    if (bulk->onDone)
+	bulk->onDone(opened);
+}
+
+bool FileMgr::Impl::idleOnEvict()
+{
+    evictIdleFiles();
+    return false;	// one-shot
+}
+
+bool FileMgr::Impl::timeoutOnReload()
+{
+    vector<shared_ptr<File>> targets;
+    for (auto id: reloadQueue) {
+	auto iter = files.find(id);
+	if ((iter != end(files)) && !iter->second->isLoading() &&
+		!iter->second->getBuffer()->get_modified())
+	    targets.push_back(iter->second);
+    }
+    reloadQueue.clear();
+    reloadFiles(targets);
+    return false;	// one-shot
 }
 
 //// interface class ////
@@ -124,6 +556,7 @@ vector<string> FileMgr::Impl::getRecentFiles()
 FileMgr::FileMgr() : pimpl{new Impl{this}} {}
 FileMgr::~FileMgr() = default;
 void FileMgr::init() { pimpl->init(); }
+void FileMgr::cancelLoading() { pimpl->cancelLoading(); }
 void FileMgr::cleanup() { pimpl->cleanup(); }
 void FileMgr::deleteFile(shared_ptr<File> f) { pimpl->deleteFile(f); }
 optional<shared_ptr<File>> FileMgr::getFile(const string& path,
@@ -131,6 +564,15 @@ optional<shared_ptr<File>> FileMgr::getFile(const string& path,
     return pimpl->getFile(path, supressErrorMsg);
 }
 vector<string> FileMgr::getFileNames() { return pimpl->getFileNames(); }
+string FileMgr::getMemoryReport() { return pimpl->getMemoryReport(); }
+void FileMgr::getFiles(const vector<string>& patterns,
+	const FilesCallback& onDone) {
+    pimpl->getFiles(patterns, onDone);
+}
 vector<string> FileMgr::getRecentFiles() { return pimpl->getRecentFiles(); }
+void FileMgr::reloadAll() { pimpl->reloadAll(); }
+void FileMgr::scheduleReload(FileId id) { pimpl->scheduleReload(id); }
+void FileMgr::updateInode(FileId id) { pimpl->updateInode(id); }
+void FileMgr::visit(FileId id) { pimpl->visit(id); }
 
 // eof
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <vector>
 #include <boost/optional.hpp>
@@ -9,15 +10,26 @@
 class FileMgr
 {
 public:
+    typedef std::function<void(const std::vector<std::shared_ptr<File>>&)>
+	FilesCallback;
+
     FileMgr();
     virtual ~FileMgr();
     void init();
+    void cancelLoading();
     void cleanup();
     void deleteFile(std::shared_ptr<File> f);
     boost::optional<std::shared_ptr<File>> getFile(const std::string& path,
 	const bool supressErrorMsg=false);
     std::vector<std::string> getFileNames();
+    std::string getMemoryReport();
+    void getFiles(const std::vector<std::string>& patterns,
+	const FilesCallback& onDone=FilesCallback());
     std::vector<std::string> getRecentFiles();
+    void reloadAll();
+    void scheduleReload(FileId id);
+    void updateInode(FileId id);
+    void visit(FileId id);
 private:
     FileMgr(const FileMgr&) = delete;	// copy ctor
     FileMgr(FileMgr&&) = delete;
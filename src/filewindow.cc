@@ -1,6 +1,11 @@
 #include "command.h"
+#include "document.h"
 #include "global.h"
+#include "filemgr.h"
 #include "filewindow.h"
+#include "pager.h"
+#include "pathtable.h"
+#include "util.h"
 #include "windowmgr.h"
 
 using std::shared_ptr;
@@ -13,35 +18,108 @@ class FileWindow::Impl
 {
 public:
     Impl(FileWindow* parent);
-    ~Impl() = default;
+    ~Impl();
     void init();
+    int getCursorOffset();
     shared_ptr<File> getFile();
+    FileId getFileId();
+    void gotoLine(unsigned int lineNum);
+    bool loadDeferredFile();
     void save(const string& altFilename);
     void setBuffer(const GsvBuffer& buf);
+    void setDeferredFile(FileId id, int cursorOffset);
     void setFile(shared_ptr<File> f);
     const string shortDesc();
     void bufferOnInsert(const Gtk::TextBuffer::iterator& pos,
 	const Glib::ustring& text, int bytes);
+    void fileOnLoadStateChanged();
+    void vadjustmentOnValueChanged();
 
     FileWindow* fw;
     shared_ptr<File> file;
+    bool deferred;	// File not opened yet; see setDeferredFile()
+    FileId deferredId;
+    int deferredCursor;
+    sigc::connection bufferInsertConnection;
+    sigc::connection loadStateConnection;
+    sigc::connection vadjustmentConnection;	// pager mode only
+    bool paging;	// swapping the pager window
 };
 
-FileWindow::Impl::Impl(FileWindow* parent) : fw{parent}, file{nullptr} {}
+FileWindow::Impl::Impl(FileWindow* parent)
+    : fw{parent}, file{nullptr}, deferred{false}, deferredId{0},
+      deferredCursor{0}, paging{false}
+{
+}
+
+FileWindow::Impl::~Impl()
+{
+    // The buffer is shared with other FileWindows and outlives this one.
+    bufferInsertConnection.disconnect();
+    loadStateConnection.disconnect();
+    vadjustmentConnection.disconnect();
+}
 
 void FileWindow::Impl::init() {}
 
+// Pager mode doesn't keep the cursor.
+int FileWindow::Impl::getCursorOffset()
+{
+    if (deferred)
+	return deferredCursor;
+    if (file->getPager())
+	return 0;
+    return file->getBuffer()->get_insert()->get_iter().get_offset();
+}
+
+// @return	the File; null if deferred
 shared_ptr<File> FileWindow::Impl::getFile()
 {
     return file;
 }
 
+FileId FileWindow::Impl::getFileId()
+{
+    return deferred ? deferredId : file->getId();
+}
+
+void FileWindow::Impl::gotoLine(unsigned int lineNum)
+{
+    if (!file->getPager()) {
+	// The document's line index is exact once the pending edits are
+	// applied, which getDocument() does.
+	auto& index = file->getDocument().getLineIndex();
+	fw->gotoOffset(index.getLineStartChar((lineNum > 0) ? lineNum - 1 : 0));
+	return;
+    }
+
+    // Pager mode: bring the line into the buffer first.
+    paging = true;
+    auto lineInBuffer = file->pageTo((lineNum > 0) ? lineNum - 1 : 0);
+    paging = false;
+    fw->EditWindow::gotoLine(lineInBuffer + 1);
+}
+
+// Open the deferred File, if any.
+// @return	false if the File cannot be opened
+bool FileWindow::Impl::loadDeferredFile()
+{
+    if (!deferred)
+	return true;
+    auto f = fileMgr->getFile(pathTable->getFullPath(deferredId));
+    if (!f)
+	return false;
+    deferred = false;
+    setFile(*f);
+    (*f)->placeCursor(deferredCursor);
+    return true;
+}
+
 void FileWindow::Impl::save(const string& altFilename)
 {
     // TODO: Use altFilename.
 
-    auto text = fw->getBuffer()->get_text();
-    file->save(text);
+    file->save();
 }
 
 void FileWindow::Impl::setBuffer(const GsvBuffer& buf)
@@ -49,10 +127,19 @@ void FileWindow::Impl::setBuffer(const GsvBuffer& buf)
     fw->EditWindow::setBuffer(buf);
 }
 
+// A window restored from the session but not shown yet doesn't open its
+// File until loadDeferredFile() is called.
+void FileWindow::Impl::setDeferredFile(FileId id, int cursorOffset)
+{
+    deferred = true;
+    deferredId = id;
+    deferredCursor = cursorOffset;
+}
+
 void FileWindow::Impl::setFile(shared_ptr<File> f)
 {
     file = f;
-    auto buf = f->getNewBuffer();
+    auto buf = f->getBuffer();
     fw->setBuffer(buf);
 
     // Set label for filepath.
@@ -61,12 +148,22 @@ void FileWindow::Impl::setFile(shared_ptr<File> f)
     if (path.find(home) == 0) {	// 'path' starts with 'home'.
 	path = "~" + path.substr(home.size());
     }
-    fw->setLabelText(shortDesc());
+    fileOnLoadStateChanged();
+    loadStateConnection = f->signalLoadStateChanged().connect(mem_fun(*this,
+	&FileWindow::Impl::fileOnLoadStateChanged));
 
-    // Set syntax.
-    auto lm = Gsv::LanguageManager::get_default();
-    auto lang = lm->guess_language(path, Glib::ustring());
-    buf->set_language(lang);
+    if (f->getPager()) {
+	// Pager mode: neither highlighting nor wrapping for huge files.
+	fw->setLineWrap(false);
+	vadjustmentConnection = fw->getView().get_vadjustment()->
+	    signal_value_changed().connect(mem_fun(*this,
+		&FileWindow::Impl::vadjustmentOnValueChanged));
+    } else {
+	// Set syntax.
+	auto lm = Gsv::LanguageManager::get_default();
+	auto lang = lm->guess_language(path, Glib::ustring());
+	buf->set_language(lang);
+    }
 
     // Color the colorbox according to f's parent directory.
     std::hash<string> h1;
@@ -77,12 +174,17 @@ void FileWindow::Impl::setFile(shared_ptr<File> f)
     rgba.set_blue_u((hashValue & 0xFFFF));
     fw->getColorBox()->override_background_color(rgba);
 
-    buf->signal_insert().connect(mem_fun(*this,
+    bufferInsertConnection = buf->signal_insert().connect(mem_fun(*this,
 	&FileWindow::Impl::bufferOnInsert));
 }
 
 const string FileWindow::Impl::shortDesc()
 {
+    if (deferred) {
+	const string& path = pathTable->getFullPath(deferredId);
+	return Glib::path_get_basename(path) + " (" +
+	    entilde(Glib::path_get_dirname(path)) + ")";
+    }
     auto gf = file->getGioFile();
     string directory = gf->get_parent()->get_path();
     const string home = Glib::get_home_dir();
@@ -94,6 +196,67 @@ const string FileWindow::Impl::shortDesc()
 
 //// event handlers ////
 
+// Show the "opening" state in the label, and don't let the user edit
+// the buffer until the File is fully loaded.
+void FileWindow::Impl::fileOnLoadStateChanged()
+{
+    string state{""};
+    auto pager = file->getPager();
+    if (pager) {
+	auto first = pager->getWindowFirstLine();
+	auto last = first + fw->getBuffer()->get_line_count();
+	state = " [pager " + std::to_string(first + 1) + "-" +
+	    std::to_string(last) + " of " +
+	    std::to_string(pager->getNumLines()) +
+	    (pager->isIndexComplete() ? "" : "+") + "]";
+    }
+    else if (file->isLoading())
+	state = " [opening " + std::to_string(file->getLoadProgress()) + "%]";
+
+    fw->setLabelText(shortDesc() + state);
+    fw->getView().set_editable(!file->isLoading() && !pager);
+}
+
+// Pager mode: when the viewport gets near either end of the buffer,
+// move the window of lines so that the viewport is in the middle of it.
+void FileWindow::Impl::vadjustmentOnValueChanged()
+{
+    if (paging)
+	return;
+    auto pager = file->getPager();
+    auto adj = fw->getView().get_vadjustment();
+    const double value = adj->get_value();
+    const double pageSize = adj->get_page_size();
+    const bool nearTop = (value < pageSize);
+    const bool nearBottom = (value + 2 * pageSize > adj->get_upper());
+
+    auto first = pager->getWindowFirstLine();
+    auto numLinesInBuffer =
+	static_cast<Pager::size_type>(fw->getBuffer()->get_line_count());
+    if (nearTop && (first == 0))
+	return;
+    if (nearBottom && (first + numLinesInBuffer >= pager->getNumLines()))
+	return;
+    if (!nearTop && !nearBottom)
+	return;
+
+    // Which line is at the top of the viewport now?
+    Gtk::TextBuffer::iterator iter;
+    int lineTop;
+    fw->getView().get_line_at_y(iter, static_cast<int>(value), lineTop);
+    auto topLine = first + iter.get_line();
+
+    paging = true;
+    auto lineInBuffer = file->pageTo(topLine);
+    auto buf = fw->getBuffer();
+    auto mark = buf->get_mark("pager-top");
+    if (!mark)
+	mark = buf->create_mark("pager-top", buf->begin());
+    buf->move_mark(mark, buf->get_iter_at_line(lineInBuffer));
+    fw->getView().scroll_to(mark, 0, 0, 0);
+    paging = false;
+}
+
 void FileWindow::Impl::bufferOnInsert(const Gtk::TextBuffer::iterator& pos,
     const Glib::ustring& text, int bytes)
 {
@@ -107,9 +270,16 @@ void FileWindow::Impl::bufferOnInsert(const Gtk::TextBuffer::iterator& pos,
 FileWindow::FileWindow() : EditWindow(), pimpl{new Impl{this}} {}
 FileWindow::~FileWindow() = default;
 void FileWindow::init() { pimpl->init(); }
+int FileWindow::getCursorOffset() { return pimpl->getCursorOffset(); }
 shared_ptr<File> FileWindow::getFile() { return pimpl->getFile(); }
+FileId FileWindow::getFileId() { return pimpl->getFileId(); }
+void FileWindow::gotoLine(unsigned int lineNum) { pimpl->gotoLine(lineNum); }
+bool FileWindow::loadDeferredFile() { return pimpl->loadDeferredFile(); }
 void FileWindow::save(const string& altFilename) { pimpl->save(altFilename); }
 void FileWindow::setBuffer(const GsvBuffer& buf) { pimpl->setBuffer(buf); }
+void FileWindow::setDeferredFile(FileId id, int cursorOffset) {
+    pimpl->setDeferredFile(id, cursorOffset);
+}
 void FileWindow::setFile(shared_ptr<File> file) { pimpl->setFile(file); }
 const string FileWindow::shortDesc() { return pimpl->shortDesc(); }
 
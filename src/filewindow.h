@@ -12,9 +12,14 @@ public:
     FileWindow();
     virtual ~FileWindow();
     void init();
+    int getCursorOffset();
     std::shared_ptr<File> getFile();
+    FileId getFileId();
+    void gotoLine(unsigned int lineNum);
+    bool loadDeferredFile();
     void save(const std::string& altFilename);
     void setBuffer(const GsvBuffer& buf);
+    void setDeferredFile(FileId id, int cursorOffset);
     void setFile(std::shared_ptr<File> file);
     const std::string shortDesc();
 private:
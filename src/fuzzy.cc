@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <boost/optional.hpp>
+#include "fuzzy.h"
+
+using std::string;
+using boost::optional;
+
+typedef string::size_type size_type;
+
+// The scores, after fzf.  A gap costs less to extend than to open, so
+// that one long gap beats several short ones.  A match at a boundary is
+// worth about as much as a consecutive one, and the first character of the
+// pattern counts double there.
+static const int SCORE_MATCH = 16;
+static const int SCORE_GAP_START = -3;
+static const int SCORE_GAP_EXTENSION = -1;
+static const int BONUS_BOUNDARY = SCORE_MATCH / 2;	// after "._-" etc.
+static const int BONUS_BOUNDARY_WHITE = BONUS_BOUNDARY + 2;	// or start
+static const int BONUS_BOUNDARY_DELIMITER = BONUS_BOUNDARY + 1;	// after '/'
+static const int BONUS_CAMEL123 = BONUS_BOUNDARY + SCORE_GAP_EXTENSION;
+static const int BONUS_CONSECUTIVE = -(SCORE_GAP_START + SCORE_GAP_EXTENSION);
+static const int BONUS_FIRST_CHAR_MULTIPLIER = 2;
+static const int BONUS_BASENAME = SCORE_MATCH;	// whole match after '/'
+static const int BONUS_CASE = 1;	// per character in the same case
+
+enum class CharClass { White, Delimiter, NonWord, Lower, Upper, Digit };
+
+static inline CharClass classOf(unsigned char c)
+{
+    if ((c >= 'a') && (c <= 'z'))
+	return CharClass::Lower;
+    if ((c >= 'A') && (c <= 'Z'))
+	return CharClass::Upper;
+    if ((c >= '0') && (c <= '9'))
+	return CharClass::Digit;
+    if ((c == ' ') || (c == '\t'))
+	return CharClass::White;
+    if (c == '/')
+	return CharClass::Delimiter;
+    if (c >= 0x80)
+	return CharClass::Lower;	// part of a non-ASCII letter, probably
+    return CharClass::NonWord;
+}
+
+static inline unsigned char toLower(unsigned char c)
+{
+    return ((c >= 'A') && (c <= 'Z')) ? c + ('a' - 'A') : c;
+}
+
+static inline unsigned char toUpper(unsigned char c)
+{
+    return ((c >= 'a') && (c <= 'z')) ? c - ('a' - 'A') : c;
+}
+
+// Bonus for matching a character of class 'cur' right after 'prev'.
+static inline int bonusFor(CharClass prev, CharClass cur)
+{
+    if ((cur == CharClass::Lower) || (cur == CharClass::Upper) ||
+	    (cur == CharClass::Digit)) {
+	switch (prev) {
+	case CharClass::White:
+	    return BONUS_BOUNDARY_WHITE;
+	case CharClass::Delimiter:
+	    return BONUS_BOUNDARY_DELIMITER;
+	case CharClass::NonWord:
+	    return BONUS_BOUNDARY;
+	default:
+	    break;
+	}
+	if (((prev == CharClass::Lower) && (cur == CharClass::Upper)) ||
+		((prev != CharClass::Digit) && (cur == CharClass::Digit)))
+	    return BONUS_CAMEL123;	// fooBar, foo123
+	return 0;
+    }
+    if ((cur == CharClass::White) || (cur == CharClass::Delimiter))
+	return BONUS_BOUNDARY_DELIMITER;
+    return BONUS_BOUNDARY;
+}
+
+// Find the characters of the pattern in order, 16 bytes at a time if
+// possible.  Each block is loaded once, however many characters of the
+// pattern it holds.
+// @return	index just after the last character found; 0 if not found
+static inline size_type scanForward(const FuzzyPattern& pattern,
+    const unsigned char* p, size_type length)
+{
+    const auto& text = pattern.text;
+    const size_type n = text.size();
+    size_type i = 0;
+    size_type k = 0;
+    auto other = [&pattern](unsigned char c) {
+	return pattern.caseSensitive ? c : toUpper(c);
+    };
+#if defined(__SSE2__)
+    for (size_type block = 0; (k < n) && (block + 16 <= length);
+	    block += 16) {
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+	    p + block));
+	unsigned int from = i - block;	// bits below are done
+	while (k < n) {
+	    unsigned char c = text[k];
+	    unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+		_mm_cmpeq_epi8(v, _mm_set1_epi8(c)),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8(other(c)))));
+	    mask &= ~0u << from;
+	    if (mask == 0)
+		break;
+	    from = __builtin_ctz(mask) + 1;
+	    ++k;
+	}
+	i = block + ((k < n) ? 16 : from);
+    }
+#endif
+    for (; (k < n) && (i < length); ++i) {
+	unsigned char c = text[k];
+	if ((p[i] == c) || (p[i] == other(c)))
+	    ++k;
+    }
+    return (k == n) ? i : 0;
+}
+
+// Letters and digits get a bit each, case folded; a few punctuation
+// characters share the rest.
+static inline FuzzyCharMask charBit(unsigned char c)
+{
+    c = toLower(c);
+    if ((c >= 'a') && (c <= 'z'))
+	return FuzzyCharMask(1) << (c - 'a');
+    if ((c >= '0') && (c <= '9'))
+	return FuzzyCharMask(1) << (26 + c - '0');
+    if (c >= 0x80)
+	return FuzzyCharMask(1) << 36;
+    return FuzzyCharMask(1) << (37 + c % 27);
+}
+
+FuzzyPattern compileFuzzyPattern(const string& pattern)
+{
+    FuzzyPattern result{pattern, pattern, false, 0};
+    result.caseSensitive = std::any_of(begin(pattern), end(pattern),
+	[](char c) { return (c >= 'A') && (c <= 'Z'); });
+    if (!result.caseSensitive)
+	std::transform(begin(pattern), end(pattern), begin(result.text),
+	    [](char c) { return toLower(c); });
+    result.mask = fuzzyCharMask(pattern.data(), pattern.size());
+    return result;
+}
+
+FuzzyCharMask fuzzyCharMask(const char* data, size_type length)
+{
+    FuzzyCharMask mask = 0;
+    for (size_type i = 0; i < length; ++i)
+	mask |= charBit(data[i]);
+    return mask;
+}
+
+// The better score first; among equals, the shorter candidate, then the
+// one listed first.
+bool fuzzyRanksBefore(const FuzzyMatch& a, const FuzzyMatch& b)
+{
+    if (a.score != b.score)
+	return a.score > b.score;
+    if (a.length != b.length)
+	return a.length < b.length;
+    return a.index < b.index;
+}
+
+// fzf's "v1" algorithm: the first occurrence of the pattern is found
+// scanning forward, then tightened by scanning backward from its end, and
+// only that window is scored.  Linear in the length of the candidate.
+// @return	the score; none if the candidate doesn't match
+optional<int> fuzzyScore(const FuzzyPattern& pattern, const char* data,
+    size_type length)
+{
+    const auto p = reinterpret_cast<const unsigned char*>(data);
+    const auto& text = pattern.text;
+    const size_type n = text.size();
+    if (n == 0)
+	return optional<int>(0);
+
+    // forward
+    const size_type end = scanForward(pattern, p, length);
+    if (end == 0)
+	return optional<int>();
+
+    // backward
+    size_type start = end;
+    for (size_type k = n; k > 0; ) {
+	--start;
+	unsigned char c = pattern.caseSensitive ? p[start] : toLower(p[start]);
+	if (c == static_cast<unsigned char>(text[k - 1]))
+	    --k;
+    }
+
+    // score
+    int score = 0;
+    int firstBonus = 0;
+    size_type consecutive = 0;
+    bool inGap = false;
+    size_type k = 0;
+    CharClass prevClass = (start > 0) ? classOf(p[start - 1]) :
+	CharClass::White;
+    for (size_type i = start; i < end; ++i) {
+	const unsigned char c = p[i];
+	const CharClass cls = classOf(c);
+	if ((k < n) &&
+		((pattern.caseSensitive ? c : toLower(c)) ==
+		static_cast<unsigned char>(text[k]))) {
+	    int bonus = bonusFor(prevClass, cls);
+	    if (consecutive == 0)
+		firstBonus = bonus;
+	    else {
+		// A run keeps the bonus of its start, unless it crosses a
+		// better boundary.
+		if ((bonus >= BONUS_BOUNDARY) && (bonus > firstBonus))
+		    firstBonus = bonus;
+		bonus = std::max(std::max(bonus, firstBonus),
+		    BONUS_CONSECUTIVE);
+	    }
+	    score += SCORE_MATCH +
+		((k == 0) ? bonus * BONUS_FIRST_CHAR_MULTIPLIER : bonus);
+	    if (c == static_cast<unsigned char>(pattern.original[k]))
+		score += BONUS_CASE;
+	    inGap = false;
+	    ++consecutive;
+	    ++k;
+	} else {
+	    score += inGap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+	    inGap = true;
+	    consecutive = 0;
+	    firstBonus = 0;
+	}
+	prevClass = cls;
+    }
+
+    // Prefer matches in the basename; a trailing '/' of a directory
+    // doesn't count.
+    size_type base = ((length > 0) && (p[length - 1] == '/')) ?
+	length - 1 : length;
+    while ((base > 0) && (p[base - 1] != '/'))
+	--base;
+    if (start >= base)
+	score += BONUS_BASENAME;
+    return optional<int>(score);
+}
+
+// eof
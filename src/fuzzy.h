@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <boost/optional.hpp>
+
+// fzf-style fuzzy matching.  A candidate matches if it contains the
+// characters of the pattern in order.  Matches score higher at word
+// boundaries, in consecutive runs, in the basename, and in the same case.
+// The pattern is case-insensitive unless it has an uppercase letter.
+
+// The characters a pattern or candidate contains, folded into 64 bits.
+// A candidate cannot match unless its mask covers the pattern's, which
+// rejects most candidates without looking at them; see fuzzyMayMatch().
+typedef uint64_t FuzzyCharMask;
+
+struct FuzzyPattern
+{
+    std::string text;	// lowercased unless caseSensitive
+    std::string original;
+    bool caseSensitive;
+    FuzzyCharMask mask;
+};
+
+// A matching candidate, for ranking.
+struct FuzzyMatch
+{
+    int score;
+    unsigned int length;	// of the candidate
+    unsigned int index;	// of the candidate, for the caller
+};
+
+FuzzyPattern compileFuzzyPattern(const std::string& pattern);
+FuzzyCharMask fuzzyCharMask(const char* data, std::string::size_type length);
+bool fuzzyRanksBefore(const FuzzyMatch& a, const FuzzyMatch& b);
+boost::optional<int> fuzzyScore(const FuzzyPattern& pattern,
+    const char* data, std::string::size_type length);
+
+inline bool fuzzyMayMatch(const FuzzyPattern& pattern, FuzzyCharMask mask)
+{
+    return (mask & pattern.mask) == pattern.mask;
+}
+
+// eof
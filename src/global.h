@@ -11,6 +11,8 @@ typedef Glib::RefPtr<Gsv::Buffer> GsvBuffer;
 typedef Glib::RefPtr<Gio::File> GioFile;
 // using GioFile = Glib::RefPtr<Gio::File>;
 
+typedef Glib::RefPtr<Gio::FileInfo> GioFileInfo;
+
 enum class ShadeMode: unsigned int {
     Unshaded,
     Shaded,
@@ -20,10 +22,16 @@ enum class ShadeMode: unsigned int {
 
 class Command;
 class FileMgr;
+class PathTable;
+class ProjectIndex;
 class WindowMgr;
+class WorkerPool;
 
 extern Command* commandMgr;
 extern FileMgr* fileMgr;
+extern PathTable* pathTable;
+extern ProjectIndex* projectIndex;
 extern WindowMgr* windowMgr;
+extern WorkerPool* workerPool;
 
 // eof
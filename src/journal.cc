@@ -0,0 +1,279 @@
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/optional.hpp>
+#include "global.h"
+#include "journal.h"
+#include "util.h"
+#include "worker.h"
+
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+using boost::optional;
+
+static const string MAGIC{"myeditor-journal 1"};
+
+// Record layout (integers are little-endian):
+//   kind ('I' or 'E'), u64 charOffset, u64 numChars, u32 text length,
+//   text, u32 FNV-1a checksum of all the preceding bytes of the record
+static const string::size_type RECORD_HEADER_SIZE = 1 + 8 + 8 + 4;
+
+static uint32_t fnv1a32(const char* data, string::size_type length)
+{
+    uint32_t h = 2166136261u;
+    for (string::size_type i = 0; i < length; ++i) {
+	h ^= static_cast<unsigned char>(data[i]);
+	h *= 16777619u;
+    }
+    return h;
+}
+
+static string makeHeader(const string& path, const string& etag)
+{
+    return MAGIC + '\n' + path + '\n' + etag + '\n';
+}
+
+// State shared with the writer job, which may outlive the Journal.
+struct JournalSink
+{
+    JournalSink()
+      : writing{false}, unlinkRequested{false}, discarded{false}, fd{-1} {}
+    ~JournalSink() { if (fd >= 0) close(fd); }
+
+    mutex sinkMutex;	// guards everything but 'fd'
+    string journalPath;
+    string header;	// written when the journal file is created
+    string pending;	// records not yet written
+    bool writing;	// a writer job is in flight
+    bool unlinkRequested;	// the journal file is obsolete
+    bool discarded;	// no journal file is to be created any more
+    int fd;	// owned by the writer job
+};
+
+// Runs on a worker thread.  Only one of these runs at a time per sink, so
+// the records are written in order.
+static void writerJob(shared_ptr<JournalSink> sink)
+{
+    for (;;) {
+	string data, header;
+	bool unlinkFile;
+	{
+	    std::lock_guard<mutex> lock(sink->sinkMutex);
+	    if (sink->pending.empty() && !sink->unlinkRequested) {
+		sink->writing = false;
+		return;
+	    }
+	    data.swap(sink->pending);
+	    header = sink->header;
+	    unlinkFile = sink->unlinkRequested;
+	    sink->unlinkRequested = false;
+	}
+
+	if (unlinkFile) {
+	    if (sink->fd >= 0) {
+		close(sink->fd);
+		sink->fd = -1;
+	    }
+	    unlink(sink->journalPath.c_str());
+	}
+	if (data.empty())
+	    continue;
+
+	if (sink->fd < 0) {
+	    mkdir((Glib::get_home_dir() + "/.myeditor").c_str(), 0700);
+	    mkdir(Journal::getDirectory().c_str(), 0700);
+	    {
+		// Not after discard(), which may have unlinked it already.
+		std::lock_guard<mutex> lock(sink->sinkMutex);
+		if (sink->discarded)
+		    return;
+		sink->fd = open(sink->journalPath.c_str(),
+		    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	    }
+	    if (sink->fd < 0)
+		continue;	// Nowhere to write; the edits are not journaled.
+	    // Held until the file is closed, even by a crash; see isInUse().
+	    flock(sink->fd, LOCK_EX | LOCK_NB);
+	    data.insert(0, header);
+	}
+
+	const char* p = data.data();
+	string::size_type length = data.size();
+	while (length > 0) {
+	    ssize_t n = write(sink->fd, p, length);
+	    if ((n < 0) && (errno == EINTR))
+		continue;
+	    if (n <= 0)
+		break;
+	    p += n;
+	    length -= n;
+	}
+	fdatasync(sink->fd);
+    }
+}
+
+//// impl class ////
+
+class Journal::Impl
+{
+public:
+    Impl(Journal* parent, const string& path, const string& etag);
+    ~Impl() = default;
+    void append(const vector<Delta>& deltas);
+    void discard();
+    void restart(const string& etag);
+    void startWriter();
+
+    Journal* journal;
+    string path;
+    shared_ptr<JournalSink> sink;
+};
+
+Journal::Impl::Impl(Journal* parent, const string& path_, const string& etag)
+    : journal{parent}, path{path_}, sink{make_shared<JournalSink>()}
+{
+    sink->journalPath = getJournalPath(path);
+    sink->header = makeHeader(path, etag);
+}
+
+// Called on the main loop; this only serializes the deltas.
+void Journal::Impl::append(const vector<Delta>& deltas)
+{
+    string records;
+    for (const auto& d: deltas) {
+	auto start = records.size();
+	records += (d.kind == Delta::Kind::Insert) ? 'I' : 'E';
+	appendUint(records, d.charOffset, 8);
+	appendUint(records, d.numChars, 8);
+	appendUint(records, d.text.size(), 4);
+	records += d.text;
+	appendUint(records, fnv1a32(records.data() + start,
+	    records.size() - start), 4);
+    }
+
+    std::lock_guard<mutex> lock(sink->sinkMutex);
+    sink->pending += records;
+    startWriter();
+}
+
+// The edits are no longer needed, e.g. the File has been closed or the
+// editor quits.  The journal file is gone when this returns, since the
+// worker threads may never run again; nothing is journaled after this.
+void Journal::Impl::discard()
+{
+    std::lock_guard<mutex> lock(sink->sinkMutex);
+    sink->pending.clear();
+    sink->discarded = true;
+    unlink(sink->journalPath.c_str());
+}
+
+// The file has been saved or reloaded as of 'etag'; the journal so far
+// is obsolete, and new edits apply to the new file.
+void Journal::Impl::restart(const string& etag)
+{
+    std::lock_guard<mutex> lock(sink->sinkMutex);
+    sink->pending.clear();
+    sink->header = makeHeader(path, etag);
+    sink->unlinkRequested = true;
+    startWriter();
+}
+
+// Must be called with sinkMutex held.
+void Journal::Impl::startWriter()
+{
+    if (sink->writing)
+	return;
+    sink->writing = true;
+    workerPool->post(std::bind(writerJob, sink));
+}
+
+//// interface class ////
+
+string Journal::getDirectory()
+{
+    return Glib::get_home_dir() + "/.myeditor/journal";
+}
+
+// Journal files are named after a hash of the path of the journaled file.
+string Journal::getJournalPath(const string& path)
+{
+    return getDirectory() + "/" + hashPath(path) + ".journal";
+}
+
+// @return	true if the journal is written by a running instance, which
+//		holds a lock on it
+bool Journal::isInUse(const string& journalPath)
+{
+    int fd = open(journalPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return false;
+    const bool locked = (flock(fd, LOCK_SH | LOCK_NB) != 0) &&
+	(errno == EWOULDBLOCK);
+    close(fd);
+    return locked;
+}
+
+// Return none if the journal is not readable.  Records after a damaged
+// one (typically the last one, torn by a crash) are ignored.
+optional<Journal::Contents> Journal::read(const string& journalPath)
+{
+    std::ifstream ifs{journalPath, std::ios::in | std::ios::binary};
+    if (!ifs)
+	return optional<Contents>();
+    string data{std::istreambuf_iterator<char>(ifs),
+	std::istreambuf_iterator<char>()};
+
+    // Header: three lines.
+    string lines[3];
+    string::size_type pos = 0;
+    for (auto& line: lines) {
+	auto nl = data.find('\n', pos);
+	if (nl == string::npos)
+	    return optional<Contents>();
+	line = data.substr(pos, nl - pos);
+	pos = nl + 1;
+    }
+    if (lines[0] != MAGIC)
+	return optional<Contents>();
+    Contents result{lines[1], lines[2], vector<Delta>()};
+
+    while (data.size() - pos >= RECORD_HEADER_SIZE + 4) {
+	const char* p = data.data() + pos;
+	auto textLength = readUint(p + 17, 4);
+	auto recordLength = RECORD_HEADER_SIZE + textLength;
+	if (data.size() - pos < recordLength + 4)
+	    break;
+	if (readUint(p + recordLength, 4) != fnv1a32(p, recordLength))
+	    break;
+	if ((p[0] != 'I') && (p[0] != 'E'))
+	    break;
+	result.deltas.push_back(Delta{
+	    (p[0] == 'I') ? Delta::Kind::Insert : Delta::Kind::Erase,
+	    readUint(p + 1, 8), readUint(p + 9, 8),
+	    string(p + RECORD_HEADER_SIZE, textLength)});
+	pos += recordLength + 4;
+    }
+    return optional<Contents>(result);
+}
+
+Journal::Journal(const string& path, const string& etag)
+    : pimpl{new Impl{this, path, etag}} {}
+Journal::~Journal() = default;
+void Journal::append(const vector<Delta>& deltas) { pimpl->append(deltas); }
+void Journal::discard() { pimpl->discard(); }
+void Journal::restart(const string& etag) { pimpl->restart(etag); }
+
+// eof
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/optional.hpp>
+#include "deltaqueue.h"
+
+// Write-ahead journal of the edits made to a File since it was last loaded
+// or saved, kept in ~/.myeditor/journal/ so that a crash loses nothing.
+// Records are buffered by append() and written (and fdatasync'ed) on a
+// worker thread; the file itself is created with the first record.
+// Each record carries a checksum, so a record torn by a crash is ignored.
+class Journal
+{
+public:
+    struct Contents
+    {
+	std::string path;	// of the journaled file
+	std::string etag;	// of the file the edits apply to
+	std::vector<Delta> deltas;
+    };
+
+    static std::string getDirectory();
+    static std::string getJournalPath(const std::string& path);
+    static bool isInUse(const std::string& journalPath);
+    static boost::optional<Contents> read(const std::string& journalPath);
+
+    Journal(const std::string& path, const std::string& etag);
+    virtual ~Journal();
+    void append(const std::vector<Delta>& deltas);
+    void discard();
+    void restart(const std::string& etag);
+private:
+    Journal(const Journal&) = delete;	// copy ctor
+    Journal(Journal&&) = delete;
+    Journal& operator=(const Journal&) = delete;
+    Journal& operator=(Journal&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
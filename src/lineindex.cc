@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "lineindex.h"
+#include "util.h"
+
+using std::string;
+using std::vector;
+
+typedef LineIndex::size_type size_type;
+
+// A block holds at most this many lines.  Oversized blocks are split in
+// halves, and neighbors that fit in one block are merged.
+static const size_type MAX_BLOCK_LINES = 512;
+
+struct Line
+{
+    size_type numBytes;	// including the LF
+    size_type numChars;
+};
+
+struct Block
+{
+    vector<Line> lines;
+    size_type numBytes;
+    size_type numChars;
+};
+
+// Split 'text' at every LF, scanning 16 bytes at a time if possible.
+// @return	the lengths of the lines; the last one has no LF, and may be
+//		empty
+static vector<Line> splitLines(const char* text, size_type length)
+{
+    vector<Line> result;
+    size_type lineStart = 0;
+    auto addLine = [&](size_type end) {
+	result.push_back(Line{end - lineStart,
+	    utf8CharCount(text + lineStart, end - lineStart)});
+	lineStart = end;
+    };
+
+    size_type i = 0;
+#if defined(__SSE2__)
+    const __m128i lf = _mm_set1_epi8('\n');
+    while (i + 16 <= length) {
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+	unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+	while (mask != 0) {
+	    addLine(i + __builtin_ctz(mask) + 1);
+	    mask &= mask - 1;
+	}
+	i += 16;
+    }
+#endif
+    for (; i < length; ++i) {
+	if (text[i] == '\n')
+	    addLine(i + 1);
+    }
+    addLine(length);
+    return result;
+}
+
+//// impl class ////
+
+class LineIndex::Impl
+{
+public:
+    enum class Key { Line, Byte, Char };
+
+    // A line, and where it is.
+    struct Location
+    {
+	vector<Block>::size_type block;
+	vector<Line>::size_type index;	// in the block
+	size_type line;
+	size_type byteOffset;	// where the line starts
+	size_type charOffset;
+    };
+
+    Impl(LineIndex* parent);
+    ~Impl() = default;
+    void append(const char* text, size_type length);
+    void clear();
+    void erase(size_type byteOffset, size_type charOffset,
+	size_type numBytes, size_type numChars);
+    size_type getLineAtByte(size_type byteOffset);
+    size_type getLineAtChar(size_type charOffset);
+    size_type getLineCount();
+    size_type getLineStartByte(size_type line);
+    size_type getLineStartChar(size_type line);
+    void insert(size_type byteOffset, size_type charOffset,
+	const char* text, size_type length);
+    void adjustBlock(vector<Block>::size_type b, const Line& oldLine,
+	const Line& newLine);
+    Location locate(Key key, size_type value);
+    void mergeBlocks(vector<Block>::size_type b);
+    size_type prefixSum(const vector<size_type>& tree,
+	vector<Block>::size_type numBlocks);
+    void rebuildTrees();
+    void splitBlock(vector<Block>::size_type b);
+    void sumBlock(vector<Block>::size_type b);
+
+    LineIndex* index;
+    vector<Block> blocks;	// never empty, and no block is empty
+    // Fenwick trees of the number of lines, bytes and chars of the blocks.
+    // They are rebuilt lazily after the blocks are added or removed.
+    vector<size_type> lineTree;
+    vector<size_type> byteTree;
+    vector<size_type> charTree;
+    bool treesDirty;
+};
+
+LineIndex::Impl::Impl(LineIndex* parent) : index{parent}, treesDirty{true}
+{
+    clear();
+}
+
+// Add 'text' to the end, as the loader does.
+void LineIndex::Impl::append(const char* text, size_type length)
+{
+    if (length == 0)
+	return;
+    auto newLines = splitLines(text, length);
+    const auto firstChanged = blocks.size() - 1;
+
+    Line& last = blocks.back().lines.back();
+    last.numBytes += newLines[0].numBytes;
+    last.numChars += newLines[0].numChars;
+    for (vector<Line>::size_type i = 1; i < newLines.size(); ++i) {
+	if (blocks.back().lines.size() >= MAX_BLOCK_LINES)
+	    blocks.push_back(Block{vector<Line>{}, 0, 0});
+	blocks.back().lines.push_back(newLines[i]);
+    }
+
+    // The loader appends chunk after chunk; the trees catch up when the
+    // index is queried.
+    for (auto b = firstChanged; b < blocks.size(); ++b)
+	sumBlock(b);
+    treesDirty = true;
+}
+
+void LineIndex::Impl::clear()
+{
+    blocks.assign(1, Block{vector<Line>{Line{0, 0}}, 0, 0});
+    treesDirty = true;
+}
+
+void LineIndex::Impl::erase(size_type byteOffset, size_type charOffset,
+    size_type numBytes, size_type numChars)
+{
+    if (numChars == 0)
+	return;
+    Location first = locate(Key::Char, charOffset);
+    Location last = locate(Key::Char, charOffset + numChars);
+    const Line firstLine = blocks[first.block].lines[first.index];
+    const Line lastLine = blocks[last.block].lines[last.index];
+
+    // What's left of the first and the last lines becomes one line.
+    Line merged{
+	(byteOffset - first.byteOffset) +
+	    (last.byteOffset + lastLine.numBytes - (byteOffset + numBytes)),
+	(charOffset - first.charOffset) +
+	    (last.charOffset + lastLine.numChars - (charOffset + numChars))};
+
+    if (first.line == last.line) {
+	blocks[first.block].lines[first.index] = merged;
+	adjustBlock(first.block, firstLine, merged);
+	return;
+    }
+
+    auto& firstLines = blocks[first.block].lines;
+    firstLines[first.index] = merged;
+    if (first.block == last.block) {
+	firstLines.erase(begin(firstLines) + first.index + 1,
+	    begin(firstLines) + last.index + 1);
+    }
+    else {
+	firstLines.erase(begin(firstLines) + first.index + 1, end(firstLines));
+	auto& lastLines = blocks[last.block].lines;
+	lastLines.erase(begin(lastLines), begin(lastLines) + last.index + 1);
+	auto eraseEnd = begin(blocks) + last.block +
+	    (lastLines.empty() ? 1 : 0);
+	blocks.erase(begin(blocks) + first.block + 1, eraseEnd);
+    }
+    sumBlock(first.block);
+    if (first.block + 1 < blocks.size())
+	sumBlock(first.block + 1);
+    mergeBlocks(first.block);
+    treesDirty = true;
+}
+
+size_type LineIndex::Impl::getLineAtByte(size_type byteOffset)
+{
+    return locate(Key::Byte, byteOffset).line;
+}
+
+size_type LineIndex::Impl::getLineAtChar(size_type charOffset)
+{
+    return locate(Key::Char, charOffset).line;
+}
+
+size_type LineIndex::Impl::getLineCount()
+{
+    if (treesDirty)
+	rebuildTrees();
+    return prefixSum(lineTree, blocks.size());
+}
+
+// @return	start of the line; of the last line if 'line' is beyond it
+size_type LineIndex::Impl::getLineStartByte(size_type line)
+{
+    return locate(Key::Line, line).byteOffset;
+}
+
+size_type LineIndex::Impl::getLineStartChar(size_type line)
+{
+    return locate(Key::Line, line).charOffset;
+}
+
+void LineIndex::Impl::insert(size_type byteOffset, size_type charOffset,
+    const char* text, size_type length)
+{
+    if (length == 0)
+	return;
+    auto newLines = splitLines(text, length);
+    Location loc = locate(Key::Char, charOffset);
+    auto& lines = blocks[loc.block].lines;
+    const Line oldLine = lines[loc.index];
+
+    if (newLines.size() == 1) {
+	Line& line = lines[loc.index];
+	line.numBytes += length;
+	line.numChars += newLines[0].numChars;
+	adjustBlock(loc.block, oldLine, line);
+	return;
+    }
+
+    // The line is split in two, and the new lines go in between.
+    size_type headBytes = byteOffset - loc.byteOffset;
+    size_type headChars = charOffset - loc.charOffset;
+    newLines.front().numBytes += headBytes;
+    newLines.front().numChars += headChars;
+    newLines.back().numBytes += oldLine.numBytes - headBytes;
+    newLines.back().numChars += oldLine.numChars - headChars;
+    lines[loc.index] = newLines.front();
+    lines.insert(begin(lines) + loc.index + 1,
+	begin(newLines) + 1, end(newLines));
+    sumBlock(loc.block);
+    splitBlock(loc.block);
+    treesDirty = true;
+}
+
+// Update the totals of a block after one of its lines has changed.
+void LineIndex::Impl::adjustBlock(vector<Block>::size_type b,
+    const Line& oldLine, const Line& newLine)
+{
+    // Unsigned arithmetic wraps around, so shrinking works as well.
+    size_type deltaBytes = newLine.numBytes - oldLine.numBytes;
+    size_type deltaChars = newLine.numChars - oldLine.numChars;
+    blocks[b].numBytes += deltaBytes;
+    blocks[b].numChars += deltaChars;
+    if (treesDirty)
+	return;
+    for (auto i = b + 1; i < byteTree.size(); i += i & (~i + 1)) {
+	byteTree[i] += deltaBytes;
+	charTree[i] += deltaChars;
+    }
+}
+
+// Find the line at 'value', which is a line number, a byte offset or a
+// char offset depending on 'key'.  Beyond the end is the last line.
+LineIndex::Impl::Location LineIndex::Impl::locate(Key key, size_type value)
+{
+    if (treesDirty)
+	rebuildTrees();
+    const vector<size_type>& tree = (key == Key::Line) ? lineTree :
+	(key == Key::Byte) ? byteTree : charTree;
+
+    // Descend the tree to the block containing 'value'.
+    vector<Block>::size_type b = 0;
+    size_type rest = value;
+    vector<Block>::size_type step = 1;
+    while (step * 2 <= blocks.size())
+	step *= 2;
+    for (; step > 0; step /= 2) {
+	if ((b + step <= blocks.size()) && (tree[b + step] <= rest)) {
+	    b += step;
+	    rest -= tree[b];
+	}
+    }
+    if (b == blocks.size())
+	--b;
+
+    Location loc{b, 0, prefixSum(lineTree, b), prefixSum(byteTree, b),
+	prefixSum(charTree, b)};
+    const auto& lines = blocks[b].lines;
+    for (; loc.index + 1 < lines.size(); ++loc.index) {
+	const Line& line = lines[loc.index];
+	if (((key == Key::Line) && (value < loc.line + 1)) ||
+		((key == Key::Byte) &&
+		    (value < loc.byteOffset + line.numBytes)) ||
+		((key == Key::Char) &&
+		    (value < loc.charOffset + line.numChars)))
+	    break;
+	++loc.line;
+	loc.byteOffset += line.numBytes;
+	loc.charOffset += line.numChars;
+    }
+    return loc;
+}
+
+// Merge block b and the next one, if they fit in one block.
+void LineIndex::Impl::mergeBlocks(vector<Block>::size_type b)
+{
+    if ((b + 1 >= blocks.size()) ||
+	    (blocks[b].lines.size() + blocks[b + 1].lines.size() >
+		MAX_BLOCK_LINES))
+	return;
+    auto& next = blocks[b + 1];
+    blocks[b].lines.insert(end(blocks[b].lines),
+	begin(next.lines), end(next.lines));
+    blocks[b].numBytes += next.numBytes;
+    blocks[b].numChars += next.numChars;
+    blocks.erase(begin(blocks) + b + 1);
+    treesDirty = true;
+}
+
+// @return	the total of the first 'numBlocks' blocks
+size_type LineIndex::Impl::prefixSum(const vector<size_type>& tree,
+    vector<Block>::size_type numBlocks)
+{
+    size_type sum = 0;
+    for (auto i = numBlocks; i > 0; i -= i & (~i + 1))
+	sum += tree[i];
+    return sum;
+}
+
+// Build the Fenwick trees in linear time.
+void LineIndex::Impl::rebuildTrees()
+{
+    const auto n = blocks.size();
+    lineTree.assign(n + 1, 0);
+    byteTree.assign(n + 1, 0);
+    charTree.assign(n + 1, 0);
+    for (vector<Block>::size_type i = 1; i <= n; ++i) {
+	lineTree[i] += blocks[i - 1].lines.size();
+	byteTree[i] += blocks[i - 1].numBytes;
+	charTree[i] += blocks[i - 1].numChars;
+	auto parent = i + (i & (~i + 1));
+	if (parent <= n) {
+	    lineTree[parent] += lineTree[i];
+	    byteTree[parent] += byteTree[i];
+	    charTree[parent] += charTree[i];
+	}
+    }
+    treesDirty = false;
+}
+
+// Split block b, if it's too large, into blocks half full.
+void LineIndex::Impl::splitBlock(vector<Block>::size_type b)
+{
+    if (blocks[b].lines.size() <= MAX_BLOCK_LINES)
+	return;
+    vector<Line> lines;
+    lines.swap(blocks[b].lines);
+    const size_type half = MAX_BLOCK_LINES / 2;
+
+    vector<Block> newBlocks;
+    for (size_type i = 0; i < lines.size(); i += half) {
+	auto last = std::min(i + half, lines.size());
+	newBlocks.push_back(Block{
+	    vector<Line>(begin(lines) + i, begin(lines) + last), 0, 0});
+    }
+    blocks.erase(begin(blocks) + b);
+    blocks.insert(begin(blocks) + b, begin(newBlocks), end(newBlocks));
+    for (size_type i = 0; i < newBlocks.size(); ++i)
+	sumBlock(b + i);
+    treesDirty = true;
+}
+
+// Recompute the totals of block b from its lines.
+void LineIndex::Impl::sumBlock(vector<Block>::size_type b)
+{
+    Block& block = blocks[b];
+    block.numBytes = 0;
+    block.numChars = 0;
+    for (const auto& line: block.lines) {
+	block.numBytes += line.numBytes;
+	block.numChars += line.numChars;
+    }
+}
+
+//// interface class ////
+
+LineIndex::LineIndex() : pimpl{new Impl{this}} {}
+LineIndex::~LineIndex() = default;
+void LineIndex::append(const char* text, size_type length) {
+    pimpl->append(text, length);
+}
+void LineIndex::clear() { pimpl->clear(); }
+void LineIndex::erase(size_type byteOffset, size_type charOffset,
+	size_type numBytes, size_type numChars) {
+    pimpl->erase(byteOffset, charOffset, numBytes, numChars);
+}
+size_type LineIndex::getLineAtByte(size_type byteOffset) {
+    return pimpl->getLineAtByte(byteOffset);
+}
+size_type LineIndex::getLineAtChar(size_type charOffset) {
+    return pimpl->getLineAtChar(charOffset);
+}
+size_type LineIndex::getLineCount() { return pimpl->getLineCount(); }
+size_type LineIndex::getLineStartByte(size_type line) {
+    return pimpl->getLineStartByte(line);
+}
+size_type LineIndex::getLineStartChar(size_type line) {
+    return pimpl->getLineStartChar(line);
+}
+void LineIndex::insert(size_type byteOffset, size_type charOffset,
+	const char* text, size_type length) {
+    pimpl->insert(byteOffset, charOffset, text, length);
+}
+
+// eof
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+// Where each line of a Document starts, in bytes and in characters.
+// The lines are kept in blocks whose totals are summed up by Fenwick
+// trees, so that lines, byte offsets and character offsets are mapped to
+// one another in O(log n), and edits update the index in place.
+// Lines are counted from 0; a line includes its LF.
+class LineIndex
+{
+public:
+    typedef std::string::size_type size_type;
+
+    LineIndex();
+    virtual ~LineIndex();
+    void append(const char* text, size_type length);
+    void clear();
+    void erase(size_type byteOffset, size_type charOffset,
+	size_type numBytes, size_type numChars);
+    size_type getLineAtByte(size_type byteOffset);
+    size_type getLineAtChar(size_type charOffset);
+    size_type getLineCount();
+    size_type getLineStartByte(size_type line);
+    size_type getLineStartChar(size_type line);
+    void insert(size_type byteOffset, size_type charOffset,
+	const char* text, size_type length);
+private:
+    LineIndex(const LineIndex&) = delete;	// copy ctor
+    LineIndex(LineIndex&&) = delete;
+    LineIndex& operator=(const LineIndex&) = delete;
+    LineIndex& operator=(LineIndex&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
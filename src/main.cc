@@ -1,42 +1,105 @@
 // main.cc
 
+#include <cstdlib>
+#include <string>
 #include <vector>
+#include <unistd.h>
 #include <gtkmm/main.h>
 #include "command.h"
 #include "global.h"
 #include "filewindow.h"
 #include "filemgr.h"
+#include "pathtable.h"
+#include "projectindex.h"
 #include "scratchwindow.h"
+#include "server.h"
 #include "windowmgr.h"
+#include "worker.h"
 
 using std::string;
 using std::vector;
 
 Command* commandMgr;
 FileMgr* fileMgr;
+PathTable* pathTable;
+ProjectIndex* projectIndex;
 WindowMgr* windowMgr;
+WorkerPool* workerPool;
+
+// "-c COMMAND..." is a minibuffer command.
+// @return	the command; empty if 'args' are files
+static string getCommandArg(const vector<string>& args)
+{
+    if (args.empty() || (args[0] != "-c"))
+	return "";
+    string command;
+    for (auto iter = begin(args) + 1; iter != end(args); ++iter)
+	command += (command.empty() ? "" : " ") + *iter;
+    return command;
+}
+
+static string getCurrentDir()
+{
+    char* cwd = getcwd(nullptr, 0);
+    const string dir{cwd ? cwd : "."};
+    free(cwd);
+    return dir;
+}
+
+// The commands to open 'files' in the running instance, whose current
+// directory may differ from ours.  The first file ends up in front.
+static vector<string> getEditCommands(const vector<string>& files)
+{
+    const string dir = getCurrentDir();
+    vector<string> commands;
+    for (auto iter = files.rbegin(); iter != files.rend(); ++iter) {
+	const string& path = *iter;
+	if ((path.find('/') == 0) || (path.find('~') == 0))
+	    commands.push_back("e " + path);
+	else commands.push_back("e " + dir + "/" + path);
+    }
+    return commands;
+}
 
 int main(int argc, char* argv[])
 {
+    vector<string> args(argv + 1, argv + argc);
+    const string command = getCommandArg(args);
+    if (Server::forward(command.empty() ?
+	    getEditCommands(args) : vector<string>{command}))
+	return 0;	// handled by the running instance
+
     Gtk::Main kit(argc, argv);
     Gsv::init();
 
+    pathTable = new PathTable();
+    workerPool = new WorkerPool();
+    workerPool->init();
     commandMgr = new Command();
     fileMgr = new FileMgr();
     fileMgr->init();
     windowMgr = new WindowMgr();
     windowMgr->init();
+    Server server;
+    server.init();
+
+    // Index the project we're in, if any.
+    projectIndex = new ProjectIndex();
+    const string projectRoot = ProjectIndex::findRoot(getCurrentDir());
+    if (!projectRoot.empty())
+	projectIndex->start(projectRoot);
 
     // windowMgr->addWindow(*manage(new ScratchWindow()));
 
-    if (argc > 1) {
+    if (!command.empty())
+	commandMgr->execute(command);
+    else if (!args.empty()) {
 	// File(s) are specified in the command line.
-	// Load them and open the first.
-	vector<string> args(argv + 1, argv + argc);
-	for (const string& arg: args)
-	    fileMgr->getFile(arg, true);
+	// Open the first, and the rest in the background.
 	commandMgr->execute("e " + args[0]);
+	fileMgr->getFiles(vector<string>(begin(args) + 1, end(args)));
     }
+    else windowMgr->restoreSession();
 
     kit.run(*windowMgr);
 
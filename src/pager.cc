@@ -0,0 +1,176 @@
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "pager.h"
+#include "util.h"
+
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+typedef Pager::size_type size_type;
+
+// The indexer reports its progress after scanning this many bytes.
+// The first report comes early, so that the first page can be shown.
+static const size_type FIRST_PROGRESS_INTERVAL = 1024 * 1024;
+static const size_type PROGRESS_INTERVAL = 64 * 1024 * 1024;
+
+// getLines() returns at most this many bytes, even if a single line is
+// longer than that.
+static const size_type MAX_LINES_BYTES = 16 * 1024 * 1024;
+
+//// impl class ////
+
+class Pager::Impl
+{
+public:
+    Impl(Pager* parent, const shared_ptr<const Storage>& mapping);
+    ~Impl() = default;
+    void buildIndex(const std::function<bool()>& isCancelled,
+	const std::function<void(size_type indexedBytes)>& onProgress);
+    string getLines(size_type firstLine, size_type numLines);
+    size_type getNumLines();
+    size_type getWindowFirstLine();
+    bool isIndexComplete();
+    void setWindowFirstLine(size_type line);
+
+    Pager* pager;
+    shared_ptr<const Storage> mapping;
+    mutex indexMutex;	// guards the members below; written by the indexer
+    vector<size_type> checkpoints;	// offset of line (i * STRIDE)
+    size_type numLines;	// known so far
+    size_type indexedBytes;
+    bool indexComplete;
+    size_type windowFirstLine;	// main thread only
+};
+
+Pager::Impl::Impl(Pager* parent, const shared_ptr<const Storage>& mapping_)
+    : pager{parent}, mapping{mapping_}, checkpoints{0}, numLines{0},
+      indexedBytes{0}, indexComplete{false}, windowFirstLine{0}
+{
+}
+
+// Runs on a worker thread.
+void Pager::Impl::buildIndex(const std::function<bool()>& isCancelled,
+    const std::function<void(size_type indexedBytes)>& onProgress)
+{
+    const char* data = mapping->data();
+    const size_type size = mapping->size();
+    size_type offset = 0;
+    size_type lines = 0;	// complete lines so far
+    vector<size_type> newCheckpoints;
+    size_type nextReport = FIRST_PROGRESS_INTERVAL;
+
+    while (offset < size) {
+	auto nl = static_cast<const char*>(
+	    memchr(data + offset, '\n', size - offset));
+	if (nl == nullptr)
+	    break;
+	offset = nl - data + 1;
+	++lines;
+	if (lines % STRIDE == 0)
+	    newCheckpoints.push_back(offset);
+
+	if (offset >= nextReport) {
+	    {
+		lock_guard<mutex> lock(indexMutex);
+		checkpoints.insert(end(checkpoints),
+		    begin(newCheckpoints), end(newCheckpoints));
+		numLines = lines;
+		indexedBytes = offset;
+	    }
+	    newCheckpoints.clear();
+	    onProgress(offset);
+	    if (isCancelled())
+		return;
+	    nextReport = offset + PROGRESS_INTERVAL;
+	}
+    }
+
+    {
+	lock_guard<mutex> lock(indexMutex);
+	checkpoints.insert(end(checkpoints),
+	    begin(newCheckpoints), end(newCheckpoints));
+	numLines = (offset < size) ? lines + 1 : lines;	// last line w/o LF
+	indexedBytes = size;
+	indexComplete = true;
+    }
+    onProgress(size);
+}
+
+// @return	the text of the lines, up to the end of what's indexed
+string Pager::Impl::getLines(size_type firstLine, size_type numLines_)
+{
+    size_type offset;
+    size_type limit;
+    {
+	lock_guard<mutex> lock(indexMutex);
+	if (firstLine >= numLines)
+	    return "";
+	offset = checkpoints[firstLine / STRIDE];
+	limit = indexedBytes;
+    }
+
+    const char* data = mapping->data();
+    for (size_type i = 0; i < firstLine % STRIDE; ++i) {
+	auto nl = static_cast<const char*>(
+	    memchr(data + offset, '\n', limit - offset));
+	offset = nl - data + 1;
+    }
+
+    size_type end = offset;
+    for (size_type i = 0; (i < numLines_) && (end < limit); ++i) {
+	auto nl = static_cast<const char*>(
+	    memchr(data + end, '\n', limit - end));
+	end = (nl == nullptr) ? limit : nl - data + 1;
+    }
+    if (end - offset > MAX_LINES_BYTES)
+	end = offset + utf8CompleteLength(data + offset, MAX_LINES_BYTES);
+    return string(data + offset, end - offset);
+}
+
+size_type Pager::Impl::getNumLines()
+{
+    lock_guard<mutex> lock(indexMutex);
+    return numLines;
+}
+
+size_type Pager::Impl::getWindowFirstLine()
+{
+    return windowFirstLine;
+}
+
+bool Pager::Impl::isIndexComplete()
+{
+    lock_guard<mutex> lock(indexMutex);
+    return indexComplete;
+}
+
+void Pager::Impl::setWindowFirstLine(size_type line)
+{
+    windowFirstLine = line;
+}
+
+//// interface class ////
+
+Pager::Pager(const shared_ptr<const Storage>& mapping)
+    : pimpl{new Impl{this, mapping}} {}
+Pager::~Pager() = default;
+void Pager::buildIndex(const std::function<bool()>& isCancelled,
+	const std::function<void(size_type indexedBytes)>& onProgress) {
+    pimpl->buildIndex(isCancelled, onProgress);
+}
+string Pager::getLines(size_type firstLine, size_type numLines) {
+    return pimpl->getLines(firstLine, numLines);
+}
+size_type Pager::getNumLines() { return pimpl->getNumLines(); }
+size_type Pager::getWindowFirstLine() { return pimpl->getWindowFirstLine(); }
+bool Pager::isIndexComplete() { return pimpl->isIndexComplete(); }
+void Pager::setWindowFirstLine(size_type line) {
+    pimpl->setWindowFirstLine(line);
+}
+
+// eof
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include "document.h"
+
+// Read-only access to a huge file by line number, for the pager mode.
+// The file is mapped, and the byte offset of every STRIDE-th line is
+// recorded (sparse line-offset index), so that any line can be reached
+// by scanning at most STRIDE lines.
+class Pager
+{
+public:
+    typedef std::string::size_type size_type;
+    static const size_type STRIDE = 1024;
+
+    explicit Pager(const std::shared_ptr<const Storage>& mapping);
+    virtual ~Pager();
+    void buildIndex(const std::function<bool()>& isCancelled,
+	const std::function<void(size_type indexedBytes)>& onProgress);
+    std::string getLines(size_type firstLine, size_type numLines);
+    size_type getNumLines();
+    size_type getWindowFirstLine();
+    bool isIndexComplete();
+    void setWindowFirstLine(size_type line);
+private:
+    Pager(const Pager&) = delete;	// copy ctor
+    Pager(Pager&&) = delete;
+    Pager& operator=(const Pager&) = delete;
+    Pager& operator=(Pager&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
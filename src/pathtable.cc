@@ -0,0 +1,87 @@
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <boost/optional.hpp>
+#include "pathtable.h"
+#include "util.h"
+
+using std::deque;
+using std::string;
+using std::unordered_map;
+using boost::optional;
+
+struct PathEntry
+{
+    string fullPath;
+    string tildePath;
+};
+
+//// impl class ////
+
+class PathTable::Impl
+{
+public:
+    Impl(PathTable* parent);
+    ~Impl() = default;
+    optional<FileId> find(const string& fullPath);
+    const string& getFullPath(FileId id);
+    const string& getTildePath(FileId id);
+    FileId intern(const string& fullPath);
+
+    PathTable* table;
+    // Indexed by FileId.  A deque never moves its elements as it grows,
+    // so the paths returned stay valid across intern().
+    deque<PathEntry> entries;
+    unordered_map<string, FileId> ids;	// by full path
+};
+
+PathTable::Impl::Impl(PathTable* parent) : table{parent} {}
+
+optional<FileId> PathTable::Impl::find(const string& fullPath)
+{
+    auto iter = ids.find(fullPath);
+    if (iter == end(ids))
+	return optional<FileId>();
+    return optional<FileId>(iter->second);
+}
+
+const string& PathTable::Impl::getFullPath(FileId id)
+{
+    return entries[id].fullPath;
+}
+
+const string& PathTable::Impl::getTildePath(FileId id)
+{
+    return entries[id].tildePath;
+}
+
+// @return	the FileId of 'fullPath', newly assigned if it's the first time
+FileId PathTable::Impl::intern(const string& fullPath)
+{
+    auto iter = ids.find(fullPath);
+    if (iter != end(ids))
+	return iter->second;
+    FileId id = entries.size();
+    entries.push_back(PathEntry{fullPath, entilde(fullPath)});
+    ids[fullPath] = id;
+    return id;
+}
+
+//// interface class ////
+
+PathTable::PathTable() : pimpl{new Impl{this}} {}
+PathTable::~PathTable() = default;
+optional<FileId> PathTable::find(const string& fullPath) {
+    return pimpl->find(fullPath);
+}
+const string& PathTable::getFullPath(FileId id) {
+    return pimpl->getFullPath(id);
+}
+const string& PathTable::getTildePath(FileId id) {
+    return pimpl->getTildePath(id);
+}
+FileId PathTable::intern(const string& fullPath) {
+    return pimpl->intern(fullPath);
+}
+
+// eof
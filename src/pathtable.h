@@ -0,0 +1,33 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <boost/optional.hpp>
+
+typedef unsigned int FileId;
+
+// Interned full paths.  Each distinct path gets a FileId that stays valid
+// as long as the editor runs, so that Files and windows are looked up by
+// an integer instead of by comparing strings.  The '~' form of each path
+// is computed once and cached.  The paths returned by reference stay valid
+// as long as the table.  Main thread only.
+class PathTable
+{
+public:
+    PathTable();
+    virtual ~PathTable();
+    boost::optional<FileId> find(const std::string& fullPath);
+    const std::string& getFullPath(FileId id);
+    const std::string& getTildePath(FileId id);
+    FileId intern(const std::string& fullPath);
+private:
+    PathTable(const PathTable&) = delete;	// copy ctor
+    PathTable(PathTable&&) = delete;
+    PathTable& operator=(const PathTable&) = delete;
+    PathTable& operator=(PathTable&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
@@ -0,0 +1,645 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "command.h"
+#include "global.h"
+#include "projectindex.h"
+#include "worker.h"
+
+using std::make_shared;
+using std::map;
+using std::set;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+using sigc::mem_fun;
+
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+    IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+// A line of .gitignore.  The common subset is supported: comments, "!",
+// a trailing "/" for directories, a leading "/" or "**/", and wildcards
+// as in fnmatch(3).
+struct IgnorePattern
+{
+    string glob;
+    bool negated;
+    bool dirOnly;
+    bool anchored;	// matched against the path, not the name
+};
+
+// The patterns of the .gitignore in 'dir', and those of its ancestors.
+struct IgnoreRules
+{
+    shared_ptr<const IgnoreRules> parent;
+    string dir;	// relative to the root; "" or ends with '/'
+    vector<IgnorePattern> patterns;
+};
+
+// A directory to be listed.
+struct WalkItem
+{
+    string dir;	// relative to the root; "" or ends with '/'
+    shared_ptr<const IgnoreRules> rules;	// of its parent
+};
+
+// Shared between the ProjectIndex and its walker jobs.  A walk covers the
+// initial listing and the directories created later.
+// The directories wait in 'queue' rather than in the WorkerPool, and only
+// 'maxRunning' walker jobs are posted at a time.  So a File posted to load
+// waits for a few directories at most, not for the whole tree.
+struct WalkState
+{
+    WalkState(const string& r, int fd, unsigned int m)
+      : root{r}, inotifyFd{fd}, maxRunning{m}, cancelled{false},
+	running{0} {}
+    const string root;
+    const int inotifyFd;	// -1 if not watching
+    const unsigned int maxRunning;
+    std::atomic<bool> cancelled;
+    std::mutex queueMutex;	// guards 'queue' and 'running'
+    std::deque<WalkItem> queue;
+    unsigned int running;	// walker jobs posted, not done
+};
+
+// A directory being watched.
+struct WatchedDir
+{
+    string dir;	// relative to the root; "" or ends with '/'
+    shared_ptr<const IgnoreRules> rules;
+};
+
+static shared_ptr<const IgnoreRules> readIgnoreFile(const string& fullDir,
+    const string& dir, const shared_ptr<const IgnoreRules>& parent)
+{
+    std::ifstream ifs{fullDir + ".gitignore"};
+    if (!ifs)
+	return parent;
+
+    auto rules = make_shared<IgnoreRules>();
+    rules->parent = parent;
+    rules->dir = dir;
+    string line;
+    while (std::getline(ifs, line)) {
+	auto last = line.find_last_not_of(" \t\r");
+	if ((last == string::npos) || (line[0] == '#'))
+	    continue;
+	line.erase(last + 1);
+	IgnorePattern p{line, false, false, false};
+	if (p.glob[0] == '!') {
+	    p.negated = true;
+	    p.glob.erase(0, 1);
+	}
+	if (!p.glob.empty() && (p.glob.back() == '/')) {
+	    p.dirOnly = true;
+	    p.glob.pop_back();
+	}
+	if (p.glob.compare(0, 3, "**/") == 0)
+	    p.glob.erase(0, 3);
+	else if (p.glob[0] == '/') {
+	    p.anchored = true;
+	    p.glob.erase(0, 1);
+	}
+	if (p.glob.find('/') != string::npos)
+	    p.anchored = true;
+	if (!p.glob.empty())
+	    rules->patterns.push_back(p);
+    }
+    return rules;
+}
+
+// The last matching pattern decides, and a deeper .gitignore wins.
+static bool isIgnored(const IgnoreRules* rules, const string& path,
+    const string& name, bool isDir)
+{
+    if (name == ".git")
+	return true;
+    for (auto r = rules; r; r = r->parent.get()) {
+	for (auto p = r->patterns.rbegin(); p != r->patterns.rend(); ++p) {
+	    if (p->dirOnly && !isDir)
+		continue;
+	    bool matched = p->anchored ?
+		(fnmatch(p->glob.c_str(), path.c_str() + r->dir.size(),
+		    FNM_PATHNAME) == 0) :
+		(fnmatch(p->glob.c_str(), name.c_str(), 0) == 0);
+	    if (matched)
+		return !p->negated;
+	}
+    }
+    return false;
+}
+
+//// impl class ////
+
+class ProjectIndex::Impl
+{
+public:
+    Impl(ProjectIndex* parent);
+    ~Impl();
+    vector<string> find(const string& needle, size_type limit);
+    unsigned long getGeneration();
+    const char* getPath(size_type i);
+    string getRoot();
+    size_type getSize();
+    bool isComplete();
+    bool isLive();
+    void start(const string& root);
+    sigc::signal<void>& signalChanged();
+
+    void applyChanges();
+    void scheduleFlush();
+    void stop();
+    void unwatch(const vector<string>& dirs);
+    void walk(const string& dir, shared_ptr<const IgnoreRules> rules);
+    static void walkerJob(Impl* self, shared_ptr<WalkState> state);
+
+    bool idleOnFlush();
+    bool inotifyOnRead(Glib::IOCondition cond);
+    void walkerOnDirectory(shared_ptr<WalkState> state, const string& dir,
+	shared_ptr<const IgnoreRules> rules, int wd, int watchErrno,
+	const vector<string>& files);
+    void walkerOnDone(shared_ptr<WalkState> state);
+
+    ProjectIndex* index;
+    string root;	// without the trailing '/'
+    string paths;	// relative to the root, each terminated by '\0'
+    vector<unsigned int> offsets;	// of each path in 'paths'
+    unsigned long generation;	// bumped unless paths are only appended
+    bool complete;	// the initial listing is done
+    bool live;	// watching every directory for changes
+    shared_ptr<WalkState> walkState;	// null unless started
+    int inotifyFd;
+    sigc::connection inotifyConnection;
+    map<int, WatchedDir> watches;	// by watch descriptor
+    // Changes not applied to the index yet; see scheduleFlush().
+    set<string> removedFiles;
+    vector<string> removedDirs;	// each ends with '/'
+    set<string> addedFiles;
+    sigc::connection flushConnection;	// pending idle flush
+    sigc::signal<void> changed;
+};
+
+ProjectIndex::Impl::Impl(ProjectIndex* parent)
+  : index{parent}, generation{0}, complete{false}, live{false},
+    walkState{nullptr}, inotifyFd{-1}
+{
+}
+
+ProjectIndex::Impl::~Impl()
+{
+    stop();
+}
+
+// Full paths that contain 'needle', at most 'limit' of them.
+vector<string> ProjectIndex::Impl::find(const string& needle,
+    size_type limit)
+{
+    vector<string> result;
+    string::size_type pos = 0;
+    while (result.size() < limit) {
+	pos = paths.find(needle, pos);
+	if ((pos == string::npos) || (pos >= paths.size()))
+	    break;
+	// The path containing 'pos'.
+	auto iter = std::upper_bound(begin(offsets), end(offsets), pos);
+	const unsigned int start = *(iter - 1);
+	result.push_back(root + "/" + (paths.c_str() + start));
+	pos = (iter == end(offsets)) ? paths.size() : *iter;
+    }
+    return result;
+}
+
+// As long as this stays the same, paths are only appended to the index,
+// and the i-th path stays the i-th.
+unsigned long ProjectIndex::Impl::getGeneration()
+{
+    return generation;
+}
+
+// @return	the i-th path, relative to the root; valid until the index
+//		changes
+const char* ProjectIndex::Impl::getPath(size_type i)
+{
+    return paths.c_str() + offsets[i];
+}
+
+string ProjectIndex::Impl::getRoot()
+{
+    return root;
+}
+
+ProjectIndex::size_type ProjectIndex::Impl::getSize()
+{
+    return offsets.size();
+}
+
+bool ProjectIndex::Impl::isComplete()
+{
+    return complete;
+}
+
+// @return	false if changes on disk may be missed, e.g. because the
+//		inotify watches have run out
+bool ProjectIndex::Impl::isLive()
+{
+    return live;
+}
+
+// Index 'dir', forgetting the previous root if any.
+void ProjectIndex::Impl::start(const string& dir)
+{
+    stop();
+    root = dir;
+    while ((root.size() > 1) && (root.back() == '/'))
+	root.pop_back();
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    live = (inotifyFd >= 0);
+    if (inotifyFd >= 0) {
+	inotifyConnection = Glib::signal_io().connect(mem_fun(*this,
+	    &ProjectIndex::Impl::inotifyOnRead), inotifyFd, Glib::IO_IN);
+    }
+    else commandMgr->log("project index: not watching " + root + ": " +
+	strerror(errno));
+    // Leave half the workers for loading Files.
+    walkState = make_shared<WalkState>(root, inotifyFd,
+	std::max(1u, workerPool->size() / 2));
+    walk("", nullptr);
+    changed.emit();
+}
+
+sigc::signal<void>& ProjectIndex::Impl::signalChanged()
+{
+    return changed;
+}
+
+// Apply the pending changes in a single pass over the index.  Without
+// removals, the index isn't rebuilt; the new paths are only appended.
+void ProjectIndex::Impl::applyChanges()
+{
+    const bool hasRemovals = !removedFiles.empty() || !removedDirs.empty();
+    string newPaths;
+    vector<unsigned int> newOffsets;
+    if (hasRemovals) {
+	newPaths.reserve(paths.size());
+	newOffsets.reserve(offsets.size() + addedFiles.size());
+    }
+    string p;	// reused, so that looking up a path allocates nothing
+    for (auto offset: offsets) {
+	const char* path = paths.c_str() + offset;
+	const auto length = strlen(path);
+	p.assign(path, length);
+	const bool removed = hasRemovals &&
+	    ((removedFiles.count(p) > 0) ||
+		std::any_of(begin(removedDirs), end(removedDirs),
+		    [&p](const string& d) {
+			return p.compare(0, d.size(), d) == 0;
+		    }));
+	if (removed)
+	    continue;
+	if (!addedFiles.empty())
+	    addedFiles.erase(p);	// already in the index
+	if (hasRemovals) {
+	    newOffsets.push_back(newPaths.size());
+	    newPaths.append(path, length + 1);
+	}
+    }
+    if (hasRemovals) {
+	paths.swap(newPaths);
+	offsets.swap(newOffsets);
+	++generation;
+    }
+    for (const auto& a: addedFiles) {
+	offsets.push_back(paths.size());
+	paths.append(a.c_str(), a.size() + 1);
+    }
+    removedFiles.clear();
+    removedDirs.clear();
+    addedFiles.clear();
+}
+
+// Apply the changes when the main loop is idle, so that a burst of them
+// (e.g. a branch checkout creating many directories) costs one pass over
+// the index rather than one per inotify read or per directory.
+void ProjectIndex::Impl::scheduleFlush()
+{
+    if (!flushConnection.connected())
+	flushConnection = Glib::signal_idle().connect(mem_fun(*this,
+	    &ProjectIndex::Impl::idleOnFlush), Glib::PRIORITY_LOW);
+}
+
+void ProjectIndex::Impl::stop()
+{
+    if (walkState)
+	walkState->cancelled = true;
+    walkState = nullptr;
+    inotifyConnection.disconnect();
+    flushConnection.disconnect();
+    if (inotifyFd >= 0)
+	close(inotifyFd);	// This removes all the watches.
+    inotifyFd = -1;
+    watches.clear();
+    removedFiles.clear();
+    removedDirs.clear();
+    addedFiles.clear();
+    paths.clear();
+    offsets.clear();
+    ++generation;
+    complete = false;
+    live = false;
+}
+
+// Stop watching the directories under 'dirs', which have been moved out of
+// the tree or deleted.  A directory moved out keeps its watches otherwise,
+// and its events would add paths under the old name.
+void ProjectIndex::Impl::unwatch(const vector<string>& dirs)
+{
+    for (auto iter = begin(watches); iter != end(watches); ) {
+	const string& d = iter->second.dir;
+	if (std::any_of(begin(dirs), end(dirs), [&d](const string& r) {
+		    return d.compare(0, r.size(), r) == 0;
+		})) {
+	    inotify_rm_watch(inotifyFd, iter->first);
+	    iter = watches.erase(iter);
+	}
+	else ++iter;
+    }
+}
+
+// List 'dir' and its subdirectories in the background.
+void ProjectIndex::Impl::walk(const string& dir,
+    shared_ptr<const IgnoreRules> rules)
+{
+    std::lock_guard<std::mutex> lock(walkState->queueMutex);
+    walkState->queue.push_back(WalkItem{dir, rules});
+    if (walkState->running < walkState->maxRunning) {
+	++walkState->running;
+	workerPool->post(std::bind(&ProjectIndex::Impl::walkerJob, this,
+	    walkState));
+    }
+}
+
+// List a directory from the queue on a worker thread.  The subdirectories
+// go to the queue, and the job posts itself again while there are more,
+// behind whatever has been posted meanwhile.
+void ProjectIndex::Impl::walkerJob(Impl* self, shared_ptr<WalkState> state)
+{
+    WalkItem item;
+    bool hasItem = false;
+    {
+	std::lock_guard<std::mutex> lock(state->queueMutex);
+	if (!state->cancelled && !state->queue.empty()) {
+	    item = state->queue.front();
+	    state->queue.pop_front();
+	    hasItem = true;
+	}
+    }
+    const string& dir = item.dir;
+
+    vector<WalkItem> subdirs;
+    if (hasItem && !state->cancelled) {
+	const string fullDir = state->root + "/" + dir;
+	auto rules = readIgnoreFile(fullDir, dir, item.rules);
+	// Watch before listing, so that nothing created meanwhile is missed.
+	int wd = (state->inotifyFd < 0) ? -1 :
+	    inotify_add_watch(state->inotifyFd, fullDir.c_str(), WATCH_MASK);
+	int watchErrno = ((state->inotifyFd >= 0) && (wd < 0)) ? errno : 0;
+
+	vector<string> files;
+	DIR* d = opendir(fullDir.c_str());
+	if (d) {
+	    struct dirent* ent;
+	    while ((ent = readdir(d)) != nullptr) {
+		const string name{ent->d_name};
+		if ((name == ".") || (name == ".."))
+		    continue;
+		bool isDir = (ent->d_type == DT_DIR);
+		if (ent->d_type == DT_UNKNOWN) {
+		    struct stat st;
+		    isDir = (lstat((fullDir + name).c_str(), &st) == 0) &&
+			S_ISDIR(st.st_mode);
+		}
+		const string path = dir + name;
+		if (isIgnored(rules.get(), path, name, isDir))
+		    continue;
+		if (isDir)
+		    subdirs.push_back(WalkItem{path + "/", rules});
+		else files.push_back(path);
+	    }
+	    closedir(d);
+	}
+	workerPool->postToMain(
+	    [self, state, dir, rules, wd, watchErrno, files]() {
+		if (!state->cancelled)
+		    self->walkerOnDirectory(state, dir, rules, wd,
+			watchErrno, files);
+	    });
+    }
+
+    unsigned int numToPost = 0;
+    bool done = false;
+    {
+	std::lock_guard<std::mutex> lock(state->queueMutex);
+	state->queue.insert(end(state->queue), begin(subdirs), end(subdirs));
+	if (state->queue.empty() || state->cancelled) {
+	    --state->running;
+	    done = (state->running == 0);
+	} else {
+	    numToPost = 1 + std::min<unsigned int>(
+		state->maxRunning - state->running, state->queue.size() - 1);
+	    state->running += numToPost - 1;
+	}
+    }
+    for (unsigned int i = 0; i < numToPost; ++i)
+	workerPool->post(std::bind(&ProjectIndex::Impl::walkerJob, self,
+	    state));
+
+    // Callbacks run in the order posted, and the other jobs have posted
+    // theirs, so this comes after all the directories.  Once the walk is
+    // cancelled, 'self' may be gone.
+    if (done) {
+	workerPool->postToMain([self, state]() {
+	    if (!state->cancelled)
+		self->walkerOnDone(state);
+	});
+    }
+}
+
+//// event handlers ////
+
+bool ProjectIndex::Impl::idleOnFlush()
+{
+    applyChanges();
+    changed.emit();
+    return false;	// one-shot
+}
+
+bool ProjectIndex::Impl::inotifyOnRead(Glib::IOCondition cond)
+{
+    vector<string> goneDirs;	// in this read
+    vector<WalkItem> newDirs;
+    alignas(struct inotify_event) char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(inotifyFd, buf, sizeof(buf))) > 0) {
+	for (char* p = buf; p < buf + n; ) {
+	    auto ev = reinterpret_cast<struct inotify_event*>(p);
+	    p += sizeof(struct inotify_event) + ev->len;
+	    if (ev->mask & IN_Q_OVERFLOW) {
+		// Events are lost; start over.
+		commandMgr->log("project index: rescanning " + root);
+		start(string(root));
+		return false;
+	    }
+	    auto w = watches.find(ev->wd);
+	    if (w == end(watches))
+		continue;
+	    if (ev->mask & IN_IGNORED) {
+		watches.erase(w);
+		continue;
+	    }
+	    if (ev->len == 0)
+		continue;
+
+	    const string name{ev->name};
+	    const string path = w->second.dir + name;
+	    const bool isDir = (ev->mask & IN_ISDIR);
+	    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		if (isDir) {
+		    const string d = path + "/";
+		    removedDirs.push_back(d);
+		    goneDirs.push_back(d);
+		    // Found by the walk before, but not in the index yet.
+		    addedFiles.erase(addedFiles.lower_bound(d),
+			std::find_if(addedFiles.lower_bound(d),
+			    end(addedFiles), [&d](const string& a) {
+				return a.compare(0, d.size(), d) != 0;
+			    }));
+		}
+		else {
+		    removedFiles.insert(path);
+		    addedFiles.erase(path);
+		}
+	    }
+	    else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+		if (isIgnored(w->second.rules.get(), path, name, isDir))
+		    continue;
+		if (isDir)
+		    newDirs.push_back(WalkItem{path + "/", w->second.rules});
+		else {
+		    addedFiles.insert(path);
+		    removedFiles.erase(path);
+		}
+	    }
+	}
+    }
+
+    // Before walking the new ones, which may be the same directories
+    // moved within the tree.
+    if (!goneDirs.empty())
+	unwatch(goneDirs);
+    for (const auto& d: newDirs)
+	walk(d.dir, d.rules);
+    if (!removedFiles.empty() || !removedDirs.empty() ||
+	    !addedFiles.empty())
+	scheduleFlush();
+    return true;
+}
+
+void ProjectIndex::Impl::walkerOnDirectory(shared_ptr<WalkState> state,
+    const string& dir, shared_ptr<const IgnoreRules> rules, int wd,
+    int watchErrno, const vector<string>& files)
+{
+    if (state != walkState)
+	return;	// stale
+    if (wd >= 0)
+	watches[wd] = WatchedDir{dir, rules};
+    else if ((watchErrno != 0) && live) {
+	// Typically ENOSPC: fs.inotify.max_user_watches is too low.
+	live = false;
+	commandMgr->log("project index: not watching " + root + "/" + dir +
+	    " and the rest: " + strerror(watchErrno));
+    }
+
+    if (complete) {
+	// A directory created later; inotify may have added some already.
+	for (const auto& f: files) {
+	    addedFiles.insert(f);
+	    removedFiles.erase(f);
+	}
+	if (!files.empty())
+	    scheduleFlush();
+	return;
+    }
+    for (const auto& f: files) {
+	offsets.push_back(paths.size());
+	paths.append(f.c_str(), f.size() + 1);
+    }
+    if (!files.empty())
+	changed.emit();
+}
+
+void ProjectIndex::Impl::walkerOnDone(shared_ptr<WalkState> state)
+{
+    if ((state != walkState) || complete)
+	return;
+    complete = true;
+    commandMgr->log("project index: " + std::to_string(offsets.size()) +
+	" files in " + root);
+    changed.emit();
+}
+
+//// interface class ////
+
+ProjectIndex::ProjectIndex() : pimpl{new Impl{this}} {}
+ProjectIndex::~ProjectIndex() = default;
+
+// @return	the nearest directory containing .git, from 'dir' up;
+//		empty if none
+string ProjectIndex::findRoot(const string& dir)
+{
+    string d = dir;
+    while (!d.empty()) {
+	struct stat st;
+	if (stat((d + "/.git").c_str(), &st) == 0)
+	    return d;
+	auto slash = d.rfind('/');
+	if ((slash == string::npos) || (d == "/"))
+	    break;
+	d = (slash == 0) ? "/" : d.substr(0, slash);
+    }
+    return "";
+}
+
+vector<string> ProjectIndex::find(const string& needle, size_type limit) {
+    return pimpl->find(needle, limit);
+}
+unsigned long ProjectIndex::getGeneration() {
+    return pimpl->getGeneration();
+}
+const char* ProjectIndex::getPath(size_type i) { return pimpl->getPath(i); }
+string ProjectIndex::getRoot() { return pimpl->getRoot(); }
+ProjectIndex::size_type ProjectIndex::getSize() { return pimpl->getSize(); }
+bool ProjectIndex::isComplete() { return pimpl->isComplete(); }
+bool ProjectIndex::isLive() { return pimpl->isLive(); }
+void ProjectIndex::start(const string& root) { pimpl->start(root); }
+sigc::signal<void>& ProjectIndex::signalChanged() {
+    return pimpl->signalChanged();
+}
+
+// eof
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "global.h"
+
+// The files of a project, i.e. a directory tree, listed in the background
+// and kept up to date with inotify.  Directories ignored by .gitignore are
+// not entered.  The paths, relative to the root, are packed in a single
+// buffer so that half a million of them can be searched in a moment.
+// signalChanged() is emitted as the listing grows, and on every change
+// after that.  Main thread only.
+class ProjectIndex
+{
+public:
+    typedef std::vector<unsigned int>::size_type size_type;
+
+    ProjectIndex();
+    virtual ~ProjectIndex();
+    static std::string findRoot(const std::string& dir);
+    std::vector<std::string> find(const std::string& needle,
+	size_type limit);
+    unsigned long getGeneration();
+    const char* getPath(size_type i);
+    std::string getRoot();
+    size_type getSize();
+    bool isComplete();
+    bool isLive();
+    void start(const std::string& root);
+    sigc::signal<void>& signalChanged();
+private:
+    ProjectIndex(const ProjectIndex&) = delete;	// copy ctor
+    ProjectIndex(ProjectIndex&&) = delete;
+    ProjectIndex& operator=(const ProjectIndex&) = delete;
+    ProjectIndex& operator=(ProjectIndex&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
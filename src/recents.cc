@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <sys/stat.h>
+#include "global.h"
+#include "recents.h"
+#include "util.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+// Layout of recents.db: MAGIC, then the number of entries (u32), then
+// for each entry: visits (u32), time of the last visit (u64, seconds
+// since the epoch), length of the path (u32) and the path.
+// Integers are little-endian.
+static const string MAGIC{"myeditor-recents 1\n"};
+
+// Only this many entries, those with the highest frecency, are saved.
+static const vector<string>::size_type MAX_ENTRIES = 10000;
+
+struct RecentEntry
+{
+    uint32_t visits;
+    uint64_t lastVisit;
+};
+
+// How often a file was opened, weighted by how long ago it was last
+// opened.
+static double getFrecency(const RecentEntry& entry, uint64_t now)
+{
+    const uint64_t age = (now > entry.lastVisit) ? now - entry.lastVisit : 0;
+    const uint64_t hour = 60 * 60;
+    const uint64_t day = 24 * hour;
+    double weight = (age < 4 * hour) ? 100 : (age < day) ? 70 :
+	(age < 7 * day) ? 50 : (age < 30 * day) ? 30 : 10;
+    return entry.visits * weight;
+}
+
+static string getDbPath()
+{
+    return Glib::get_home_dir() + "/.myeditor/recents.db";
+}
+
+//// impl class ////
+
+class Recents::Impl
+{
+public:
+    Impl(Recents* parent);
+    ~Impl() = default;
+    vector<string> getRanked();
+    void load();
+    void loadText();
+    void save();
+    void visit(const string& path);
+
+    Recents* recents;
+    map<string, RecentEntry> entries;	// use '~' for HOME
+};
+
+Recents::Impl::Impl(Recents* parent) : recents{parent} {}
+
+// @return	paths, the highest frecency first
+vector<string> Recents::Impl::getRanked()
+{
+    const uint64_t now = time(nullptr);
+    vector<std::tuple<double, uint64_t, string>> ranking;
+    for (const auto& e: entries) {
+	ranking.push_back(std::make_tuple(getFrecency(e.second, now),
+	    e.second.lastVisit, e.first));
+    }
+    // Descending; the more recent first if the frecency is the same.
+    std::sort(ranking.rbegin(), ranking.rend());
+
+    vector<string> result;
+    result.reserve(ranking.size());
+    for (const auto& r: ranking)
+	result.push_back(std::get<2>(r));
+    return result;
+}
+
+// A broken or truncated database is read as far as it's intact.
+void Recents::Impl::load()
+{
+    std::ifstream ifs{getDbPath(), std::ios::in | std::ios::binary};
+    if (!ifs) {
+	loadText();
+	return;
+    }
+    const string data{std::istreambuf_iterator<char>(ifs),
+	std::istreambuf_iterator<char>()};
+    if (data.compare(0, MAGIC.size(), MAGIC) != 0)
+	return;
+
+    string::size_type pos = MAGIC.size();
+    if (pos + 4 > data.size())
+	return;
+    auto numEntries = readUint(data.data() + pos, 4);
+    pos += 4;
+    for (uint64_t i = 0; i < numEntries; ++i) {
+	if (pos + 16 > data.size())
+	    return;
+	const char* p = data.data() + pos;
+	RecentEntry entry{static_cast<uint32_t>(readUint(p, 4)),
+	    readUint(p + 4, 8)};
+	auto length = readUint(p + 12, 4);
+	pos += 16;
+	if (pos + length > data.size())
+	    return;
+	entries[data.substr(pos, length)] = entry;
+	pos += length;
+    }
+}
+
+// Import ~/.myeditor/recents, the plain list (old to new) written by
+// earlier versions.
+void Recents::Impl::loadText()
+{
+    std::ifstream ifs{Glib::get_home_dir() + "/.myeditor/recents"};
+    if (!ifs)
+	return;
+    vector<string> paths;
+    string line;
+    while (ifs >> line)
+	paths.push_back(line);
+    const uint64_t now = time(nullptr);
+    for (vector<string>::size_type i = 0; i < paths.size(); ++i)
+	entries[paths[i]] = RecentEntry{1, now - (paths.size() - i)};
+}
+
+// Write to a temporary file and rename it, so that the database is never
+// seen half-written.
+void Recents::Impl::save()
+{
+    auto ranked = getRanked();
+    if (ranked.size() > MAX_ENTRIES)
+	ranked.resize(MAX_ENTRIES);
+
+    string data{MAGIC};
+    appendUint(data, ranked.size(), 4);
+    for (const string& path: ranked) {
+	const RecentEntry& entry = entries[path];
+	appendUint(data, entry.visits, 4);
+	appendUint(data, entry.lastVisit, 8);
+	appendUint(data, path.size(), 4);
+	data += path;
+    }
+
+    mkdir((Glib::get_home_dir() + "/.myeditor").c_str(), 0700);
+    const string dbPath{getDbPath()};
+    const string tmpPath{dbPath + ".tmp"};
+    {
+	std::ofstream ofs{tmpPath, std::ios::out | std::ios::binary};
+	if (!ofs.write(data.data(), data.size()))
+	    return;
+    }
+    rename(tmpPath.c_str(), dbPath.c_str());
+}
+
+void Recents::Impl::visit(const string& path)
+{
+    RecentEntry& entry = entries[path];	// zero-initialized if new
+    if (entry.visits < UINT32_MAX)
+	++entry.visits;
+    entry.lastVisit = time(nullptr);
+}
+
+//// interface class ////
+
+Recents::Recents() : pimpl{new Impl{this}} {}
+Recents::~Recents() = default;
+vector<string> Recents::getRanked() { return pimpl->getRanked(); }
+void Recents::load() { pimpl->load(); }
+void Recents::save() { pimpl->save(); }
+void Recents::visit(const string& path) { pimpl->visit(path); }
+
+// eof
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// The files opened so far, ranked by frecency: how often and how recently
+// each was opened.  Kept in ~/.myeditor/recents.db, a compact binary file
+// that is read with a single read() at startup and replaced atomically.
+class Recents
+{
+public:
+    Recents();
+    virtual ~Recents();
+    std::vector<std::string> getRanked();
+    void load();
+    void save();
+    void visit(const std::string& path);
+private:
+    Recents(const Recents&) = delete;	// copy ctor
+    Recents(Recents&&) = delete;
+    Recents& operator=(const Recents&) = delete;
+    Recents& operator=(Recents&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
@@ -0,0 +1,296 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "command.h"
+#include "global.h"
+#include "server.h"
+#include "windowmgr.h"
+
+using std::map;
+using std::string;
+using std::vector;
+using sigc::mem_fun;
+
+// Protocol: the client sends minibuffer commands, one per line, and shuts
+// down its writing side.  The server executes them in order and replies
+// with the message of each, one per line, then closes the connection.
+
+// A client sending more than this is cut off.
+static const string::size_type MAX_REQUEST_SIZE = 1 << 20;
+
+// $XDG_RUNTIME_DIR/myeditor-UID.sock.  Without XDG_RUNTIME_DIR, it's in
+// a directory of our own in /tmp, where anyone could have put a socket.
+// @return	empty string if the directory isn't private to us
+static string getSocketPath()
+{
+    const string uid = std::to_string(getuid());
+    const char* env = getenv("XDG_RUNTIME_DIR");
+    if (env && *env)
+	return string{env} + "/myeditor-" + uid + ".sock";
+
+    const string dir{"/tmp/myeditor-" + uid};
+    mkdir(dir.c_str(), 0700);
+    struct stat st;
+    if ((lstat(dir.c_str(), &st) != 0) || !S_ISDIR(st.st_mode) ||
+	    (st.st_uid != getuid()) || ((st.st_mode & 0077) != 0))
+	return "";
+    return dir + "/socket";
+}
+
+// @return	false if the other end of 'fd' is run by someone else
+static bool isOwnPeer(int fd)
+{
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    return (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) == 0) &&
+	(cred.uid == getuid());
+}
+
+// @return	false if 'path' is empty or doesn't fit in a sockaddr_un
+static bool toSocketAddress(const string& path, struct sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || (path.size() >= sizeof(addr.sun_path)))
+	return false;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+static bool writeAll(int fd, const string& data)
+{
+    string::size_type written = 0;
+    while (written < data.size()) {
+	auto n = write(fd, data.data() + written, data.size() - written);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	written += n;
+    }
+    return true;
+}
+
+//// impl class ////
+
+class Server::Impl
+{
+public:
+    Impl(Server* parent);
+    ~Impl();
+    void init();
+    void execute(int fd);
+
+    bool clientOnRead(Glib::IOCondition cond, int fd);
+    bool clientOnWrite(Glib::IOCondition cond, int fd);
+    bool listenerOnAccept(Glib::IOCondition cond);
+
+    Server* server;
+    string socketPath;
+    int listenFd;	// -1 if not listening
+    map<int, string> requests;	// commands received so far, by client
+    map<int, string> replies;	// left to be sent, by client
+};
+
+Server::Impl::Impl(Server* parent) : server{parent}, listenFd{-1} {}
+
+Server::Impl::~Impl()
+{
+    for (const auto& r: requests)
+	close(r.first);
+    for (const auto& r: replies)
+	close(r.first);
+    if (listenFd >= 0) {
+	close(listenFd);
+	unlink(socketPath.c_str());
+    }
+}
+
+// Start listening.  Failure only means no single-instance mode; forward()
+// has already found no other instance listening.
+void Server::Impl::init()
+{
+    socketPath = getSocketPath();
+    struct sockaddr_un addr;
+    if (!toSocketAddress(socketPath, addr))
+	return;
+
+    // Remove the socket only if it's left by an instance that crashed.
+    // Another one may have started listening since forward().
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+	return;
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+	    sizeof(addr)) == 0) {
+	close(fd);
+	return;
+    }
+    if (errno == ECONNREFUSED)
+	unlink(socketPath.c_str());
+    close(fd);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+	return;
+    if ((bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+		sizeof(addr)) != 0) ||
+	    (chmod(socketPath.c_str(), 0600) != 0) || (listen(fd, 16) != 0)) {
+	close(fd);
+	return;
+    }
+    listenFd = fd;
+    Glib::signal_io().connect(mem_fun(*this,
+	&Server::Impl::listenerOnAccept), listenFd, Glib::IO_IN);
+}
+
+// Execute the commands received from 'fd', and start sending the reply.
+// The connection is closed once it's sent.
+void Server::Impl::execute(int fd)
+{
+    const string request = requests[fd];
+    requests.erase(fd);
+
+    string reply;
+    string::size_type pos = 0;
+    while (pos < request.size()) {
+	auto eol = request.find('\n', pos);
+	if (eol == string::npos)
+	    eol = request.size();
+	const string command = request.substr(pos, eol - pos);
+	pos = eol + 1;
+	if (command.empty())
+	    continue;
+	auto result = commandMgr->execute(command);
+	reply += std::get<1>(result) + "\n";
+    }
+    windowMgr->present();
+
+    replies[fd] = reply;
+    Glib::signal_io().connect(sigc::bind(mem_fun(*this,
+	&Server::Impl::clientOnWrite), fd), fd, Glib::IO_OUT | Glib::IO_HUP);
+}
+
+//// event handlers ////
+
+bool Server::Impl::clientOnRead(Glib::IOCondition cond, int fd)
+{
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+	return true;
+    if (n > 0) {
+	requests[fd].append(buf, n);
+	if (requests[fd].size() <= MAX_REQUEST_SIZE)
+	    return true;
+	requests.erase(fd);
+	close(fd);
+	return false;
+    }
+
+    // End of the request.
+    if (n == 0)
+	execute(fd);
+    else {
+	requests.erase(fd);
+	close(fd);
+    }
+    return false;
+}
+
+// Send as much of the reply as the client takes without blocking.
+bool Server::Impl::clientOnWrite(Glib::IOCondition cond, int fd)
+{
+    string& reply = replies[fd];
+    while (!reply.empty()) {
+	ssize_t n = send(fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN)
+		return true;
+	    break;	// The client has gone away.
+	}
+	reply.erase(0, n);
+    }
+    replies.erase(fd);
+    close(fd);
+    return false;
+}
+
+bool Server::Impl::listenerOnAccept(Glib::IOCondition cond)
+{
+    int fd = accept4(listenFd, nullptr, nullptr,
+	SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+	return true;
+    if (!isOwnPeer(fd)) {
+	close(fd);
+	return true;
+    }
+    requests[fd] = "";
+    Glib::signal_io().connect(sigc::bind(mem_fun(*this,
+	&Server::Impl::clientOnRead), fd), fd, Glib::IO_IN | Glib::IO_HUP);
+    return true;
+}
+
+//// interface class ////
+
+Server::Server() : pimpl{new Impl{this}} {}
+Server::~Server() = default;
+void Server::init() { pimpl->init(); }
+
+// Hand 'commands' to the running instance, if any, and print its replies.
+// Called before GTK+ is initialized.
+// @return	true if there is a running instance
+bool Server::forward(const vector<string>& commands)
+{
+    struct sockaddr_un addr;
+    if (!toSocketAddress(getSocketPath(), addr))
+	return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+	return false;
+    if ((connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+		sizeof(addr)) != 0) || !isOwnPeer(fd)) {
+	close(fd);
+	return false;
+    }
+
+    string request;
+    for (const auto& c: commands)
+	request += c + "\n";
+    writeAll(fd, request);
+    shutdown(fd, SHUT_WR);
+
+    string reply;
+    char buf[4096];
+    ssize_t n;
+    while (((n = read(fd, buf, sizeof(buf))) > 0) ||
+	    ((n < 0) && (errno == EINTR))) {
+	if (n > 0)
+	    reply.append(buf, n);
+    }
+    close(fd);
+
+    string::size_type pos = 0;
+    while (pos < reply.size()) {
+	auto eol = reply.find('\n', pos);
+	if (eol == string::npos)
+	    eol = reply.size();
+	if (eol > pos)
+	    std::cerr << reply.substr(pos, eol - pos) << '\n';
+	pos = eol + 1;
+    }
+    return true;
+}
+
+// eof
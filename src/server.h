@@ -0,0 +1,27 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Single-instance mode.  The first myeditor listens on a per-user Unix
+// domain socket.  Later invocations hand their minibuffer commands to it
+// with forward() and exit, without initializing GTK+ at all.
+class Server
+{
+public:
+    Server();
+    virtual ~Server();
+    static bool forward(const std::vector<std::string>& commands);
+    void init();
+private:
+    Server(const Server&) = delete;	// copy ctor
+    Server(Server&&) = delete;
+    Server& operator=(const Server&) = delete;
+    Server& operator=(Server&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
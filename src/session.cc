@@ -0,0 +1,111 @@
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "global.h"
+#include "session.h"
+#include "util.h"
+
+using std::string;
+using std::vector;
+
+// Layout of the session file: MAGIC, the focused window (column and row,
+// u32 each), the number of columns (u32), then for each column the number
+// of its windows (u32) and the windows, then the number of hidden windows
+// (u32) and the windows.  A window is the length of its path (u32), the
+// path and the cursor offset (u32).  Integers are little-endian.
+static const string MAGIC{"myeditor-session 1\n"};
+
+static string getSessionPath()
+{
+    return Glib::get_home_dir() + "/.myeditor/session";
+}
+
+static void appendWindows(string& data, const vector<SessionWindow>& windows)
+{
+    appendUint(data, windows.size(), 4);
+    for (const auto& w: windows) {
+	appendUint(data, w.path.size(), 4);
+	data += w.path;
+	appendUint(data, w.cursorOffset, 4);
+    }
+}
+
+// @return	false if 'data' is truncated at 'pos'
+static bool readWindows(const string& data, string::size_type& pos,
+    vector<SessionWindow>& windows)
+{
+    if (pos + 4 > data.size())
+	return false;
+    auto numWindows = readUint(data.data() + pos, 4);
+    pos += 4;
+    for (uint64_t i = 0; i < numWindows; ++i) {
+	if (pos + 4 > data.size())
+	    return false;
+	auto length = readUint(data.data() + pos, 4);
+	pos += 4;
+	if (pos + length + 4 > data.size())
+	    return false;
+	SessionWindow w{data.substr(pos, length),
+	    static_cast<uint32_t>(readUint(data.data() + pos + length, 4))};
+	windows.push_back(w);
+	pos += length + 4;
+    }
+    return true;
+}
+
+// A broken session file is ignored as a whole.
+// @return	true if 'session' is read
+bool loadSession(Session& session)
+{
+    std::ifstream ifs{getSessionPath(), std::ios::in | std::ios::binary};
+    if (!ifs)
+	return false;
+    const string data{std::istreambuf_iterator<char>(ifs),
+	std::istreambuf_iterator<char>()};
+    if (data.compare(0, MAGIC.size(), MAGIC) != 0)
+	return false;
+
+    string::size_type pos = MAGIC.size();
+    if (pos + 12 > data.size())
+	return false;
+    session.focusColumn = readUint(data.data() + pos, 4);
+    session.focusRow = readUint(data.data() + pos + 4, 4);
+    auto numColumns = readUint(data.data() + pos + 8, 4);
+    pos += 12;
+    session.columns.clear();
+    for (uint64_t i = 0; i < numColumns; ++i) {
+	vector<SessionWindow> windows;
+	if (!readWindows(data, pos, windows) || windows.empty())
+	    return false;
+	session.columns.push_back(windows);
+    }
+    session.hidden.clear();
+    return readWindows(data, pos, session.hidden);
+}
+
+// Write to a temporary file and rename it, as Recents does.
+void saveSession(const Session& session)
+{
+    string data{MAGIC};
+    appendUint(data, session.focusColumn, 4);
+    appendUint(data, session.focusRow, 4);
+    appendUint(data, session.columns.size(), 4);
+    for (const auto& windows: session.columns)
+	appendWindows(data, windows);
+    appendWindows(data, session.hidden);
+
+    mkdir((Glib::get_home_dir() + "/.myeditor").c_str(), 0700);
+    const string sessionPath{getSessionPath()};
+    const string tmpPath{sessionPath + ".tmp"};
+    {
+	std::ofstream ofs{tmpPath, std::ios::out | std::ios::binary};
+	if (!ofs.write(data.data(), data.size()))
+	    return;
+    }
+    rename(tmpPath.c_str(), sessionPath.c_str());
+}
+
+// eof
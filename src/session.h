@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A window of the saved session; 'path' is empty for a ScratchWindow.
+struct SessionWindow
+{
+    std::string path;
+    uint32_t cursorOffset;
+};
+
+// The layout of the columns and the open files, saved at quit to
+// ~/.myeditor/session and restored at startup.
+struct Session
+{
+    std::vector<std::vector<SessionWindow>> columns;	// windows on screen
+    uint32_t focusColumn;
+    uint32_t focusRow;
+    std::vector<SessionWindow> hidden;	// rest of the history, newest first
+};
+
+bool loadSession(Session& session);
+void saveSession(const Session& session);
+
+// eof
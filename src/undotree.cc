@@ -0,0 +1,500 @@
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include <boost/optional.hpp>
+#include "undotree.h"
+#include "util.h"
+
+using std::make_shared;
+using std::map;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+using boost::optional;
+
+typedef UndoTree::Edit Edit;
+typedef UndoTree::NodeId NodeId;
+typedef UndoTree::size_type size_type;
+
+static const string MAGIC{"myeditor-undo 1"};
+static const NodeId NO_NODE = static_cast<NodeId>(-1);
+
+struct Node
+{
+    NodeId parent;	// NO_NODE for the root
+    vector<NodeId> children;	// old to new
+    NodeId redoChild;	// the branch visited last
+    // The edits are shared with the Snapshots being saved.  They are
+    // replaced rather than modified, except while not shared.
+    shared_ptr<vector<Edit>> edits;	// from the parent's state; or null
+    shared_ptr<const string> compressed;	// 'edits', compressed; or null
+    size_type rawSize;	// of the serialized 'edits', if compressed
+};
+
+static const vector<Edit> NO_EDITS;
+
+// The tree as of a save, for serializing it on a worker thread.
+struct UndoTree::Snapshot
+{
+    string etag;	// of the file it applies to
+    NodeId root;
+    NodeId current;
+    NodeId nextId;
+    map<NodeId, Node> nodes;
+};
+
+static string serializeEdits(const vector<Edit>& edits)
+{
+    string result;
+    for (const auto& e: edits) {
+	result += e.isInsert ? 'I' : 'E';
+	appendUint(result, e.charOffset, 8);
+	appendUint(result, e.text.size(), 8);
+	result += e.text;
+    }
+    return result;
+}
+
+static bool parseEdits(const char* p, size_type length, vector<Edit>& edits)
+{
+    const char* end = p + length;
+    while (p < end) {
+	if (end - p < 17)
+	    return false;
+	Edit e{p[0] == 'I', readUint(p + 1, 8), ""};
+	auto textLength = readUint(p + 9, 8);
+	p += 17;
+	if (static_cast<size_type>(end - p) < textLength)
+	    return false;
+	e.text.assign(p, textLength);
+	p += textLength;
+	edits.push_back(e);
+    }
+    return true;
+}
+
+//// impl class ////
+
+class UndoTree::Impl
+{
+public:
+    Impl(UndoTree* parent, size_type memoryLimit);
+    ~Impl() = default;
+    void beginGroup();
+    void endGroup();
+    NodeId getCurrent();
+    size_type getMemoryUsage();
+    void recordErase(size_type charOffset, const char* text, size_type length);
+    void recordInsert(size_type charOffset, const char* text, size_type length);
+    vector<Edit> redo();
+    vector<Edit> undo();
+    shared_ptr<Snapshot> takeSnapshot(const string& etag, NodeId current);
+    optional<string> deserialize(const string& data);
+
+    void commitGroup();
+    void compress(Node& node);
+    void enforceLimit();
+    const vector<Edit>& getEdits(Node& node);
+    static size_type nodeSize(const Node& node);
+    static string serialize(const Snapshot& snapshot);
+    void pruneRoot();
+    bool tryMerge();
+
+    UndoTree* tree;
+    map<NodeId, Node> nodes;	// ids are in chronological order
+    NodeId root;	// the oldest state we can go back to
+    NodeId current;
+    NodeId nextId;
+    NodeId compressedBelow;	// older nodes have been compressed
+    size_type memoryLimit;
+    size_type memoryUsage;
+    int groupDepth;
+    vector<Edit> group;	// the group being recorded
+    bool mergeable;	// the current node may absorb more typing
+};
+
+UndoTree::Impl::Impl(UndoTree* parent, size_type memoryLimit_)
+    : tree{parent}, root{0}, current{0}, nextId{1}, compressedBelow{0},
+      memoryLimit{memoryLimit_}, memoryUsage{0}, groupDepth{0},
+      mergeable{false}
+{
+    nodes[root] = Node{NO_NODE, vector<NodeId>(), NO_NODE, nullptr, nullptr,
+	0};
+    memoryUsage = nodeSize(nodes[root]);
+}
+
+// Edits between beginGroup() and endGroup() are undone as one.
+// Groups may nest; the outermost one counts.
+void UndoTree::Impl::beginGroup()
+{
+    ++groupDepth;
+}
+
+void UndoTree::Impl::endGroup()
+{
+    if ((groupDepth > 0) && (--groupDepth == 0))
+	commitGroup();
+}
+
+NodeId UndoTree::Impl::getCurrent()
+{
+    return current;
+}
+
+size_type UndoTree::Impl::getMemoryUsage()
+{
+    return memoryUsage;
+}
+
+void UndoTree::Impl::recordErase(size_type charOffset, const char* text,
+    size_type length)
+{
+    group.push_back(Edit{false, charOffset, string(text, length)});
+    if (groupDepth == 0)
+	commitGroup();
+}
+
+void UndoTree::Impl::recordInsert(size_type charOffset, const char* text,
+    size_type length)
+{
+    group.push_back(Edit{true, charOffset, string(text, length)});
+    if (groupDepth == 0)
+	commitGroup();
+}
+
+// @return	edits that bring the text to the next state
+vector<Edit> UndoTree::Impl::redo()
+{
+    Node& node = nodes[current];
+    if (node.children.empty())
+	return vector<Edit>();
+    current = (node.redoChild != NO_NODE) ?
+	node.redoChild : node.children.back();
+    mergeable = false;
+    return getEdits(nodes[current]);
+}
+
+// @return	edits that bring the text to the previous state
+vector<Edit> UndoTree::Impl::undo()
+{
+    if (current == root)
+	return vector<Edit>();
+    Node& node = nodes[current];
+    vector<Edit> result;
+    const vector<Edit>& edits = getEdits(node);
+    for (auto e = edits.rbegin(); e != edits.rend(); ++e)
+	result.push_back(Edit{!e->isInsert, e->charOffset, e->text});
+    nodes[node.parent].redoChild = current;
+    current = node.parent;
+    mergeable = false;
+    return result;
+}
+
+// Take the tree, with 'current' as the current node, for storing it on
+// disk along with the etag of the file it applies to.  Only the structure
+// is copied; the edits are shared, so this is cheap enough for every save.
+// @return	null if 'current' is no longer in the tree
+shared_ptr<UndoTree::Snapshot> UndoTree::Impl::takeSnapshot(
+    const string& etag, NodeId current_)
+{
+    if (nodes.find(current_) == end(nodes))
+	return nullptr;
+    return make_shared<Snapshot>(Snapshot{etag, root, current_, nextId,
+	nodes});
+}
+
+// Replace the tree with the serialized one in 'data'.
+// @return	etag of the file it applies to; none if 'data' is broken
+optional<string> UndoTree::Impl::deserialize(const string& data)
+{
+    auto nl1 = data.find('\n');
+    auto nl2 = (nl1 == string::npos) ? nl1 : data.find('\n', nl1 + 1);
+    if ((nl2 == string::npos) || (data.compare(0, nl1, MAGIC) != 0))
+	return optional<string>();
+    string etag = data.substr(nl1 + 1, nl2 - nl1 - 1);
+
+    const char* p = data.data() + nl2 + 1;
+    const char* end = data.data() + data.size();
+    if (end - p < 32)
+	return optional<string>();
+    NodeId newRoot = readUint(p, 8);
+    NodeId newCurrent = readUint(p + 8, 8);
+    NodeId newNextId = readUint(p + 16, 8);
+    auto numNodes = readUint(p + 24, 8);
+    p += 32;
+
+    map<NodeId, Node> newNodes;
+    for (size_type i = 0; i < numNodes; ++i) {
+	if (end - p < 40)
+	    return optional<string>();
+	NodeId id = readUint(p, 8);
+	Node node{readUint(p + 8, 8), vector<NodeId>(), readUint(p + 16, 8),
+	    nullptr, nullptr, readUint(p + 24, 8)};
+	auto length = readUint(p + 32, 8);
+	p += 40;
+	if (static_cast<size_type>(end - p) < length)
+	    return optional<string>();
+	if (node.rawSize > 0)
+	    node.compressed = make_shared<const string>(p, length);
+	else {
+	    node.edits = make_shared<vector<Edit>>();
+	    if (!parseEdits(p, length, *node.edits))
+		return optional<string>();
+	}
+	p += length;
+	newNodes[id] = node;
+    }
+
+    // Rebuild the children; ids are in chronological order.
+    for (auto& entry: newNodes) {
+	if (entry.second.parent == NO_NODE)
+	    continue;
+	auto parent = newNodes.find(entry.second.parent);
+	if ((parent == newNodes.end()) || (entry.second.parent >= entry.first))
+	    return optional<string>();
+	parent->second.children.push_back(entry.first);
+    }
+    if ((newNodes.find(newRoot) == newNodes.end()) ||
+	    (newNodes.find(newCurrent) == newNodes.end()))
+	return optional<string>();
+
+    nodes.swap(newNodes);
+    root = newRoot;
+    current = newCurrent;
+    nextId = newNextId;
+    compressedBelow = 0;
+    group.clear();
+    mergeable = false;
+    memoryUsage = 0;
+    for (const auto& entry: nodes)
+	memoryUsage += nodeSize(entry.second);
+    enforceLimit();
+    return optional<string>(etag);
+}
+
+void UndoTree::Impl::commitGroup()
+{
+    if (group.empty())
+	return;
+    const bool isTyping = (group.size() == 1) &&
+	(group[0].text.find('\n') == string::npos);
+
+    if (!tryMerge()) {
+	NodeId id = nextId++;
+	Node& parent = nodes[current];
+	memoryUsage -= nodeSize(parent);
+	parent.children.push_back(id);
+	parent.redoChild = id;
+	memoryUsage += nodeSize(parent);
+
+	Node node{current, vector<NodeId>(), NO_NODE,
+	    make_shared<vector<Edit>>(), nullptr, 0};
+	node.edits->swap(group);
+	memoryUsage += nodeSize(node);
+	nodes[id] = std::move(node);
+	current = id;
+    }
+    group.clear();
+    mergeable = isTyping;
+    enforceLimit();
+}
+
+void UndoTree::Impl::compress(Node& node)
+{
+    if (!node.edits || node.edits->empty() || node.compressed)
+	return;
+    string raw = serializeEdits(*node.edits);
+    uLongf length = compressBound(raw.size());
+    string buf(length, '\0');
+    if ((compress2(reinterpret_cast<Bytef*>(&buf[0]), &length,
+		reinterpret_cast<const Bytef*>(raw.data()), raw.size(),
+		Z_BEST_SPEED) != Z_OK) ||
+	    (length >= raw.size()))
+	return;	// not worth it
+
+    memoryUsage -= nodeSize(node);
+    buf.resize(length);
+    node.compressed = make_shared<const string>(std::move(buf));
+    node.rawSize = raw.size();
+    node.edits.reset();
+    memoryUsage += nodeSize(node);
+}
+
+// Compress the oldest entries, and drop them if that's not enough.
+// Going below the limit by a margin saves doing this at every edit.
+void UndoTree::Impl::enforceLimit()
+{
+    if (memoryUsage <= memoryLimit)
+	return;
+    const size_type target = memoryLimit / 4 * 3;
+
+    for (auto it = nodes.lower_bound(compressedBelow);
+	    (it != nodes.end()) && (memoryUsage > target); ++it) {
+	if (it->first == current)
+	    continue;	// Typing goes there.
+	compress(it->second);
+	compressedBelow = it->first + 1;
+    }
+    while ((memoryUsage > target) && (root != current))
+	pruneRoot();
+}
+
+const vector<Edit>& UndoTree::Impl::getEdits(Node& node)
+{
+    if (node.compressed) {
+	string raw(node.rawSize, '\0');
+	uLongf length = node.rawSize;
+	vector<Edit> edits;
+	if ((uncompress(reinterpret_cast<Bytef*>(&raw[0]), &length,
+		    reinterpret_cast<const Bytef*>(node.compressed->data()),
+		    node.compressed->size()) == Z_OK) &&
+		parseEdits(raw.data(), length, edits)) {
+	    memoryUsage -= nodeSize(node);
+	    node.edits = make_shared<vector<Edit>>(std::move(edits));
+	    node.compressed.reset();
+	    node.rawSize = 0;
+	    memoryUsage += nodeSize(node);
+	}
+    }
+    return node.edits ? *node.edits : NO_EDITS;
+}
+
+size_type UndoTree::Impl::nodeSize(const Node& node)
+{
+    size_type result = sizeof(Node) + node.children.size() * sizeof(NodeId) +
+	(node.compressed ? node.compressed->size() : 0);
+    if (node.edits) {
+	for (const auto& e: *node.edits)
+	    result += sizeof(Edit) + e.text.size();
+    }
+    return result;
+}
+
+// Forget the oldest state.  The child of the root on the way to the
+// current node becomes the new root; the other branches are dropped.
+void UndoTree::Impl::pruneRoot()
+{
+    NodeId newRoot = current;
+    while (nodes[newRoot].parent != root)
+	newRoot = nodes[newRoot].parent;
+
+    vector<NodeId> doomed{root};
+    for (auto child: nodes[root].children) {
+	if (child != newRoot)
+	    doomed.push_back(child);
+    }
+    while (!doomed.empty()) {
+	NodeId id = doomed.back();
+	doomed.pop_back();
+	Node& node = nodes[id];
+	if (id != root)
+	    doomed.insert(doomed.end(), node.children.begin(),
+		node.children.end());
+	memoryUsage -= nodeSize(node);
+	nodes.erase(id);
+    }
+
+    Node& node = nodes[newRoot];
+    memoryUsage -= nodeSize(node);
+    node.parent = NO_NODE;
+    node.edits.reset();
+    node.compressed.reset();
+    node.rawSize = 0;
+    memoryUsage += nodeSize(node);
+    root = newRoot;
+}
+
+// Runs on a worker thread.
+string UndoTree::Impl::serialize(const Snapshot& snapshot)
+{
+    string result{MAGIC + '\n' + snapshot.etag + '\n'};
+    appendUint(result, snapshot.root, 8);
+    appendUint(result, snapshot.current, 8);
+    appendUint(result, snapshot.nextId, 8);
+    appendUint(result, snapshot.nodes.size(), 8);
+    for (const auto& entry: snapshot.nodes) {
+	const Node& node = entry.second;
+	appendUint(result, entry.first, 8);
+	appendUint(result, node.parent, 8);
+	appendUint(result, node.redoChild, 8);
+	if (!node.compressed) {
+	    string raw = node.edits ? serializeEdits(*node.edits) : "";
+	    appendUint(result, 0, 8);
+	    appendUint(result, raw.size(), 8);
+	    result += raw;
+	} else {
+	    appendUint(result, node.rawSize, 8);
+	    appendUint(result, node.compressed->size(), 8);
+	    result += *node.compressed;
+	}
+    }
+    return result;
+}
+
+// Typing and deleting characters one by one are undone as a whole,
+// until a newline.
+bool UndoTree::Impl::tryMerge()
+{
+    if (!mergeable || (group.size() != 1))
+	return false;
+    Node& node = nodes[current];
+    if (!node.children.empty() || !node.edits || (node.edits->size() != 1))
+	return false;
+    if (node.edits.use_count() > 1)	// being saved; leave that copy alone
+	node.edits = make_shared<vector<Edit>>(*node.edits);
+    Edit& last = (*node.edits)[0];
+    const Edit& e = group[0];
+    if ((e.isInsert != last.isInsert) || (e.text.find('\n') != string::npos))
+	return false;
+
+    memoryUsage -= nodeSize(node);
+    bool merged = true;
+    if (e.isInsert && (e.charOffset == last.charOffset +
+	    utf8CharCount(last.text.data(), last.text.size())))
+	last.text += e.text;
+    else if (!e.isInsert && (e.charOffset == last.charOffset))
+	last.text += e.text;	// delete forward
+    else if (!e.isInsert && (e.charOffset +
+	    utf8CharCount(e.text.data(), e.text.size()) == last.charOffset)) {
+	last.text.insert(0, e.text);	// backspace
+	last.charOffset = e.charOffset;
+    }
+    else merged = false;
+    memoryUsage += nodeSize(node);
+    return merged;
+}
+
+//// interface class ////
+
+UndoTree::UndoTree(size_type memoryLimit)
+    : pimpl{new Impl{this, memoryLimit}} {}
+UndoTree::~UndoTree() = default;
+void UndoTree::beginGroup() { pimpl->beginGroup(); }
+void UndoTree::endGroup() { pimpl->endGroup(); }
+NodeId UndoTree::getCurrent() { return pimpl->getCurrent(); }
+size_type UndoTree::getMemoryUsage() { return pimpl->getMemoryUsage(); }
+void UndoTree::recordErase(size_type charOffset, const char* text,
+	size_type length) {
+    pimpl->recordErase(charOffset, text, length);
+}
+void UndoTree::recordInsert(size_type charOffset, const char* text,
+	size_type length) {
+    pimpl->recordInsert(charOffset, text, length);
+}
+vector<Edit> UndoTree::redo() { return pimpl->redo(); }
+vector<Edit> UndoTree::undo() { return pimpl->undo(); }
+shared_ptr<UndoTree::Snapshot> UndoTree::takeSnapshot(const string& etag,
+	NodeId current) {
+    return pimpl->takeSnapshot(etag, current);
+}
+string UndoTree::serialize(const Snapshot& snapshot) {
+    return Impl::serialize(snapshot);
+}
+optional<string> UndoTree::deserialize(const string& data) {
+    return pimpl->deserialize(data);
+}
+
+// eof
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/optional.hpp>
+
+// Undo history of a File, as a tree: making an edit after undoing starts
+// a new branch rather than throwing the undone edits away.  Redo follows
+// the branch visited last.
+// The history is kept within a memory limit: old entries are compressed
+// first, and the oldest are dropped only if that isn't enough.
+class UndoTree
+{
+public:
+    typedef std::string::size_type size_type;
+    typedef unsigned long NodeId;
+
+    // An edit, or its inverse.  Offsets are in characters.
+    struct Edit
+    {
+	bool isInsert;
+	size_type charOffset;
+	std::string text;	// inserted or erased text
+    };
+
+    explicit UndoTree(size_type memoryLimit);
+    virtual ~UndoTree();
+    void beginGroup();
+    void endGroup();
+    NodeId getCurrent();
+    size_type getMemoryUsage();
+    void recordErase(size_type charOffset, const char* text, size_type length);
+    void recordInsert(size_type charOffset, const char* text, size_type length);
+    std::vector<Edit> redo();
+    std::vector<Edit> undo();
+
+    // The tree as of a save, to be serialized on a worker thread.
+    struct Snapshot;
+    std::shared_ptr<Snapshot> takeSnapshot(const std::string& etag,
+	NodeId current);
+    static std::string serialize(const Snapshot& snapshot);
+    boost::optional<std::string> deserialize(const std::string& data);
+private:
+    UndoTree(const UndoTree&) = delete;	// copy ctor
+    UndoTree(UndoTree&&) = delete;
+    UndoTree& operator=(const UndoTree&) = delete;
+    UndoTree& operator=(UndoTree&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof
@@ -1,12 +1,22 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <string>
 #include "global.h"
 #include "util.h"
 
 using std::string;
 
+// Glib::get_home_dir() builds a new string every time.
+static const string& getHomeDir()
+{
+    static const string home{Glib::get_home_dir()};
+    return home;
+}
+
 string entilde(const string& path)
 {
-    const string home = Glib::get_home_dir();
+    const string& home = getHomeDir();
 
     if (path.find(home) != 0)
 	return path;
@@ -18,9 +28,112 @@ string toFullPath(const string& basedir, const string& path)
     if (path.find('/') == 0)
 	return path;
     if (path.find('~') == 0)
-	return Glib::get_home_dir() + path.substr(1);
+	return getHomeDir() + path.substr(1);
     return Gio::File::create_for_path(basedir)->resolve_relative_path(path)->
 	get_path();
 }
 
+// Append 'value' to 'out' as a little-endian integer of numBytes bytes.
+void appendUint(string& out, uint64_t value, int numBytes)
+{
+    for (int i = 0; i < numBytes; ++i)
+	out += static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+// A fast hash of 'data', for telling whether contents have changed.
+// It takes 8 bytes a step; not for anything adversarial.
+uint64_t hashBytes(const char* data, string::size_type length)
+{
+    const uint64_t K = 0x9E3779B97F4A7C15ull;
+    uint64_t h = length * K;
+    string::size_type i = 0;
+    for (; i + 8 <= length; i += 8) {
+	uint64_t word;
+	memcpy(&word, data + i, 8);
+	h = (h ^ word) * K;
+	h ^= h >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, length - i);
+    h = (h ^ tail) * K;
+    return h ^ (h >> 32);
+}
+
+// Return a hash of 'path', for naming files in ~/.myeditor/ after it.
+string hashPath(const string& path)
+{
+    uint64_t h = 14695981039346656037ull;	// FNV-1a
+    for (char c: path) {
+	h ^= static_cast<unsigned char>(c);
+	h *= 1099511628211ull;
+    }
+    char result[17];
+    snprintf(result, sizeof(result), "%016llx",
+	static_cast<unsigned long long>(h));
+    return result;
+}
+
+// Read a little-endian integer of numBytes bytes.
+uint64_t readUint(const char* p, int numBytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < numBytes; ++i)
+	value |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) <<
+	    (8 * i);
+    return value;
+}
+
+// Return the byte offset of the numChars-th character in 'text'.
+string::size_type utf8ByteOffset(const char* text, string::size_type length,
+    string::size_type numChars)
+{
+    string::size_type i = 0;
+    for (; i < length; ++i) {
+	if ((static_cast<unsigned char>(text[i]) & 0xC0) == 0x80)
+	    continue;	// continuation byte
+	if (numChars == 0)
+	    return i;
+	--numChars;
+    }
+    return length;
+}
+
+string::size_type utf8CharCount(const char* text, string::size_type length)
+{
+    string::size_type result = 0;
+    for (string::size_type i = 0; i < length; ++i) {
+	if ((static_cast<unsigned char>(text[i]) & 0xC0) != 0x80)
+	    ++result;
+    }
+    return result;
+}
+
+// Return the length of the longest prefix of 'text' that doesn't end in
+// the middle of a UTF-8 sequence.
+string::size_type utf8CompleteLength(const string& text)
+{
+    return utf8CompleteLength(text.data(), text.size());
+}
+
+string::size_type utf8CompleteLength(const char* text,
+    string::size_type length)
+{
+    auto i = length;
+    unsigned int numContinuations = 0;
+    while ((i > 0) && (numContinuations < 4) &&
+	    ((static_cast<unsigned char>(text[i - 1]) & 0xC0) == 0x80)) {
+	--i;
+	++numContinuations;
+    }
+    if (i == 0)
+	return length;	// not UTF-8 anyway
+
+    auto lead = static_cast<unsigned char>(text[i - 1]);
+    unsigned int seqLen = (lead >= 0xF0) ? 4 : (lead >= 0xE0) ? 3 :
+	(lead >= 0xC0) ? 2 : 1;
+    if (numContinuations + 1 < seqLen)
+	return i - 1;	// The last sequence is incomplete.
+    return length;
+}
+
 // eof
@@ -1,6 +1,18 @@
+#include <cstdint>
 #include <string>
 
 std::string toFullPath(const std::string& basedir, const std::string& path);
 std::string entilde(const std::string& path);
+void appendUint(std::string& out, uint64_t value, int numBytes);
+uint64_t hashBytes(const char* data, std::string::size_type length);
+std::string hashPath(const std::string& path);
+uint64_t readUint(const char* p, int numBytes);
+std::string::size_type utf8ByteOffset(const char* text,
+    std::string::size_type length, std::string::size_type numChars);
+std::string::size_type utf8CharCount(const char* text,
+    std::string::size_type length);
+std::string::size_type utf8CompleteLength(const char* text,
+    std::string::size_type length);
+std::string::size_type utf8CompleteLength(const std::string& text);
 
 // eof
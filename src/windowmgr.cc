@@ -8,7 +8,9 @@
 #include "editwindow.h"
 #include "filemgr.h"
 #include "filewindow.h"
+#include "pathtable.h"
 #include "scratchwindow.h"
+#include "session.h"
 #include "windowmgr.h"
 
 using std::deque;
@@ -18,6 +20,34 @@ using std::vector;
 using boost::optional;
 using sigc::mem_fun;
 
+static SessionWindow toSessionWindow(EditWindow* ew)
+{
+    if (typeid(*ew) != typeid(FileWindow))
+	return SessionWindow{"", 0};
+    auto fw = static_cast<FileWindow*>(ew);
+    return SessionWindow{pathTable->getFullPath(fw->getFileId()),
+	static_cast<uint32_t>(fw->getCursorOffset())};
+}
+
+// Create a window for 'sw' on screen.  A File that cannot be opened
+// gets a ScratchWindow instead.
+static EditWindow* newSessionWindow(const SessionWindow& sw)
+{
+    optional<shared_ptr<File>> f;
+    if (!sw.path.empty())
+	f = fileMgr->getFile(sw.path);
+    if (!f) {
+	auto scratch = manage(new ScratchWindow());
+	scratch->init();
+	return scratch;
+    }
+    auto fw = manage(new FileWindow());
+    fw->init();
+    fw->setFile(*f);
+    (*f)->placeCursor(sw.cursorOffset);
+    return fw;
+}
+
 //// impl class ////
 
 class WindowMgr::Impl
@@ -37,15 +67,19 @@ public:
     EditWindow* getCurrentFocus();
     optional<EditWindow*> getEditWindow(const EditWindowPos& pos);
     optional<EditWindowPos> getEditWindowPosition(const EditWindow* ew);
+    optional<FileWindow*> findFileWindow(FileId id);
     optional<FileWindow*> getFileWindow(const std::string& path,
 	bool createIfNecessary=false);
     unsigned int getNumColumns();
     optional<ScratchWindow*> getScratchWindow(bool createIfNecessary=false);
+    bool holdsFile(FileId id);
     void moveWindow(EditWindow* ew, EditWindow* sibling);
     EditWindow* newColumn(optional<EditWindow*> opt_ew);
     void replaceWindow(EditWindow* oldEW, EditWindow* newEW);
+    void restoreSession();
+    void saveSession();
     void setEntryPlaceholderText(const string& msg);
-    void setFrontEditWindow(EditWindow* ew);
+    EditWindow* setFrontEditWindow(EditWindow* ew);
     void splitWindow(EditWindow& ew);
 
     void entryOnActivate();
@@ -168,12 +202,20 @@ void WindowMgr::Impl::bubble()
 	    EditWindow* originalEW = editWindowHistory->at(1);
 	    replaceWindow(currentEW, originalEW);
 	}
+	setFrontEditWindow(nextEW);
     } else {
+	// A window restored from the session opens its File before it's
+	// shown.  One that cannot is gone; bubble on past it.
+	if (!setFrontEditWindow(nextEW)) {
+	    deleteFromHistory(currentEW);
+	    editWindowHistory->push_front(currentEW);
+	    bubble();
+	    return;
+	}
 	EditWindow* ewToBeReplaced = *(getEditWindow(bubblePos));
-	replaceWindow(ewToBeReplaced, nextEW);
+	replaceWindow(ewToBeReplaced, nextEW);	// This puts it to front.
     }
     nextEW->grabFocus();
-    setFrontEditWindow(nextEW);
 
     // Update lastOp for both EditWindows.
     currentEW->setBubbleNumber(0);
@@ -287,13 +329,40 @@ optional<EditWindowPos> WindowMgr::Impl::getEditWindowPosition(
     return optional<EditWindowPos>();
 }
 
+optional<FileWindow*> WindowMgr::Impl::findFileWindow(FileId id)
+{
+    for (unsigned int colIndex = 0; colIndex < getNumColumns(); ++colIndex) {
+	auto opt_fw = getColumn(colIndex)->getFileWindow(id);
+	if (opt_fw)
+	    return opt_fw;
+    }
+    return optional<FileWindow*>();
+}
+
+// @return	true if a FileWindow on screen or in the history holds the
+//		File 'id'.  A deferred FileWindow holds none.
+bool WindowMgr::Impl::holdsFile(FileId id)
+{
+    if (findFileWindow(id))
+	return true;
+    for (auto ew: *editWindowHistory) {
+	if (typeid(*ew) != typeid(FileWindow))
+	    continue;
+	auto f = static_cast<FileWindow*>(ew)->getFile();
+	if (f && (f->getId() == id))
+	    return true;
+    }
+    return false;
+}
+
 optional<FileWindow*> WindowMgr::Impl::getFileWindow(const string& path,
     bool createIfNecessary)
 {
     // If any column contains a FileWindow for 'path', return it.
-    for (unsigned int colIndex = 0; colIndex < getNumColumns(); ++colIndex) {
-	Column& c = *getColumn(colIndex);
-	auto opt_fw = c.getFileWindow(path);
+    // A path never interned has never been opened.
+    auto id = pathTable->find(path);
+    if (id) {
+	auto opt_fw = findFileWindow(*id);
 	if (opt_fw)
 	    return opt_fw;
     }
@@ -301,12 +370,17 @@ optional<FileWindow*> WindowMgr::Impl::getFileWindow(const string& path,
     if (!createIfNecessary)
 	return optional<FileWindow*>();
 
-    // Create a new EditWindow and return it.
-    FileWindow* new_fw = manage(new FileWindow());
-    new_fw->init();
     optional<shared_ptr<File>> f = fileMgr->getFile(path);
     if (!f)
 	return optional<FileWindow*>();	// error: file cannot be read
+    // 'path' may be an alias of a File already shown.
+    auto opt_fw = findFileWindow((*f)->getId());
+    if (opt_fw)
+	return opt_fw;
+
+    // Create a new EditWindow and return it.
+    FileWindow* new_fw = manage(new FileWindow());
+    new_fw->init();
     new_fw->setFile(*f);
     replaceWindow(getCurrentFocus(), new_fw);
     return optional<FileWindow*>(new_fw);
@@ -384,15 +458,105 @@ void WindowMgr::Impl::replaceWindow(EditWindow* oldEW, EditWindow* newEW)
     wm->show_all_children();
 }
 
+// Only the windows on screen open their Files now.  The rest of the
+// history gets FileWindows whose Files are opened when brought to front;
+// see setFrontEditWindow().
+void WindowMgr::Impl::restoreSession()
+{
+    Session session;
+    if (!loadSession(session) || session.columns.empty())
+	return;
+
+    for (unsigned int colIndex = 0; colIndex < session.columns.size();
+	    ++colIndex) {
+	// Replacing and appending windows put them to front; adding one
+	// doesn't.  Either may leave a ScratchWindow in place of 'ew'.
+	EditWindow* sibling = nullptr;
+	for (const auto& sw: session.columns[colIndex]) {
+	    EditWindow* ew = newSessionWindow(sw);
+	    if (!sibling && (colIndex == 0)) {
+		// Replace the initial ScratchWindow.
+		Column& c = *getColumn(0);
+		c.replaceWindow(*c.getEditWindow(0), ew);
+		sibling = *c.getEditWindow(0);
+	    }
+	    else if (!sibling) {
+		newColumn(optional<EditWindow*>(ew));
+		sibling = *getColumn(colIndex)->getEditWindow(0);
+	    }
+	    else {
+		getColumn(colIndex)->addWindow(*ew, *sibling);
+		sibling = setFrontEditWindow(ew);
+	    }
+	}
+    }
+
+    for (const auto& sw: session.hidden) {
+	auto fw = manage(new FileWindow());
+	fw->init();
+	fw->setDeferredFile(pathTable->intern(sw.path), sw.cursorOffset);
+	editWindowHistory->push_back(fw);
+    }
+
+    wm->show_all_children();
+    auto focus = getEditWindow(
+	EditWindowPos(session.focusColumn, session.focusRow));
+    if (focus) {
+	(*focus)->grabFocus();
+	setFrontEditWindow(*focus);
+    }
+}
+
+void WindowMgr::Impl::saveSession()
+{
+    Session session{{}, 0, 0, {}};
+    for (unsigned int colIndex = 0; colIndex < getNumColumns(); ++colIndex) {
+	vector<SessionWindow> windows;
+	Column& c = *getColumn(colIndex);
+	for (unsigned int rowNum = 0; c.getEditWindow(rowNum); ++rowNum)
+	    windows.push_back(toSessionWindow(*c.getEditWindow(rowNum)));
+	session.columns.push_back(windows);
+    }
+    auto focusPos = getEditWindowPosition(getCurrentFocus());
+    if (focusPos) {
+	session.focusColumn = std::get<0>(*focusPos);
+	session.focusRow = std::get<1>(*focusPos);
+    }
+    for (auto ew: *editWindowHistory) {
+	if ((typeid(*ew) == typeid(FileWindow)) && !getEditWindowPosition(ew))
+	    session.hidden.push_back(toSessionWindow(ew));
+    }
+    ::saveSession(session);
+}
+
 void WindowMgr::Impl::setEntryPlaceholderText(const string& msg)
 {
     entry.set_placeholder_text(msg);
 }
 
 // Update editWindowHistory and window's title.
+// A window restored from the session opens its File now.  If it cannot,
+// the window is freed, and a ScratchWindow takes its place if it's on
+// screen.
 // Note: This doesn't do grab_focus() for the EditWindow.
-void WindowMgr::Impl::setFrontEditWindow(EditWindow* ew)
+// @return	the window now at front: 'ew' or the ScratchWindow; null if
+//		'ew' was not on screen and is gone
+EditWindow* WindowMgr::Impl::setFrontEditWindow(EditWindow* ew)
 {
+    if ((typeid(*ew) == typeid(FileWindow)) &&
+	    !static_cast<FileWindow*>(ew)->loadDeferredFile()) {
+	deleteFromHistory(ew);
+	ScratchWindow* scratch = nullptr;
+	auto pos = getEditWindowPosition(ew);
+	if (pos) {
+	    scratch = manage(new ScratchWindow());
+	    scratch->init();
+	    getColumn(std::get<0>(*pos))->replaceWindow(ew, scratch);
+	}
+	delete ew;
+	return scratch;
+    }
+
     // Delete ew and any ScratchWindow from editWindowHistory.
     editWindowHistory->erase(
 	std::remove_if(begin(*editWindowHistory), end(*editWindowHistory),
@@ -404,6 +568,7 @@ void WindowMgr::Impl::setFrontEditWindow(EditWindow* ew)
 
     editWindowHistory->push_front(ew);
     wm->set_title(ew->shortDesc() + " - myeditor");
+    return ew;
 }
 
 void WindowMgr::Impl::splitWindow(EditWindow& ew)
@@ -470,6 +635,7 @@ bool WindowMgr::Impl::entryOnKeyPress(GdkEventKey* ev)
 
 bool WindowMgr::Impl::windowOnDelete(GdkEventAny* ev)
 {
+    saveSession();
     fileMgr->cleanup();
     return false;
 }
@@ -496,6 +662,9 @@ optional<EditWindowPos> WindowMgr::getEditWindowPosition(
     return pimpl->getEditWindowPosition(ew);
 }
 
+optional<FileWindow*> WindowMgr::findFileWindow(FileId id) {
+    return pimpl->findFileWindow(id);
+}
 optional<FileWindow*> WindowMgr::getFileWindow(const string& path,
 	bool createIfNecessary) {
     return pimpl->getFileWindow(path, createIfNecessary);
@@ -503,6 +672,7 @@ optional<FileWindow*> WindowMgr::getFileWindow(const string& path,
 optional<ScratchWindow*> WindowMgr::getScratchWindow(bool createIfNecessary) {
     return pimpl->getScratchWindow(createIfNecessary);
 }
+bool WindowMgr::holdsFile(FileId id) { return pimpl->holdsFile(id); }
 void WindowMgr::moveWindow(EditWindow* ew, EditWindow* sibling) {
     pimpl->moveWindow(ew, sibling);
 }
@@ -512,12 +682,14 @@ EditWindow* WindowMgr::newColumn(optional<EditWindow*> opt_ew) {
 void WindowMgr::replaceWindow(EditWindow* oldEW, EditWindow* newEW) {
     pimpl->replaceWindow(oldEW, newEW);
 }
+void WindowMgr::restoreSession() { pimpl->restoreSession(); }
+void WindowMgr::saveSession() { pimpl->saveSession(); }
 void WindowMgr::splitWindow(EditWindow& ew) { pimpl->splitWindow(ew); }
 void WindowMgr::setEntryPlaceholderText(const string& msg) {
     pimpl->setEntryPlaceholderText(msg);
 }
-void WindowMgr::setFrontEditWindow(EditWindow* ew) {
-    pimpl->setFrontEditWindow(ew);
+EditWindow* WindowMgr::setFrontEditWindow(EditWindow* ew) {
+    return pimpl->setFrontEditWindow(ew);
 }
 
 // eof
@@ -25,16 +25,20 @@ public:
     Column& getCurrentColumn();
     EditWindow* getCurrentFocus();
     boost::optional<EditWindowPos> getEditWindowPosition(const EditWindow* ew);
+    boost::optional<FileWindow*> findFileWindow(FileId id);
     boost::optional<FileWindow*> getFileWindow(const std::string& path,
 	bool createIfNecessary=false);
     boost::optional<ScratchWindow*> getScratchWindow(
 	bool createIfNecessary=false);
+    bool holdsFile(FileId id);
     void moveWindow(EditWindow* ew, EditWindow* sibling);
     EditWindow* newColumn(boost::optional<EditWindow*> opt_ew);
     void replaceWindow(EditWindow* oldEW, EditWindow* newEW);
+    void restoreSession();
+    void saveSession();
     void splitWindow(EditWindow& ew);
     void setEntryPlaceholderText(const std::string& msg);
-    void setFrontEditWindow(EditWindow* ew);
+    EditWindow* setFrontEditWindow(EditWindow* ew);
 private:
     WindowMgr(const WindowMgr&) = delete;	// copy ctor
     WindowMgr(WindowMgr&&) = delete;
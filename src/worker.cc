@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "global.h"
+#include "worker.h"
+
+using std::deque;
+using std::mutex;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+using sigc::mem_fun;
+
+// How long the main loop may spend on queued callbacks per idle slot.
+static const auto MAIN_LOOP_BUDGET = std::chrono::milliseconds(8);
+
+//// impl class ////
+
+class WorkerPool::Impl
+{
+public:
+    Impl(WorkerPool* parent);
+    ~Impl();
+    void init(unsigned int numThreads);
+    void post(const Job& job);
+    void postToMain(const Job& callback);
+    unsigned int size();
+    void workerLoop();
+
+    void dispatcherOnEmit();
+    bool mainLoopOnIdle();
+
+    WorkerPool* wp;
+    vector<thread> threads;
+    deque<Job> jobs;	// to be run on worker threads
+    mutex jobsMutex;
+    std::condition_variable jobsCond;
+    bool stopping;
+    deque<Job> mainJobs;	// to be run on the main loop
+    mutex mainJobsMutex;
+    Glib::Dispatcher dispatcher;	// wakes up the main loop
+    bool idleScheduled;	// main thread only
+};
+
+WorkerPool::Impl::Impl(WorkerPool* parent)
+    : wp{parent}, stopping{false}, idleScheduled{false}
+{
+    dispatcher.connect(mem_fun(*this, &WorkerPool::Impl::dispatcherOnEmit));
+}
+
+WorkerPool::Impl::~Impl()
+{
+    {
+	std::lock_guard<mutex> lock(jobsMutex);
+	stopping = true;
+    }
+    jobsCond.notify_all();
+    for (auto& t: threads)
+	t.join();
+}
+
+void WorkerPool::Impl::init(unsigned int numThreads)
+{
+    if (numThreads == 0)
+	numThreads = std::max(2u, thread::hardware_concurrency());
+    for (unsigned int i = 0; i < numThreads; ++i)
+	threads.emplace_back(&WorkerPool::Impl::workerLoop, this);
+}
+
+void WorkerPool::Impl::post(const Job& job)
+{
+    {
+	std::lock_guard<mutex> lock(jobsMutex);
+	jobs.push_back(job);
+    }
+    jobsCond.notify_one();
+}
+
+// May be called from any thread.
+void WorkerPool::Impl::postToMain(const Job& callback)
+{
+    bool wasEmpty;
+    {
+	std::lock_guard<mutex> lock(mainJobsMutex);
+	wasEmpty = mainJobs.empty();
+	mainJobs.push_back(callback);
+    }
+    // Emit only on the empty -> non-empty transition, so that a burst of
+    // callbacks doesn't fill up the dispatcher's pipe.
+    if (wasEmpty)
+	dispatcher.emit();
+}
+
+unsigned int WorkerPool::Impl::size()
+{
+    return threads.size();
+}
+
+void WorkerPool::Impl::workerLoop()
+{
+    for (;;) {
+	Job job;
+	{
+	    unique_lock<mutex> lock(jobsMutex);
+	    jobsCond.wait(lock, [this]() { return stopping || !jobs.empty(); });
+	    if (stopping)
+		return;
+	    job = std::move(jobs.front());
+	    jobs.pop_front();
+	}
+	job();
+    }
+}
+
+//// event handlers ////
+
+void WorkerPool::Impl::dispatcherOnEmit()
+{
+    // Run the callbacks at idle priority, i.e. after pending redraws.
+    if (idleScheduled)
+	return;
+    idleScheduled = true;
+    Glib::signal_idle().connect(mem_fun(*this,
+	&WorkerPool::Impl::mainLoopOnIdle));
+}
+
+bool WorkerPool::Impl::mainLoopOnIdle()
+{
+    auto deadline = std::chrono::steady_clock::now() + MAIN_LOOP_BUDGET;
+    for (;;) {
+	Job callback;
+	{
+	    std::lock_guard<mutex> lock(mainJobsMutex);
+	    if (mainJobs.empty()) {
+		idleScheduled = false;
+		return false;	// Disconnect; the dispatcher will reconnect.
+	    }
+	    callback = std::move(mainJobs.front());
+	    mainJobs.pop_front();
+	}
+	callback();
+	if (std::chrono::steady_clock::now() >= deadline)
+	    return true;	// Let the main loop breathe; continue later.
+    }
+}
+
+//// interface class ////
+
+WorkerPool::WorkerPool() : pimpl{new Impl{this}} {}
+WorkerPool::~WorkerPool() = default;
+void WorkerPool::init(unsigned int numThreads) { pimpl->init(numThreads); }
+void WorkerPool::post(const Job& job) { pimpl->post(job); }
+void WorkerPool::postToMain(const Job& callback) {
+    pimpl->postToMain(callback);
+}
+unsigned int WorkerPool::size() { return pimpl->size(); }
+
+// eof
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+
+// A small pool of background threads.
+// Jobs posted with post() run on a worker thread; callbacks posted with
+// postToMain() run on the GTK main loop, a few at a time, at idle priority
+// so that redraws and key events are never starved.
+class WorkerPool
+{
+public:
+    typedef std::function<void()> Job;
+    // using Job = std::function<void()>;
+
+    WorkerPool();
+    virtual ~WorkerPool();
+    void init(unsigned int numThreads=0);
+    void post(const Job& job);
+    void postToMain(const Job& callback);
+    unsigned int size();
+private:
+    WorkerPool(const WorkerPool&) = delete;	// copy ctor
+    WorkerPool(WorkerPool&&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    WorkerPool& operator=(WorkerPool&&) = delete;
+
+    class Impl;
+    const std::unique_ptr<Impl> pimpl;
+};
+
+// eof